@@ -19,66 +19,14 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include <errno.h>
 #include <libhexagonrpc/fastrpc.h>
-#include <libhexagonrpc/interfaces/remotectl.def>
+#include <libhexagonrpc/remotectl.h>
 #include <libhexagonrpc/session.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 
 #include "interfaces/chre_slpi.def"
 
-/* TODO move these to libhexagonrpc since most clients use them */
-static int remotectl_open(int fd, char *name, struct fastrpc_context **ctx, void (*err_cb)(const char *err))
-{
-	uint32_t handle;
-	int32_t dlret;
-	char err[256];
-	int ret;
-
-	ret = fastrpc2(&remotectl_open_def, fd, REMOTECTL_HANDLE,
-		       strlen(name) + 1, name,
-		       &handle,
-		       &dlret,
-		       256, err);
-
-	if (ret == -1) {
-		err_cb(strerror(errno));
-		return ret;
-	}
-
-	if (dlret == -5) {
-		err_cb(err);
-		return dlret;
-	}
-
-	*ctx = fastrpc_create_context(fd, handle);
-
-	return ret;
-}
-
-static int remotectl_close(struct fastrpc_context *ctx, void (*err_cb)(const char *err))
-{
-	uint32_t dlret;
-	char err[256];
-	int ret;
-
-	ret = fastrpc2(&remotectl_close_def, ctx->fd, REMOTECTL_HANDLE,
-		       ctx->handle,
-		       &dlret,
-		       256, err);
-
-	if (ret == -1) {
-		err_cb(strerror(errno));
-		return ret;
-	}
-
-	fastrpc_destroy_context(ctx);
-
-	return ret;
-}
-
 static void remotectl_err(const char *err)
 {
 	fprintf(stderr, "Could not remotectl: %s\n", err);
@@ -86,12 +34,12 @@ static void remotectl_err(const char *err)
 
 static int chre_slpi_start_thread(struct fastrpc_context *ctx)
 {
-	return fastrpc(&chre_slpi_start_thread_def, ctx);
+	return chre_slpi_start_thread_invoke(ctx->fd, ctx->handle, NULL);
 }
 
 static int chre_slpi_wait_on_thread_exit(struct fastrpc_context *ctx)
 {
-	return fastrpc(&chre_slpi_wait_on_thread_exit_def, ctx);
+	return chre_slpi_wait_on_thread_exit_invoke(ctx->fd, ctx->handle, NULL);
 }
 
 int main()
@@ -0,0 +1,304 @@
+/*
+ * FastRPC remote processor log interface implementation
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "adspmsgd.h"
+#include "interfaces/adspmsgd_apps.def"
+#include "listener.h"
+
+#define ADSPMSGD_RING_SIZE	65536
+#define ADSPMSGD_FLUSH_MS	200
+
+static const char *adspmsgd_level_names[] = {
+	"LOW",
+	"MEDIUM",
+	"HIGH",
+	"ERROR",
+	"FATAL",
+};
+
+/*
+ * Formatted messages are appended to the ring by the listener threads, and
+ * written out by the flusher thread when the ring is half full or when the
+ * flush interval ends. The head and tail only grow, and the flusher writes
+ * the bytes between them without the lock, since the listener threads only
+ * write to the free part of the ring. Messages that do not fit are dropped
+ * and counted instead of waiting for the output.
+ */
+struct adspmsgd_ctx {
+	FILE *out;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stop;
+	bool stopped;
+
+	size_t head;
+	size_t tail;
+	size_t dropped;
+	char ring[ADSPMSGD_RING_SIZE];
+};
+
+static void ring_put(struct adspmsgd_ctx *ctx, const char *buf, size_t len)
+{
+	size_t off, first;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (len > ADSPMSGD_RING_SIZE - (ctx->head - ctx->tail)) {
+		ctx->dropped++;
+		goto out;
+	}
+
+	off = ctx->head % ADSPMSGD_RING_SIZE;
+	first = ADSPMSGD_RING_SIZE - off;
+	if (first > len)
+		first = len;
+
+	memcpy(&ctx->ring[off], buf, first);
+	memcpy(ctx->ring, &buf[first], len - first);
+
+	ctx->head += len;
+
+	if (ctx->head - ctx->tail >= ADSPMSGD_RING_SIZE / 2)
+		pthread_cond_signal(&ctx->cond);
+
+out:
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static void write_batch(struct adspmsgd_ctx *ctx, size_t tail, size_t head,
+			size_t dropped)
+{
+	size_t off, first;
+
+	off = tail % ADSPMSGD_RING_SIZE;
+	first = ADSPMSGD_RING_SIZE - off;
+	if (first > head - tail)
+		first = head - tail;
+
+	fwrite(&ctx->ring[off], 1, first, ctx->out);
+	fwrite(ctx->ring, 1, head - tail - first, ctx->out);
+
+	if (dropped)
+		fprintf(ctx->out, "adspmsgd: dropped %zu messages\n", dropped);
+
+	fflush(ctx->out);
+}
+
+static void *flush_messages(void *data)
+{
+	struct adspmsgd_ctx *ctx = data;
+	struct timespec deadline;
+	size_t head, tail, dropped;
+	bool stop;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	do {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += ADSPMSGD_FLUSH_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+
+		while (!ctx->stop
+		    && ctx->head - ctx->tail < ADSPMSGD_RING_SIZE / 2
+		    && pthread_cond_timedwait(&ctx->cond, &ctx->lock, &deadline) != ETIMEDOUT);
+
+		head = ctx->head;
+		tail = ctx->tail;
+		dropped = ctx->dropped;
+		stop = ctx->stop;
+
+		ctx->dropped = 0;
+
+		if (head == tail && !dropped)
+			continue;
+
+		pthread_mutex_unlock(&ctx->lock);
+		write_batch(ctx, tail, head, dropped);
+		pthread_mutex_lock(&ctx->lock);
+
+		ctx->tail = head;
+	} while (!stop);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return NULL;
+}
+
+static uint32_t adspmsgd_apps_log(void *data,
+				  const struct fastrpc_io_buffer *inbufs,
+				  struct fastrpc_io_buffer *outbufs)
+{
+	struct adspmsgd_ctx *ctx = data;
+	const struct adspmsgd_log_node *node;
+	const char *level;
+	char buf[sizeof(*node) + 64];
+	size_t i, n_msg;
+	int len;
+
+	for (i = 0; i + sizeof(*node) <= inbufs[0].s; i += sizeof(*node)) {
+		node = (const struct adspmsgd_log_node *) &((const char *) inbufs[0].p)[i];
+
+		if (node->level < sizeof(adspmsgd_level_names) / sizeof(*adspmsgd_level_names))
+			level = adspmsgd_level_names[node->level];
+		else
+			level = "UNKNOWN";
+
+		// Neither string is guaranteed to be NULL-terminated
+		n_msg = strnlen(node->msg, ADSPMSGD_MSG_SIZE);
+		while (n_msg > 0 && node->msg[n_msg - 1] == '\n')
+			n_msg--;
+
+		len = snprintf(buf, sizeof(buf), "adsp: [%u] %.*s:%u %s: %.*s\n",
+			       node->thread_id,
+			       (int) strnlen(node->file, ADSPMSGD_FILENAME_SIZE),
+			       node->file,
+			       node->line,
+			       level,
+			       (int) n_msg,
+			       node->msg);
+		if (len < 0)
+			continue;
+
+		if ((size_t) len >= sizeof(buf))
+			len = sizeof(buf) - 1;
+
+		ring_put(ctx, buf, len);
+	}
+
+	return 0;
+}
+
+struct fastrpc_interface *fastrpc_adspmsgd_init(const char *path)
+{
+	struct fastrpc_interface *iface;
+	struct adspmsgd_ctx *ctx;
+	pthread_condattr_t attr;
+	int ret;
+
+	iface = malloc(sizeof(struct fastrpc_interface));
+	if (iface == NULL)
+		return NULL;
+
+	ctx = calloc(1, sizeof(struct adspmsgd_ctx));
+	if (ctx == NULL)
+		goto err_free_iface;
+
+	memcpy(iface, &adspmsgd_apps_interface, sizeof(struct fastrpc_interface));
+
+	if (path != NULL) {
+		ctx->out = fopen(path, "a");
+		if (ctx->out == NULL) {
+			fprintf(stderr, "Could not open log file (%s): %s\n",
+					path, strerror(errno));
+			goto err_free_ctx;
+		}
+	} else {
+		ctx->out = stdout;
+	}
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	ret = pthread_create(&ctx->thread, NULL, flush_messages, ctx);
+	if (ret) {
+		fprintf(stderr, "Could not start log thread: %s\n", strerror(ret));
+		goto err_destroy;
+	}
+
+	iface->data = ctx;
+
+	return iface;
+
+err_destroy:
+	pthread_mutex_destroy(&ctx->lock);
+	pthread_cond_destroy(&ctx->cond);
+
+	if (ctx->out != stdout)
+		fclose(ctx->out);
+err_free_ctx:
+	free(ctx);
+err_free_iface:
+	free(iface);
+
+	return NULL;
+}
+
+void fastrpc_adspmsgd_stop(struct fastrpc_interface *iface)
+{
+	struct adspmsgd_ctx *ctx = iface->data;
+
+	if (ctx->stopped)
+		return;
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->stop = true;
+	pthread_cond_signal(&ctx->cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	pthread_join(ctx->thread, NULL);
+
+	ctx->stopped = true;
+}
+
+void fastrpc_adspmsgd_deinit(struct fastrpc_interface *iface)
+{
+	struct adspmsgd_ctx *ctx = iface->data;
+
+	fastrpc_adspmsgd_stop(iface);
+
+	if (ctx->out != stdout)
+		fclose(ctx->out);
+
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+
+	free(iface->data);
+	free(iface);
+}
+
+static const struct fastrpc_function_impl adspmsgd_apps_procs[] = {
+	{
+		.def = &adspmsgd_apps_log_def,
+		.impl = adspmsgd_apps_log,
+	},
+};
+
+const struct fastrpc_interface adspmsgd_apps_interface = {
+	.name = "adspmsgd_apps",
+	.n_procs = 1,
+	.procs = adspmsgd_apps_procs,
+};
@@ -0,0 +1,62 @@
+/*
+ * FastRPC remote processor log interface
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADSPMSGD_H
+#define ADSPMSGD_H
+
+#include <stdint.h>
+
+#include "listener.h"
+
+#define ADSPMSGD_FILENAME_SIZE	30
+#define ADSPMSGD_MSG_SIZE	218
+
+/*
+ * A log message, as sent by the remote processor in an array of messages.
+ * The file name comes before the message, and neither is guaranteed to be
+ * NULL-terminated.
+ */
+struct adspmsgd_log_node {
+	uint32_t level;
+	uint16_t line;
+	uint16_t thread_id;
+	char file[ADSPMSGD_FILENAME_SIZE];
+	char msg[ADSPMSGD_MSG_SIZE];
+} __attribute__((packed));
+
+/*
+ * Obtain an adspmsgd_apps interface instance, which writes the log messages
+ * of the remote processor to the file at path, or to stdout if path is NULL.
+ * The messages are written in batches by a separate thread.
+ */
+struct fastrpc_interface *fastrpc_adspmsgd_init(const char *path);
+
+/*
+ * Write out the buffered messages and stop the thread that writes them.
+ * Messages that arrive afterwards are not written. This is safe to call while
+ * listener threads still use the interface, and fastrpc_adspmsgd_deinit()
+ * must still be called to free it.
+ */
+void fastrpc_adspmsgd_stop(struct fastrpc_interface *iface);
+
+void fastrpc_adspmsgd_deinit(struct fastrpc_interface *iface);
+
+#endif
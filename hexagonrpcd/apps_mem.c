@@ -0,0 +1,424 @@
+/*
+ * FastRPC shared memory interface implementation
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <libhexagonrpc/mem.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aee_error.h"
+#include "apps_mem.h"
+#include "interfaces/apps_mem.def"
+#include "listener.h"
+
+// Size classes are powers of two from 4 KiB to 16 MiB
+#define APPS_MEM_MIN_SHIFT	12
+#define APPS_MEM_N_CLASSES	13
+
+// Released buffers kept in the pool per size class
+#define APPS_MEM_MAX_FREE	4
+
+// Buffers allocated up front for each of the smallest size classes
+#define APPS_MEM_PREALLOC_CLASSES	5
+#define APPS_MEM_PREALLOC		2
+
+struct apps_mem_map_in {
+	int32_t heapid;
+	uint32_t lflags;
+	uint32_t rflags;
+	uint32_t vin;
+	int32_t len;
+} __attribute__((packed));
+
+struct apps_mem_map_out {
+	uint32_t vapps;
+	uint32_t vadsp;
+} __attribute__((packed));
+
+struct apps_mem_unmap_in {
+	uint32_t vadsp;
+	int32_t len;
+} __attribute__((packed));
+
+struct apps_mem_map64_in {
+	int32_t heapid;
+	uint32_t lflags;
+	uint32_t rflags;
+	uint64_t vin;
+	int64_t len;
+} __attribute__((packed));
+
+struct apps_mem_map64_out {
+	uint64_t vapps;
+	uint64_t vadsp;
+} __attribute__((packed));
+
+struct apps_mem_unmap64_in {
+	uint64_t vadsp;
+	int64_t len;
+} __attribute__((packed));
+
+/*
+ * A shared buffer, which is either mapped into the remote process or waiting
+ * in the pool. Buffers larger than the largest size class have no class and
+ * are freed when they are unmapped.
+ */
+struct apps_mem_region {
+	void *ptr;
+	size_t size;
+	int cls;
+
+	uint64_t raddr;
+	size_t len;
+
+	struct apps_mem_region *next;
+};
+
+struct apps_mem_ctx {
+	int fd;
+
+	pthread_mutex_t lock;
+	struct apps_mem_region *mapped;
+	struct apps_mem_region *pool[APPS_MEM_N_CLASSES];
+	unsigned int n_pooled[APPS_MEM_N_CLASSES];
+};
+
+static int size_class(size_t len)
+{
+	int cls;
+
+	for (cls = 0; cls < APPS_MEM_N_CLASSES; cls++) {
+		if (len <= (size_t) 1 << (APPS_MEM_MIN_SHIFT + cls))
+			return cls;
+	}
+
+	return -1;
+}
+
+static struct apps_mem_region *region_alloc(struct apps_mem_ctx *ctx,
+					    int cls, size_t len)
+{
+	struct apps_mem_region *region;
+
+	region = malloc(sizeof(struct apps_mem_region));
+	if (region == NULL)
+		return NULL;
+
+	region->cls = cls;
+	region->size = cls >= 0? (size_t) 1 << (APPS_MEM_MIN_SHIFT + cls): len;
+
+	region->ptr = fastrpc_mem_alloc(ctx->fd, region->size);
+	if (region->ptr == NULL) {
+		free(region);
+		return NULL;
+	}
+
+	return region;
+}
+
+static void region_free(struct apps_mem_region *region)
+{
+	fastrpc_mem_free(region->ptr);
+	free(region);
+}
+
+/*
+ * Take a buffer from the pool, or allocate one if the pool has none of the
+ * right size class. Buffers from the pool are cleared, so the remote process
+ * does not see what a previous user left in them.
+ */
+static struct apps_mem_region *region_get(struct apps_mem_ctx *ctx, size_t len)
+{
+	struct apps_mem_region *region = NULL;
+	int cls;
+
+	cls = size_class(len);
+
+	if (cls >= 0) {
+		pthread_mutex_lock(&ctx->lock);
+
+		region = ctx->pool[cls];
+		if (region != NULL) {
+			ctx->pool[cls] = region->next;
+			ctx->n_pooled[cls]--;
+		}
+
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	if (region == NULL)
+		return region_alloc(ctx, cls, len);
+
+	memset(region->ptr, 0, region->size);
+
+	return region;
+}
+
+static void region_put(struct apps_mem_ctx *ctx, struct apps_mem_region *region)
+{
+	int cls = region->cls;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (cls >= 0 && ctx->n_pooled[cls] < APPS_MEM_MAX_FREE) {
+		region->next = ctx->pool[cls];
+		ctx->pool[cls] = region;
+		ctx->n_pooled[cls]++;
+		region = NULL;
+	}
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (region != NULL)
+		region_free(region);
+}
+
+static uint32_t map_region(struct apps_mem_ctx *ctx, uint32_t rflags,
+			   int64_t len, uint64_t *vapps, uint64_t *vadsp)
+{
+	struct apps_mem_region *region;
+	int buf_fd, ret;
+
+	if (len <= 0 || (uint64_t) len > SIZE_MAX)
+		return AEE_EBADPARM;
+
+	region = region_get(ctx, len);
+	if (region == NULL) {
+		fprintf(stderr, "Could not allocate %" PRId64 " bytes for the DSP\n", len);
+		return AEE_ENOMEMORY;
+	}
+
+	buf_fd = fastrpc_mem_fd(region->ptr, len);
+
+	ret = fastrpc_mmap(ctx->fd, buf_fd, region->ptr, len, rflags,
+			   &region->raddr);
+	if (ret) {
+		fprintf(stderr, "Could not map %" PRId64 " bytes for the DSP: %s\n",
+				len, strerror(errno));
+		region_put(ctx, region);
+		return AEE_EFAILED;
+	}
+
+	region->len = len;
+
+	pthread_mutex_lock(&ctx->lock);
+	region->next = ctx->mapped;
+	ctx->mapped = region;
+	pthread_mutex_unlock(&ctx->lock);
+
+	*vapps = (uintptr_t) region->ptr;
+	*vadsp = region->raddr;
+
+	return 0;
+}
+
+static uint32_t unmap_region(struct apps_mem_ctx *ctx, uint64_t vadsp, int64_t len)
+{
+	struct apps_mem_region **curr;
+	struct apps_mem_region *region = NULL;
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	for (curr = &ctx->mapped; *curr != NULL; curr = &(*curr)->next) {
+		if ((*curr)->raddr == vadsp && (int64_t) (*curr)->len == len) {
+			region = *curr;
+			*curr = region->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (region == NULL)
+		return AEE_EBADPARM;
+
+	ret = fastrpc_munmap(ctx->fd, region->raddr, region->len);
+	if (ret) {
+		fprintf(stderr, "Could not unmap %zu bytes from the DSP: %s\n",
+				region->len, strerror(errno));
+		region_free(region);
+		return AEE_EFAILED;
+	}
+
+	region_put(ctx, region);
+
+	return 0;
+}
+
+static uint32_t apps_mem_request_map(void *data,
+				     const struct fastrpc_io_buffer *inbufs,
+				     struct fastrpc_io_buffer *outbufs)
+{
+	const struct apps_mem_map_in *first_in = inbufs[0].p;
+	struct apps_mem_map_out *first_out = outbufs[0].p;
+	uint64_t vapps, vadsp;
+	uint32_t ret;
+
+	ret = map_region(data, first_in->rflags, first_in->len, &vapps, &vadsp);
+	if (ret)
+		return ret;
+
+	// The 32-bit method cannot return the whole local address
+	first_out->vapps = vapps;
+	first_out->vadsp = vadsp;
+
+	return 0;
+}
+
+static uint32_t apps_mem_request_unmap(void *data,
+				       const struct fastrpc_io_buffer *inbufs,
+				       struct fastrpc_io_buffer *outbufs)
+{
+	const struct apps_mem_unmap_in *first_in = inbufs[0].p;
+
+	return unmap_region(data, first_in->vadsp, first_in->len);
+}
+
+static uint32_t apps_mem_request_map64(void *data,
+				       const struct fastrpc_io_buffer *inbufs,
+				       struct fastrpc_io_buffer *outbufs)
+{
+	const struct apps_mem_map64_in *first_in = inbufs[0].p;
+	struct apps_mem_map64_out *first_out = outbufs[0].p;
+	uint64_t vapps, vadsp;
+	uint32_t ret;
+
+	ret = map_region(data, first_in->rflags, first_in->len, &vapps, &vadsp);
+	if (ret)
+		return ret;
+
+	first_out->vapps = vapps;
+	first_out->vadsp = vadsp;
+
+	return 0;
+}
+
+static uint32_t apps_mem_request_unmap64(void *data,
+					 const struct fastrpc_io_buffer *inbufs,
+					 struct fastrpc_io_buffer *outbufs)
+{
+	const struct apps_mem_unmap64_in *first_in = inbufs[0].p;
+
+	return unmap_region(data, first_in->vadsp, first_in->len);
+}
+
+struct fastrpc_interface *fastrpc_apps_mem_init(int fd)
+{
+	struct fastrpc_interface *iface;
+	struct apps_mem_region *region;
+	struct apps_mem_ctx *ctx;
+	int cls, i;
+
+	iface = malloc(sizeof(struct fastrpc_interface));
+	if (iface == NULL)
+		return NULL;
+
+	ctx = calloc(1, sizeof(struct apps_mem_ctx));
+	if (ctx == NULL) {
+		free(iface);
+		return NULL;
+	}
+
+	memcpy(iface, &apps_mem_interface, sizeof(struct fastrpc_interface));
+
+	ctx->fd = fd;
+	pthread_mutex_init(&ctx->lock, NULL);
+
+	/*
+	 * Fill the pool for the most common sizes. This is only a head start,
+	 * so allocation failures are left for the requests to report.
+	 */
+	for (cls = 0; cls < APPS_MEM_PREALLOC_CLASSES; cls++) {
+		for (i = 0; i < APPS_MEM_PREALLOC; i++) {
+			region = region_alloc(ctx, cls, 0);
+			if (region == NULL)
+				break;
+
+			region->next = ctx->pool[cls];
+			ctx->pool[cls] = region;
+			ctx->n_pooled[cls]++;
+		}
+	}
+
+	iface->data = ctx;
+
+	return iface;
+}
+
+void fastrpc_apps_mem_deinit(struct fastrpc_interface *iface)
+{
+	struct apps_mem_ctx *ctx = iface->data;
+	struct apps_mem_region *region;
+	int cls;
+
+	while (ctx->mapped != NULL) {
+		region = ctx->mapped;
+		ctx->mapped = region->next;
+
+		fastrpc_munmap(ctx->fd, region->raddr, region->len);
+		region_free(region);
+	}
+
+	for (cls = 0; cls < APPS_MEM_N_CLASSES; cls++) {
+		while (ctx->pool[cls] != NULL) {
+			region = ctx->pool[cls];
+			ctx->pool[cls] = region->next;
+
+			region_free(region);
+		}
+	}
+
+	pthread_mutex_destroy(&ctx->lock);
+
+	free(iface->data);
+	free(iface);
+}
+
+static const struct fastrpc_function_impl apps_mem_procs[] = {
+	{
+		.def = &apps_mem_request_map_def,
+		.impl = apps_mem_request_map,
+	},
+	{
+		.def = &apps_mem_request_unmap_def,
+		.impl = apps_mem_request_unmap,
+	},
+	{
+		.def = &apps_mem_request_map64_def,
+		.impl = apps_mem_request_map64,
+	},
+	{
+		.def = &apps_mem_request_unmap64_def,
+		.impl = apps_mem_request_unmap64,
+	},
+};
+
+const struct fastrpc_interface apps_mem_interface = {
+	.name = "apps_mem",
+	.n_procs = 4,
+	.procs = apps_mem_procs,
+};
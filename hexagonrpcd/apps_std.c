@@ -20,8 +20,10 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -31,11 +33,28 @@
 #include "hexagonfs.h"
 #include "iobuffer.h"
 #include "listener.h"
+#include "metrics.h"
 
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+/*
+ * Requests can be handled by several listener threads at once. The lock
+ * protects the file descriptor table and the directory tree walked by
+ * hexagonfs_openat(). Operations on a single file descriptor only take the
+ * lock to mark the file descriptor as busy, so slow reads do not block other
+ * requests, and closing a file descriptor waits until it is no longer busy.
+ *
+ * The root and search directories are replaced when the tree is reloaded.
+ * Files that are already open keep a reference to the tree they came from.
+ */
 struct apps_std_ctx {
 	int rootfd;
 	int adsp_avs_cfg_dirfd;
 	int adsp_library_dirfd;
+
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	unsigned int busy[HEXAGONFS_MAX_FD];
 	struct hexagonfs_fd *fds[HEXAGONFS_MAX_FD];
 };
 
@@ -45,6 +64,77 @@ static const int apps_std_whence_table[] = {
 	SEEK_END,
 };
 
+static int fd_acquire(struct apps_std_ctx *ctx, uint32_t fd)
+{
+	int ret = 0;
+
+	if (fd >= HEXAGONFS_MAX_FD)
+		return -EBADF;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (ctx->fds[fd] != NULL)
+		ctx->busy[fd]++;
+	else
+		ret = -EBADF;
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+static void fd_release(struct apps_std_ctx *ctx, uint32_t fd)
+{
+	pthread_mutex_lock(&ctx->lock);
+
+	ctx->busy[fd]--;
+	if (!ctx->busy[fd])
+		pthread_cond_broadcast(&ctx->idle);
+
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+static int fd_open(struct apps_std_ctx *ctx, const int *dirfd, const char *name)
+{
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (*dirfd >= 0)
+		ret = hexagonfs_openat(ctx->fds, ctx->rootfd, *dirfd, name);
+	else
+		ret = *dirfd;
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (ret >= 0)
+		metrics_add_open_fds(1);
+
+	return ret;
+}
+
+static int fd_close(struct apps_std_ctx *ctx, uint32_t fd)
+{
+	int ret;
+
+	if (fd >= HEXAGONFS_MAX_FD)
+		return -EBADF;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	while (ctx->busy[fd])
+		pthread_cond_wait(&ctx->idle, &ctx->lock);
+
+	ret = hexagonfs_close(ctx->fds, fd);
+
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (!ret)
+		metrics_add_open_fds(-1);
+
+	return ret;
+}
+
 /*
  * This is a placeholder function used to complete any I/O operations.
  * File descriptors do not have a flush operation because their reads and
@@ -73,7 +163,7 @@ static uint32_t apps_std_fclose(void *data,
 	const uint32_t *first_in = inbufs[0].p;
 	int ret;
 
-	ret = hexagonfs_close(ctx->fds, *first_in);
+	ret = fd_close(ctx, *first_in);
 	if (ret) {
 		fprintf(stderr, "Could not close: %s\n", strerror(-ret));
 		return AEE_EFAILED;
@@ -101,13 +191,21 @@ static uint32_t apps_std_fread(void *data,
 	} *first_out = outbufs[0].p;
 	ssize_t ret;
 
-	ret = hexagonfs_read(ctx->fds, first_in->fd,
-			     first_in->buf_size, outbufs[1].p);
+	ret = fd_acquire(ctx, first_in->fd);
+	if (!ret) {
+		ret = hexagonfs_read(ctx->fds, first_in->fd,
+				     MIN(first_in->buf_size, outbufs[1].s),
+				     outbufs[1].p);
+		fd_release(ctx, first_in->fd);
+	}
+
 	if (ret < 0) {
 		fprintf(stderr, "Could not read file: %s\n", strerror(-ret));
 		return AEE_EFAILED;
 	}
 
+	metrics_add_read_bytes(ret);
+
 #ifdef HEXAGONRPC_VERBOSE
 	printf("read(%u, %u) -> %ld\n", first_in->fd,
 					first_in->buf_size,
@@ -135,7 +233,13 @@ static uint32_t apps_std_fseek(void *data,
 
 	whence = apps_std_whence_table[first_in->whence];
 
-	ret = hexagonfs_lseek(ctx->fds, first_in->fd, first_in->pos, whence);
+	ret = fd_acquire(ctx, first_in->fd);
+	if (!ret) {
+		ret = hexagonfs_lseek(ctx->fds, first_in->fd,
+				      first_in->pos, whence);
+		fd_release(ctx, first_in->fd);
+	}
+
 	if (ret) {
 		fprintf(stderr, "Could not seek stream: %s\n", strerror(-ret));
 		return AEE_EFAILED;
@@ -156,8 +260,9 @@ static uint32_t apps_std_fopen_with_env(void *data,
 {
 	struct apps_std_ctx *ctx = data;
 	uint32_t *out = outbufs[0].p;
+	const int *dirfd;
 	char rw_mode;
-	int dirfd, fd;
+	int fd;
 
 	// The name and environment variable must also be NULL-terminated
 	if (((const char *) inbufs[1].p)[inbufs[1].s - 1] != 0
@@ -173,26 +278,21 @@ static uint32_t apps_std_fopen_with_env(void *data,
 	}
 
 	if (!strcmp(inbufs[1].p, "ADSP_LIBRARY_PATH")) {
-		dirfd = ctx->adsp_library_dirfd;
+		dirfd = &ctx->adsp_library_dirfd;
 	} else if (!strcmp(inbufs[1].p, "ADSP_AVS_CFG_PATH")) {
-		dirfd = ctx->adsp_avs_cfg_dirfd;
+		dirfd = &ctx->adsp_avs_cfg_dirfd;
 	} else {
 		fprintf(stderr, "Unknown search directory %s\n",
 				(const char *) inbufs[1].p);
 		return AEE_EBADPARM;
 	}
 
-	if (dirfd < 0) {
-		fprintf(stderr, "Could not open virtual %s: %s\n",
-				(const char *) inbufs[1].p, strerror(-dirfd));
-		return AEE_EFAILED;
-	}
-
-	fd = hexagonfs_openat(ctx->fds, ctx->rootfd, dirfd, inbufs[3].p);
+	fd = fd_open(ctx, dirfd, inbufs[3].p);
 	if (fd < 0) {
-		fprintf(stderr, "Could not open %s: %s\n",
+		fprintf(stderr, "Could not open %s in %s: %s\n",
 				(const char *) inbufs[3].p,
-				strerror(errno));
+				(const char *) inbufs[1].p,
+				strerror(-fd));
 		return AEE_EFAILED;
 	}
 
@@ -219,7 +319,7 @@ static uint32_t apps_std_opendir(void *data,
 	if (((const char *) inbufs[1].p)[inbufs[1].s - 1] != 0)
 		return AEE_EBADPARM;
 
-	ret = hexagonfs_openat(ctx->fds, ctx->rootfd, ctx->rootfd, inbufs[1].p);
+	ret = fd_open(ctx, &ctx->rootfd, inbufs[1].p);
 	if (ret < 0) {
 		fprintf(stderr, "Could not open %s: %s\n",
 				(const char *) inbufs[1].p,
@@ -244,7 +344,7 @@ static uint32_t apps_std_closedir(void *data,
 	const uint64_t *dir = inbufs[0].p;
 	int ret;
 
-	ret = hexagonfs_close(ctx->fds, *dir);
+	ret = fd_close(ctx, *dir);
 	if (ret)
 		return AEE_EFAILED;
 
@@ -268,7 +368,12 @@ static uint32_t apps_std_readdir(void *data,
 	} *first_out = outbufs[0].p;
 	int ret;
 
-	ret = hexagonfs_readdir(ctx->fds, *dir, 255, first_out->name);
+	ret = fd_acquire(ctx, *dir);
+	if (!ret) {
+		ret = hexagonfs_readdir(ctx->fds, *dir, 255, first_out->name);
+		fd_release(ctx, *dir);
+	}
+
 	if (ret < 0) {
 		fprintf(stderr, "Could not read from directory: %s\n",
 				strerror(-ret));
@@ -312,22 +417,27 @@ static uint32_t apps_std_stat(void *data,
 	if (((const char *) inbufs[1].p)[inbufs[1].s - 1] != 0)
 		return AEE_EBADPARM;
 
-	fd = hexagonfs_openat(ctx->fds, ctx->rootfd, ctx->rootfd, pathname);
+	fd = fd_open(ctx, &ctx->rootfd, pathname);
 	if (fd < 0) {
 		fprintf(stderr, "Could not open %s: %s\n",
 				pathname, strerror(-fd));
 		return AEE_EFAILED;
 	}
 
-	ret = hexagonfs_fstat(ctx->fds, fd, &stats);
+	ret = fd_acquire(ctx, fd);
+	if (!ret) {
+		ret = hexagonfs_fstat(ctx->fds, fd, &stats);
+		fd_release(ctx, fd);
+	}
+
+	fd_close(ctx, fd);
+
 	if (ret) {
 		fprintf(stderr, "Could not stat %s: %s\n",
-				pathname, strerror(-fd));
+				pathname, strerror(-ret));
 		return AEE_EFAILED;
 	}
 
-	hexagonfs_close(ctx->fds, fd);
-
 #ifdef HEXAGONRPC_VERBOSE
 	printf("stat(%s)\n", pathname);
 #endif
@@ -350,7 +460,69 @@ static uint32_t apps_std_stat(void *data,
 	return 0;
 }
 
-struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_dirent *root)
+/*
+ * Open the root and search directories of a tree, with the context locked if
+ * it is in use.
+ */
+static int open_tree(struct apps_std_ctx *ctx, struct hexagonfs_tree *tree,
+		     int *rootfd, int *avs_cfg_dirfd, int *library_dirfd)
+{
+	*rootfd = hexagonfs_open_root(ctx->fds, tree);
+	if (*rootfd < 0)
+		return *rootfd;
+
+	*avs_cfg_dirfd = hexagonfs_openat(ctx->fds, *rootfd, *rootfd,
+					  "/vendor/etc/acdbdata/");
+	*library_dirfd = hexagonfs_openat(ctx->fds, *rootfd, *rootfd,
+					  "/usr/lib/qcom/adsp/");
+
+	return 0;
+}
+
+static void close_tree(struct apps_std_ctx *ctx,
+		       int rootfd, int avs_cfg_dirfd, int library_dirfd)
+{
+	if (library_dirfd >= 0)
+		hexagonfs_close(ctx->fds, library_dirfd);
+
+	if (avs_cfg_dirfd >= 0)
+		hexagonfs_close(ctx->fds, avs_cfg_dirfd);
+
+	hexagonfs_close(ctx->fds, rootfd);
+}
+
+/*
+ * Serve a new tree to the DSP. New lookups use the new tree, while files and
+ * directories that are already open stay usable until the DSP closes them.
+ */
+int fastrpc_apps_std_reload(struct fastrpc_interface *iface,
+			    struct hexagonfs_tree *tree)
+{
+	struct apps_std_ctx *ctx = iface->data;
+	int rootfd, avs_cfg_dirfd, library_dirfd;
+	int ret;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	ret = open_tree(ctx, tree, &rootfd, &avs_cfg_dirfd, &library_dirfd);
+	if (ret)
+		goto out;
+
+	close_tree(ctx, ctx->rootfd,
+			ctx->adsp_avs_cfg_dirfd,
+			ctx->adsp_library_dirfd);
+
+	ctx->rootfd = rootfd;
+	ctx->adsp_avs_cfg_dirfd = avs_cfg_dirfd;
+	ctx->adsp_library_dirfd = library_dirfd;
+
+out:
+	pthread_mutex_unlock(&ctx->lock);
+
+	return ret;
+}
+
+struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_tree *tree)
 {
 	struct fastrpc_interface *iface;
 	struct apps_std_ctx *ctx;
@@ -365,18 +537,13 @@ struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_dirent *root)
 
 	memcpy(iface, &apps_std_interface, sizeof(struct fastrpc_interface));
 
-	ctx->rootfd = hexagonfs_open_root(ctx->fds, root);
-	if (ctx->rootfd < 0)
-		goto err_free_ctx;
+	pthread_mutex_init(&ctx->lock, NULL);
+	pthread_cond_init(&ctx->idle, NULL);
 
-	ctx->adsp_avs_cfg_dirfd = hexagonfs_openat(ctx->fds,
-						   ctx->rootfd,
-						   ctx->rootfd,
-						   "/vendor/etc/acdbdata/");
-	ctx->adsp_library_dirfd = hexagonfs_openat(ctx->fds,
-						   ctx->rootfd,
-						   ctx->rootfd,
-						   "/usr/lib/qcom/adsp/");
+	if (open_tree(ctx, tree, &ctx->rootfd,
+			  &ctx->adsp_avs_cfg_dirfd,
+			  &ctx->adsp_library_dirfd))
+		goto err_free_ctx;
 
 	iface->data = ctx;
 
@@ -393,12 +560,11 @@ err_free_iface:
 void fastrpc_apps_std_deinit(struct fastrpc_interface *iface)
 {
 	struct apps_std_ctx *ctx = iface->data;
-	int i;
 
-	for (i = 0; i < HEXAGONFS_MAX_FD; i++) {
-		if (ctx->fds[i] != NULL)
-			hexagonfs_close(ctx->fds, i);
-	}
+	hexagonfs_close_all(ctx->fds);
+
+	pthread_cond_destroy(&ctx->idle);
+	pthread_mutex_destroy(&ctx->lock);
 
 	free(iface->data);
 	free(iface);
@@ -418,6 +584,7 @@ static const struct fastrpc_function_impl apps_std_procs[] = {
 	{
 		.def = &apps_std_fread_def,
 		.impl = apps_std_fread,
+		.deferred = true,
 	},
 	{ .def = NULL, .impl = NULL, },
 	{ .def = NULL, .impl = NULL, },
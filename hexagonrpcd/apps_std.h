@@ -25,7 +25,9 @@
 #include "hexagonfs.h"
 #include "listener.h"
 
-struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_dirent *root);
+struct fastrpc_interface *fastrpc_apps_std_init(struct hexagonfs_tree *tree);
+int fastrpc_apps_std_reload(struct fastrpc_interface *iface,
+			    struct hexagonfs_tree *tree);
 void fastrpc_apps_std_deinit(struct fastrpc_interface *iface);
 
 #endif
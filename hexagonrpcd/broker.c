@@ -0,0 +1,679 @@
+/*
+ * FastRPC session broker
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libhexagonrpc/broker.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/interfaces/remotectl.def>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "broker.h"
+#include "interfaces/adsp_listener.def"
+
+// Remote handles a client can have open at once
+#define BROKER_MAX_HANDLES 64
+
+struct broker {
+	int fd;
+	int sock;
+};
+
+/*
+ * Each connection has a reader thread that takes requests from the
+ * submission ring, and worker threads that make the calls. Workers are
+ * started when all existing workers are busy, so a call that blocks on the
+ * remote processor does not hold up the other calls of the client.
+ *
+ * The ring positions are kept here instead of being read back from the shared
+ * memory, which the client can change at any time.
+ *
+ * A client may only call the handles it opened through remotectl, and they
+ * are closed when it disconnects. A handle appears once for each time the
+ * client opened it.
+ */
+struct broker_conn {
+	int fd;
+	int sock;
+	struct hexagonrpc_broker_shm *shm;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t queue[HEXAGONRPC_BROKER_SLOTS];
+	unsigned int queue_start;
+	unsigned int queue_len;
+	unsigned int sq_tail;
+	unsigned int cq_head;
+	unsigned int n_workers;
+	unsigned int n_starting;
+	unsigned int n_idle;
+	unsigned int refs;
+	bool closing;
+
+	uint32_t handles[BROKER_MAX_HANDLES];
+	unsigned int n_handles;
+};
+
+static struct hexagonrpc_broker_shm *create_shm(int *shm_fd)
+{
+	struct hexagonrpc_broker_shm *shm;
+	int ret;
+
+	*shm_fd = memfd_create("hexagonrpc-broker", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (*shm_fd == -1)
+		return NULL;
+
+	ret = ftruncate(*shm_fd, sizeof(*shm));
+	if (ret)
+		goto err;
+
+	// The client must not be able to truncate the memory under the broker
+	ret = fcntl(*shm_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+	if (ret)
+		goto err;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, *shm_fd, 0);
+	if (shm == MAP_FAILED)
+		goto err;
+
+	shm->magic = HEXAGONRPC_BROKER_MAGIC;
+	shm->version = HEXAGONRPC_BROKER_VERSION;
+
+	return shm;
+
+err:
+	close(*shm_fd);
+	return NULL;
+}
+
+static int send_shm(int sock, int shm_fd)
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char byte = 0;
+	ssize_t ret;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	memset(buf, 0, sizeof(buf));
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &shm_fd, sizeof(int));
+
+	ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (ret != 1)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Check the request in a slot and build the ioctl argument list for it. The
+ * request is copied out of the shared memory first so that the client cannot
+ * change it after it is checked.
+ */
+static int check_request(struct hexagonrpc_broker_slot *slot,
+			 uint32_t *handle, uint32_t *sc,
+			 struct fastrpc_invoke_args *args)
+{
+	struct hexagonrpc_broker_buf bufs[HEXAGONRPC_BROKER_MAX_BUFS];
+	uint32_t i, n_bufs;
+
+	*handle = slot->handle;
+	*sc = slot->sc;
+	memcpy(bufs, slot->bufs, sizeof(bufs));
+
+	// Handles cannot be passed through the broker
+	if (*sc & 0xff)
+		return EINVAL;
+
+	n_bufs = REMOTE_SCALARS_INBUFS(*sc) + REMOTE_SCALARS_OUTBUFS(*sc);
+	if (n_bufs > HEXAGONRPC_BROKER_MAX_BUFS)
+		return EINVAL;
+
+	// The reverse tunnel belongs to hexagonrpcd
+	if (*handle == ADSP_LISTENER_HANDLE)
+		return EPERM;
+
+	for (i = 0; i < n_bufs; i++) {
+		if (bufs[i].offset > HEXAGONRPC_BROKER_SLOT_DATA
+		 || bufs[i].length > HEXAGONRPC_BROKER_SLOT_DATA - bufs[i].offset)
+			return EINVAL;
+
+		args[i].ptr = (__u64) ((char *) slot->data + bufs[i].offset);
+		args[i].length = bufs[i].length;
+		args[i].fd = -1;
+		args[i].attr = 0;
+	}
+
+	return 0;
+}
+
+static bool conn_owns(struct broker_conn *conn, uint32_t handle)
+{
+	unsigned int i;
+	bool owned = false;
+
+	pthread_mutex_lock(&conn->lock);
+
+	for (i = 0; i < conn->n_handles && !owned; i++)
+		owned = conn->handles[i] == handle;
+
+	pthread_mutex_unlock(&conn->lock);
+
+	return owned;
+}
+
+static int conn_add_handle(struct broker_conn *conn, uint32_t handle)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&conn->lock);
+
+	if (conn->n_handles < BROKER_MAX_HANDLES)
+		conn->handles[conn->n_handles++] = handle;
+	else
+		ret = -1;
+
+	pthread_mutex_unlock(&conn->lock);
+
+	return ret;
+}
+
+static void conn_remove_handle(struct broker_conn *conn, uint32_t handle)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&conn->lock);
+
+	for (i = 0; i < conn->n_handles; i++) {
+		if (conn->handles[i] == handle) {
+			conn->handles[i] = conn->handles[--conn->n_handles];
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&conn->lock);
+}
+
+static int close_handle(int fd, uint32_t handle)
+{
+	char err[256] = "";
+	struct remotectl_close_args args = {
+		.in_nums = { handle, },
+		.out_bufs = { { .s = sizeof(err), .p = err, }, },
+	};
+	int ret;
+
+	ret = remotectl_close_invoke(fd, REMOTECTL_HANDLE, &args);
+	if (ret)
+		return ret;
+
+	return args.out_nums[0];
+}
+
+/*
+ * Forward a remotectl request, keeping track of the handles the client opens
+ * and closes. The buffers are copied out of the shared memory, so that the
+ * client cannot change which handle was opened or closed while the broker
+ * reads it.
+ */
+static int handle_remotectl(struct broker_conn *conn, uint32_t sc,
+			    struct fastrpc_invoke_args *args)
+{
+	struct fastrpc_invoke_args priv[HEXAGONRPC_BROKER_MAX_BUFS];
+	uint32_t n_in, n_bufs, i;
+	const uint32_t *prim_in;
+	uint32_t *prim_out;
+	size_t total = 0;
+	char *data;
+	int ret;
+
+	if (sc != REMOTE_SCALARS_MAKE(0, 2, 2) && sc != REMOTE_SCALARS_MAKE(1, 1, 2)) {
+		errno = EPERM;
+		return -1;
+	}
+
+	n_in = REMOTE_SCALARS_INBUFS(sc);
+	n_bufs = n_in + REMOTE_SCALARS_OUTBUFS(sc);
+
+	// Keep every buffer aligned for the numbers in the primary buffers
+	for (i = 0; i < n_bufs; i++)
+		total += (args[i].length + 7) & ~(size_t) 7;
+
+	data = malloc(total);
+	if (data == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	total = 0;
+	for (i = 0; i < n_bufs; i++) {
+		priv[i] = args[i];
+		priv[i].ptr = (__u64) (data + total);
+
+		if (i < n_in)
+			memcpy(data + total, (const void *) args[i].ptr, args[i].length);
+
+		total += (args[i].length + 7) & ~(size_t) 7;
+	}
+
+	// The primary buffers hold the handle and the result
+	prim_in = (const uint32_t *) priv[0].ptr;
+	prim_out = (uint32_t *) priv[n_in].ptr;
+
+	if (REMOTE_SCALARS_METHOD(sc) == 1) {
+		if (priv[0].length < 4 || priv[n_in].length < 4) {
+			errno = EINVAL;
+			ret = -1;
+			goto out;
+		}
+
+		if (!conn_owns(conn, prim_in[0])) {
+			errno = EPERM;
+			ret = -1;
+			goto out;
+		}
+	} else if (priv[n_in].length < 8) {
+		errno = EINVAL;
+		ret = -1;
+		goto out;
+	}
+
+	ret = fastrpc_invoke(conn->fd, REMOTECTL_HANDLE, sc, priv);
+	if (ret)
+		goto out;
+
+	if (REMOTE_SCALARS_METHOD(sc) == 1) {
+		if (!prim_out[0])
+			conn_remove_handle(conn, prim_in[0]);
+	} else if (!prim_out[1] && conn_add_handle(conn, prim_out[0])) {
+		close_handle(conn->fd, prim_out[0]);
+		errno = EMFILE;
+		ret = -1;
+		goto out;
+	}
+
+	for (i = n_in; i < n_bufs; i++)
+		memcpy((void *) args[i].ptr, (const void *) priv[i].ptr, args[i].length);
+
+out:
+	free(data);
+	return ret;
+}
+
+static void handle_request(struct broker_conn *conn, uint32_t i)
+{
+	struct fastrpc_invoke_args args[HEXAGONRPC_BROKER_MAX_BUFS];
+	struct hexagonrpc_broker_slot *slot = &conn->shm->slots[i];
+	uint32_t handle, sc;
+	int ret, err;
+
+	err = check_request(slot, &handle, &sc, args);
+	if (!err && handle != REMOTECTL_HANDLE && !conn_owns(conn, handle))
+		err = EPERM;
+
+	if (err) {
+		ret = -1;
+	} else {
+		if (handle == REMOTECTL_HANDLE)
+			ret = handle_remotectl(conn, sc, args);
+		else
+			ret = fastrpc_invoke(conn->fd, handle, sc, args);
+
+		err = ret ? errno : 0;
+	}
+
+	slot->ret = ret;
+	slot->err = err;
+}
+
+static void conn_unref(struct broker_conn *conn)
+{
+	bool last;
+
+	pthread_mutex_lock(&conn->lock);
+	last = !--conn->refs;
+	pthread_mutex_unlock(&conn->lock);
+
+	if (!last)
+		return;
+
+	// Close the handles the client left open
+	while (conn->n_handles)
+		close_handle(conn->fd, conn->handles[--conn->n_handles]);
+
+	munmap(conn->shm, sizeof(*conn->shm));
+	close(conn->sock);
+
+	pthread_cond_destroy(&conn->cond);
+	pthread_mutex_destroy(&conn->lock);
+	free(conn);
+}
+
+static void *conn_worker(void *data)
+{
+	struct broker_conn *conn = data;
+	struct hexagonrpc_broker_ring *cq = &conn->shm->cq;
+	uint32_t i;
+
+	pthread_mutex_lock(&conn->lock);
+
+	conn->n_starting--;
+
+	while (true) {
+		while (!conn->queue_len && !conn->closing) {
+			conn->n_idle++;
+			pthread_cond_wait(&conn->cond, &conn->lock);
+			conn->n_idle--;
+		}
+
+		if (!conn->queue_len)
+			break;
+
+		i = conn->queue[conn->queue_start];
+		conn->queue_start = (conn->queue_start + 1) % HEXAGONRPC_BROKER_SLOTS;
+		conn->queue_len--;
+
+		pthread_mutex_unlock(&conn->lock);
+
+		handle_request(conn, i);
+
+		pthread_mutex_lock(&conn->lock);
+
+		cq->slots[conn->cq_head % HEXAGONRPC_BROKER_SLOTS] = i;
+		conn->cq_head++;
+		atomic_store_explicit(&cq->head, conn->cq_head, memory_order_release);
+
+		pthread_mutex_unlock(&conn->lock);
+
+		send(conn->sock, "", 1, MSG_NOSIGNAL);
+
+		pthread_mutex_lock(&conn->lock);
+	}
+
+	conn->n_workers--;
+
+	pthread_mutex_unlock(&conn->lock);
+
+	conn_unref(conn);
+
+	return NULL;
+}
+
+/*
+ * Move new requests from the submission ring to the queue and make sure
+ * there are enough workers for them. The lock must be held.
+ */
+static void take_submissions(struct broker_conn *conn)
+{
+	struct hexagonrpc_broker_ring *sq = &conn->shm->sq;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned int head, n;
+	uint32_t i;
+
+	head = atomic_load_explicit(&sq->head, memory_order_acquire);
+
+	for (n = 0; conn->sq_tail != head && n < HEXAGONRPC_BROKER_SLOTS; n++) {
+		i = sq->slots[conn->sq_tail % HEXAGONRPC_BROKER_SLOTS];
+		conn->sq_tail++;
+
+		if (i >= HEXAGONRPC_BROKER_SLOTS
+		 || conn->queue_len >= HEXAGONRPC_BROKER_SLOTS)
+			continue;
+
+		conn->queue[(conn->queue_start + conn->queue_len) % HEXAGONRPC_BROKER_SLOTS] = i;
+		conn->queue_len++;
+	}
+
+	atomic_store_explicit(&sq->tail, conn->sq_tail, memory_order_release);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (conn->n_idle + conn->n_starting < conn->queue_len
+	    && conn->n_workers < HEXAGONRPC_BROKER_SLOTS) {
+		if (pthread_create(&thread, &attr, conn_worker, conn))
+			break;
+
+		conn->n_workers++;
+		conn->n_starting++;
+		conn->refs++;
+	}
+
+	pthread_attr_destroy(&attr);
+
+	pthread_cond_broadcast(&conn->cond);
+}
+
+static void *conn_reader(void *data)
+{
+	struct broker_conn *conn = data;
+	char buf[64];
+	ssize_t ret;
+
+	while (true) {
+		ret = recv(conn->sock, buf, sizeof(buf), 0);
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		if (ret <= 0)
+			break;
+
+		pthread_mutex_lock(&conn->lock);
+		take_submissions(conn);
+		pthread_mutex_unlock(&conn->lock);
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	conn->closing = true;
+	pthread_cond_broadcast(&conn->cond);
+	pthread_mutex_unlock(&conn->lock);
+
+	conn_unref(conn);
+
+	return NULL;
+}
+
+static void accept_client(const struct broker *broker, int sock)
+{
+	struct broker_conn *conn;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int shm_fd;
+	int ret;
+
+	conn = malloc(sizeof(*conn));
+	if (conn == NULL)
+		goto err_close;
+
+	conn->shm = create_shm(&shm_fd);
+	if (conn->shm == NULL)
+		goto err_free;
+
+	ret = send_shm(sock, shm_fd);
+	close(shm_fd);
+
+	if (ret)
+		goto err_unmap;
+
+	conn->fd = broker->fd;
+	conn->sock = sock;
+	conn->queue_start = 0;
+	conn->queue_len = 0;
+	conn->sq_tail = 0;
+	conn->cq_head = 0;
+	conn->n_workers = 0;
+	conn->n_starting = 0;
+	conn->n_idle = 0;
+	conn->refs = 1;
+	conn->closing = false;
+	conn->n_handles = 0;
+
+	pthread_mutex_init(&conn->lock, NULL);
+	pthread_cond_init(&conn->cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	ret = pthread_create(&thread, &attr, conn_reader, conn);
+
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		pthread_cond_destroy(&conn->cond);
+		pthread_mutex_destroy(&conn->lock);
+		goto err_unmap;
+	}
+
+	return;
+
+err_unmap:
+	munmap(conn->shm, sizeof(*conn->shm));
+err_free:
+	free(conn);
+err_close:
+	close(sock);
+}
+
+static void *broker_accept(void *data)
+{
+	struct broker *broker = data;
+	int sock;
+
+	while (true) {
+		sock = accept4(broker->sock, NULL, NULL, SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			perror("Could not accept broker client");
+			break;
+		}
+
+		accept_client(broker, sock);
+	}
+
+	close(broker->sock);
+	free(broker);
+
+	return NULL;
+}
+
+int broker_start(int fd, const char *path, mode_t mode)
+{
+	struct sockaddr_un addr;
+	struct broker *broker;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Broker socket path is too long\n");
+		return -1;
+	}
+
+	broker = malloc(sizeof(*broker));
+	if (broker == NULL) {
+		perror("Could not allocate broker");
+		return -1;
+	}
+
+	broker->fd = fd;
+	broker->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (broker->sock == -1) {
+		perror("Could not create broker socket");
+		goto err_free;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+
+	ret = bind(broker->sock, (struct sockaddr *) &addr, sizeof(addr));
+	if (ret) {
+		perror("Could not bind broker socket");
+		goto err_close;
+	}
+
+	/*
+	 * Connecting needs write permission on the socket, so this decides who
+	 * can use the file descriptor. Nobody can connect before listen().
+	 */
+	ret = chmod(path, mode);
+	if (ret) {
+		perror("Could not set broker socket mode");
+		goto err_close;
+	}
+
+	ret = listen(broker->sock, 16);
+	if (ret) {
+		perror("Could not listen on broker socket");
+		goto err_close;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	ret = pthread_create(&thread, &attr, broker_accept, broker);
+
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		fprintf(stderr, "Could not start broker: %s\n", strerror(ret));
+		goto err_close;
+	}
+
+	return 0;
+
+err_close:
+	close(broker->sock);
+err_free:
+	free(broker);
+	return -1;
+}
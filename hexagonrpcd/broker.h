@@ -0,0 +1,37 @@
+/*
+ * FastRPC session broker
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <sys/types.h>
+
+/*
+ * Listen for broker clients on a Unix socket at the given path and forward
+ * their invocations to the FastRPC file descriptor. The clients are served in
+ * background threads. Only users allowed to write to the socket by the given
+ * mode can connect.
+ *
+ * Returns 0 on success, or -1 if the socket could not be set up.
+ */
+int broker_start(int fd, const char *path, mode_t mode);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+ * FastRPC reverse tunnel - traffic capture
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+#include "recorder.h"
+
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_file;
+static uint64_t capture_epoch;
+static uint32_t capture_next_id = 1;
+
+int capture_start(const char *path)
+{
+	struct capture_header hdr;
+	FILE *f;
+
+	f = fopen(path, "wb");
+	if (f == NULL)
+		return -1;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	hdr.version = CAPTURE_VERSION;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+		fclose(f);
+		return -1;
+	}
+
+	pthread_mutex_lock(&capture_lock);
+	capture_file = f;
+	capture_epoch = recorder_now();
+	pthread_mutex_unlock(&capture_lock);
+
+	return 0;
+}
+
+void capture_stop(void)
+{
+	pthread_mutex_lock(&capture_lock);
+
+	if (capture_file != NULL) {
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+
+	pthread_mutex_unlock(&capture_lock);
+}
+
+static void write_record(struct capture_record *rec, const void *data)
+{
+	rec->time = recorder_now() - capture_epoch;
+
+	if (fwrite(rec, sizeof(*rec), 1, capture_file) != 1
+	 || (rec->len && fwrite(data, rec->len, 1, capture_file) != 1)) {
+		perror("Could not write capture, stopping");
+		fclose(capture_file);
+		capture_file = NULL;
+	}
+}
+
+uint32_t capture_request(uint32_t handle, uint32_t sc,
+			 uint32_t len, const void *data)
+{
+	struct capture_record rec = {
+		.type = CAPTURE_REQUEST,
+		.handle = handle,
+		.sc = sc,
+		.len = len,
+	};
+
+	pthread_mutex_lock(&capture_lock);
+
+	if (capture_file != NULL) {
+		rec.id = capture_next_id++;
+		write_record(&rec, data);
+	}
+
+	pthread_mutex_unlock(&capture_lock);
+
+	return rec.id;
+}
+
+void capture_reply(uint32_t id, uint32_t result, uint32_t len, const void *data)
+{
+	struct capture_record rec = {
+		.type = CAPTURE_REPLY,
+		.id = id,
+		.result = result,
+		.len = len,
+	};
+
+	if (!id)
+		return;
+
+	pthread_mutex_lock(&capture_lock);
+
+	// Flush replies so that the capture survives hexagonrpcd being killed
+	if (capture_file != NULL) {
+		write_record(&rec, data);
+
+		if (capture_file != NULL)
+			fflush(capture_file);
+	}
+
+	pthread_mutex_unlock(&capture_lock);
+}
+
+int capture_read_header(FILE *f)
+{
+	struct capture_header hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+		return -1;
+
+	if (memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC))
+	 || hdr.version != CAPTURE_VERSION)
+		return -1;
+
+	return 0;
+}
+
+int capture_read(FILE *f, struct capture_record *rec,
+		 char **buf, size_t *buf_size)
+{
+	char *p;
+
+	if (fread(rec, sizeof(*rec), 1, f) != 1)
+		return feof(f)? 1: -1;
+
+	if (rec->type != CAPTURE_REQUEST && rec->type != CAPTURE_REPLY)
+		return -1;
+
+	if (rec->len > *buf_size) {
+		p = realloc(*buf, rec->len);
+		if (p == NULL)
+			return -1;
+
+		*buf = p;
+		*buf_size = rec->len;
+	}
+
+	if (rec->len && fread(*buf, rec->len, 1, f) != 1)
+		return -1;
+
+	return 0;
+}
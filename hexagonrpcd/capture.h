@@ -0,0 +1,85 @@
+/*
+ * FastRPC reverse tunnel - traffic capture
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * A capture file starts with a header and is followed by records, each with
+ * a payload of len bytes. Everything is in host byte order.
+ *
+ * A request record holds the handle, the scalars and the encoded input
+ * buffers as received from adsp_listener_next2. A reply record holds the
+ * result and the encoded output buffers, and refers to its request by id.
+ * Replies from several listener threads may come in any order.
+ */
+#define CAPTURE_MAGIC "HRPCCAP"
+#define CAPTURE_VERSION 1
+
+enum capture_type {
+	CAPTURE_REQUEST = 1,
+	CAPTURE_REPLY = 2,
+};
+
+struct capture_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct capture_record {
+	uint32_t type;
+	uint32_t id;
+
+	// Nanoseconds since the capture started
+	uint64_t time;
+
+	uint32_t handle;
+	uint32_t sc;
+	uint32_t result;
+	uint32_t len;
+};
+
+/*
+ * Start writing all requests and replies of the listener to the file at
+ * path. Until then, capturing does nothing.
+ */
+int capture_start(const char *path);
+void capture_stop(void);
+
+// Record a request and return its id, or 0 if nothing is being captured
+uint32_t capture_request(uint32_t handle, uint32_t sc,
+			 uint32_t len, const void *data);
+void capture_reply(uint32_t id, uint32_t result, uint32_t len, const void *data);
+
+/*
+ * Read the next record and its payload from a capture. The payload buffer is
+ * grown as needed and owned by the caller. Returns 0 on success, 1 at the end
+ * of the file, or -1 if the file is malformed.
+ */
+int capture_read_header(FILE *f);
+int capture_read(FILE *f, struct capture_record *rec,
+		 char **buf, size_t *buf_size);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * Event loop
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "eventloop.h"
+
+#define EVENT_LOOP_MAX_EVENTS 16
+#define EVENT_REQUEST_SIZE 512
+
+struct event_source {
+	int fd;
+	bool removed;
+	uint64_t timeout_ns;
+	uint64_t deadline;
+
+	event_handler_t handler;
+	void *data;
+
+	struct event_source *next;
+};
+
+struct event_loop {
+	int epfd;
+	bool quit;
+	int ret;
+
+	// Sources are freed after the events of the current iteration
+	struct event_source *sources;
+	struct event_source *removed;
+
+	struct event_server *servers;
+};
+
+struct event_server {
+	int sock;
+	uint64_t timeout_ms;
+	event_respond_t respond;
+	void *data;
+
+	struct event_server *next;
+};
+
+struct event_client {
+	struct event_server *server;
+	uid_t uid;
+	int sock;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct event_loop *event_loop_new(void)
+{
+	struct event_loop *loop;
+
+	loop = malloc(sizeof(*loop));
+	if (loop == NULL)
+		return NULL;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1) {
+		free(loop);
+		return NULL;
+	}
+
+	loop->quit = false;
+	loop->ret = 0;
+	loop->sources = NULL;
+	loop->removed = NULL;
+	loop->servers = NULL;
+
+	return loop;
+}
+
+static void free_sources(struct event_source *src)
+{
+	struct event_source *next;
+
+	while (src != NULL) {
+		next = src->next;
+		free(src);
+		src = next;
+	}
+}
+
+void event_loop_free(struct event_loop *loop)
+{
+	struct event_server *server;
+
+	while (loop->servers != NULL) {
+		server = loop->servers;
+		loop->servers = server->next;
+		close(server->sock);
+		free(server);
+	}
+
+	free_sources(loop->sources);
+	free_sources(loop->removed);
+	close(loop->epfd);
+	free(loop);
+}
+
+struct event_source *event_loop_add(struct event_loop *loop,
+				    int fd, uint32_t events,
+				    event_handler_t handler, void *data)
+{
+	struct epoll_event ev;
+	struct event_source *src;
+	int ret;
+
+	src = malloc(sizeof(*src));
+	if (src == NULL)
+		return NULL;
+
+	src->fd = fd;
+	src->removed = false;
+	src->timeout_ns = 0;
+	src->deadline = 0;
+	src->handler = handler;
+	src->data = data;
+
+	ev.events = events;
+	ev.data.ptr = src;
+
+	ret = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (ret) {
+		free(src);
+		return NULL;
+	}
+
+	src->next = loop->sources;
+	loop->sources = src;
+
+	return src;
+}
+
+void event_source_remove(struct event_loop *loop, struct event_source *src)
+{
+	struct event_source **p;
+
+	if (src->removed)
+		return;
+
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+
+	for (p = &loop->sources; *p != src; p = &(*p)->next);
+	*p = src->next;
+
+	src->removed = true;
+	src->next = loop->removed;
+	loop->removed = src;
+}
+
+void event_source_set_timeout(struct event_source *src, unsigned int ms)
+{
+	src->timeout_ns = (uint64_t) ms * 1000000;
+	src->deadline = ms? now_ns() + src->timeout_ns: 0;
+}
+
+int event_source_fd(const struct event_source *src)
+{
+	return src->fd;
+}
+
+void event_loop_quit(struct event_loop *loop, int ret)
+{
+	loop->quit = true;
+	loop->ret = ret;
+}
+
+// Milliseconds until the earliest deadline, rounded up, or -1 for none
+static int next_timeout(const struct event_loop *loop, uint64_t now)
+{
+	const struct event_source *src;
+	uint64_t earliest = UINT64_MAX;
+
+	for (src = loop->sources; src != NULL; src = src->next) {
+		if (src->deadline && src->deadline < earliest)
+			earliest = src->deadline;
+	}
+
+	if (earliest == UINT64_MAX)
+		return -1;
+
+	if (earliest <= now)
+		return 0;
+
+	return (earliest - now + 999999) / 1000000;
+}
+
+static void dispatch_timeouts(struct event_loop *loop, uint64_t now)
+{
+	struct event_source *src, *next;
+
+	for (src = loop->sources; src != NULL && !loop->quit; src = next) {
+		next = src->next;
+
+		if (!src->deadline || src->deadline > now)
+			continue;
+
+		src->deadline = 0;
+		src->handler(loop, src, 0, src->data);
+
+		// The next source may have been removed by the handler
+		if (next != NULL && next->removed)
+			next = loop->sources;
+	}
+}
+
+int event_loop_run(struct event_loop *loop)
+{
+	struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+	struct event_source *src;
+	int n, i;
+
+	loop->quit = false;
+
+	while (!loop->quit) {
+		n = epoll_wait(loop->epfd, events, EVENT_LOOP_MAX_EVENTS,
+			       next_timeout(loop, now_ns()));
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("Could not wait for events");
+			return -1;
+		}
+
+		for (i = 0; i < n && !loop->quit; i++) {
+			src = events[i].data.ptr;
+			if (src->removed)
+				continue;
+
+			if (src->timeout_ns)
+				src->deadline = now_ns() + src->timeout_ns;
+
+			src->handler(loop, src, events[i].events, src->data);
+		}
+
+		if (!loop->quit)
+			dispatch_timeouts(loop, now_ns());
+
+		free_sources(loop->removed);
+		loop->removed = NULL;
+	}
+
+	return loop->ret;
+}
+
+static void handle_client(struct event_loop *loop,
+			  struct event_source *src,
+			  uint32_t events,
+			  void *data)
+{
+	struct event_client *client = data;
+	struct event_server *server = client->server;
+	char req[EVENT_REQUEST_SIZE];
+	char *text = NULL;
+	size_t len = 0;
+	ssize_t ret = 0;
+	FILE *f;
+
+	if (events & EPOLLIN) {
+		ret = recv(client->sock, req, sizeof(req) - 1, MSG_DONTWAIT);
+		if (ret == -1 && errno == EAGAIN)
+			return;
+		if (ret < 0)
+			ret = 0;
+	}
+
+	req[ret] = '\0';
+
+	f = open_memstream(&text, &len);
+	if (f != NULL) {
+		server->respond(server->data, client->uid, req, ret, f);
+		fclose(f);
+
+		send(client->sock, text, len, MSG_NOSIGNAL);
+
+		free(text);
+	}
+
+	event_source_remove(loop, src);
+	close(client->sock);
+	free(client);
+}
+
+static void handle_accept(struct event_loop *loop,
+			  struct event_source *src,
+			  uint32_t events,
+			  void *data)
+{
+	struct event_server *server = data;
+	struct event_client *client;
+	struct event_source *client_src;
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+	int sock, ret;
+
+	sock = accept4(server->sock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock == -1) {
+		if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN)
+			perror("Could not accept client");
+
+		return;
+	}
+
+	ret = getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len);
+	if (ret) {
+		perror("Could not get client credentials");
+		goto err_close;
+	}
+
+	client = malloc(sizeof(*client));
+	if (client == NULL)
+		goto err_close;
+
+	client->server = server;
+	client->uid = cred.uid;
+	client->sock = sock;
+
+	client_src = event_loop_add(loop, sock, EPOLLIN, handle_client, client);
+	if (client_src == NULL)
+		goto err_free;
+
+	event_source_set_timeout(client_src, server->timeout_ms);
+
+	return;
+
+err_free:
+	free(client);
+err_close:
+	close(sock);
+}
+
+int event_loop_serve(struct event_loop *loop,
+		     const char *path, unsigned int timeout_ms,
+		     event_respond_t respond, void *data)
+{
+	struct sockaddr_un addr;
+	struct event_server *server;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path is too long: %s\n", path);
+		return -1;
+	}
+
+	server = malloc(sizeof(*server));
+	if (server == NULL) {
+		perror("Could not allocate server");
+		return -1;
+	}
+
+	server->timeout_ms = timeout_ms;
+	server->respond = respond;
+	server->data = data;
+	server->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (server->sock == -1) {
+		perror("Could not create socket");
+		goto err_free;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+
+	ret = bind(server->sock, (struct sockaddr *) &addr, sizeof(addr));
+	if (ret) {
+		fprintf(stderr, "Could not bind socket (%s): %s\n", path, strerror(errno));
+		goto err_close;
+	}
+
+	// Nobody can connect before listen(), so there is no window to race
+	ret = chmod(path, 0600);
+	if (ret) {
+		fprintf(stderr, "Could not set socket mode (%s): %s\n", path, strerror(errno));
+		goto err_close;
+	}
+
+	ret = listen(server->sock, 16);
+	if (ret) {
+		perror("Could not listen on socket");
+		goto err_close;
+	}
+
+	if (event_loop_add(loop, server->sock, EPOLLIN, handle_accept, server) == NULL) {
+		perror("Could not watch socket");
+		goto err_close;
+	}
+
+	server->next = loop->servers;
+	loop->servers = server;
+
+	return 0;
+
+err_close:
+	close(server->sock);
+err_free:
+	free(server);
+	return -1;
+}
@@ -0,0 +1,86 @@
+/*
+ * Event loop
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+struct event_loop;
+struct event_source;
+
+/*
+ * Called with the epoll events of the file descriptor, or with no events if
+ * the timeout of the source expired.
+ */
+typedef void (*event_handler_t)(struct event_loop *loop,
+				struct event_source *src,
+				uint32_t events,
+				void *data);
+
+/*
+ * Called with the user ID of a client and the request received from it, which
+ * may be empty, to write the response.
+ */
+typedef void (*event_respond_t)(void *data, uid_t uid,
+				const char *req, size_t len,
+				FILE *out);
+
+struct event_loop *event_loop_new(void);
+void event_loop_free(struct event_loop *loop);
+
+/*
+ * Watch a file descriptor. The loop does not take ownership of the file
+ * descriptor, which must stay open until the source is removed.
+ */
+struct event_source *event_loop_add(struct event_loop *loop,
+				    int fd, uint32_t events,
+				    event_handler_t handler, void *data);
+
+// This is safe to call from any handler, including the source's own
+void event_source_remove(struct event_loop *loop, struct event_source *src);
+
+// Call the handler if no events arrive within the timeout, or never if 0
+void event_source_set_timeout(struct event_source *src, unsigned int ms);
+
+int event_source_fd(const struct event_source *src);
+
+/*
+ * Dispatch events until event_loop_quit() is called, returning the value
+ * passed to it, or -1 if waiting for events fails.
+ */
+int event_loop_run(struct event_loop *loop);
+void event_loop_quit(struct event_loop *loop, int ret);
+
+/*
+ * Accept clients on a Unix socket at the given path. Each client gets one
+ * response to the request it sends first, or to an empty request if it sends
+ * nothing before the timeout, and is then disconnected. Only the owner of the
+ * process can connect.
+ */
+int event_loop_serve(struct event_loop *loop,
+		     const char *path, unsigned int timeout_ms,
+		     event_respond_t respond, void *data);
+
+#endif
@@ -20,6 +20,7 @@
  */
 
 #include <errno.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -62,21 +63,89 @@ static char *copy_segment_and_advance(const char *path,
 	return segment;
 }
 
+struct hexagonfs_tree_block {
+	struct hexagonfs_tree_block *next;
+	max_align_t data[];
+};
+
+struct hexagonfs_tree *hexagonfs_tree_new(void)
+{
+	struct hexagonfs_tree *tree;
+
+	tree = malloc(sizeof(struct hexagonfs_tree));
+	if (tree == NULL)
+		return NULL;
+
+	atomic_init(&tree->refs, 1);
+	tree->root = NULL;
+	tree->blocks = NULL;
+
+	return tree;
+}
+
+void *hexagonfs_tree_alloc(struct hexagonfs_tree *tree, size_t size)
+{
+	struct hexagonfs_tree_block *block;
+
+	block = malloc(sizeof(struct hexagonfs_tree_block) + size);
+	if (block == NULL)
+		return NULL;
+
+	block->next = tree->blocks;
+	tree->blocks = block;
+
+	return block->data;
+}
+
+struct hexagonfs_tree *hexagonfs_tree_get(struct hexagonfs_tree *tree)
+{
+	atomic_fetch_add(&tree->refs, 1);
+
+	return tree;
+}
+
+void hexagonfs_tree_put(struct hexagonfs_tree *tree)
+{
+	struct hexagonfs_tree_block *block;
+
+	if (tree == NULL || atomic_fetch_sub(&tree->refs, 1) != 1)
+		return;
+
+	while (tree->blocks != NULL) {
+		block = tree->blocks;
+		tree->blocks = block->next;
+		free(block);
+	}
+
+	free(tree);
+}
+
+static void put_file_descriptor(struct hexagonfs_fd *fd)
+{
+	struct hexagonfs_fd *up;
+
+	while (fd != NULL && !--fd->refs) {
+		up = fd->up;
+
+		fd->ops->close(fd->data);
+		hexagonfs_tree_put(fd->tree);
+		free(fd);
+
+		fd = up;
+	}
+}
+
 static struct hexagonfs_fd *pop_dir(struct hexagonfs_fd *dir,
 				    struct hexagonfs_fd *root)
 {
 	struct hexagonfs_fd *up;
 
-	if (dir != root && dir->up != NULL) {
-		up = dir->up;
+	if (dir == root || dir->up == NULL)
+		return dir;
 
-		if (!dir->is_assigned) {
-			dir->ops->close(dir->data);
-			free(dir);
-		}
-	} else {
-		up = dir;
-	}
+	up = dir->up;
+	up->refs++;
+	put_file_descriptor(dir);
 
 	return up;
 }
@@ -88,7 +157,6 @@ static int allocate_file_number(struct hexagonfs_fd **fds,
 
 	for (i = 0; i < HEXAGONFS_MAX_FD; i++) {
 		if (fds[i] == NULL) {
-			fd->is_assigned = true;
 			fds[i] = fd;
 			return i;
 		}
@@ -97,21 +165,7 @@ static int allocate_file_number(struct hexagonfs_fd **fds,
 	return -EMFILE;
 }
 
-static void destroy_file_descriptor(struct hexagonfs_fd *fd)
-{
-	struct hexagonfs_fd *curr = fd;
-	struct hexagonfs_fd *next;
-
-	while (curr != NULL && !curr->is_assigned) {
-		next = curr->up;
-		curr->ops->close(curr->data);
-		free(curr);
-
-		curr = next;
-	}
-}
-
-int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_dirent *root)
+int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_tree *tree)
 {
 	struct hexagonfs_fd *fd;
 	int ret;
@@ -120,23 +174,24 @@ int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_dirent *root
 	if (fd == NULL)
 		return -ENOMEM;
 
-	fd->is_assigned = false;
 	fd->up = NULL;
-	fd->ops = root->ops;
+	fd->tree = NULL;
+	fd->ops = tree->root->ops;
 
-	ret = root->ops->from_dirent(root->u.ptr, true, &fd->data);
-	if (ret)
-		goto err;
+	ret = tree->root->ops->from_dirent(tree->root->u.ptr, true, &fd->data);
+	if (ret) {
+		free(fd);
+		return ret;
+	}
+
+	fd->refs = 1;
+	fd->tree = hexagonfs_tree_get(tree);
 
 	ret = allocate_file_number(fds, fd);
 	if (ret < 0)
-		goto err;
+		put_file_descriptor(fd);
 
 	return ret;
-
-err:
-	destroy_file_descriptor(fd);
-	return ret;
 }
 
 int hexagonfs_openat(struct hexagonfs_fd **fds, int rootfd, int dirfd, const char *name)
@@ -155,7 +210,15 @@ int hexagonfs_openat(struct hexagonfs_fd **fds, int rootfd, int dirfd, const cha
 			curr++;
 	}
 
+	if (selected < 0 || selected >= HEXAGONFS_MAX_FD || fds[selected] == NULL)
+		return -EBADF;
+
+	/*
+	 * The walk holds a reference to the current directory, which is passed
+	 * on to each opened child as the reference to its parent.
+	 */
 	fd = fds[selected];
+	fd->refs++;
 
 	while (*curr != '\0' && !ret) {
 		segment = copy_segment_and_advance(curr, &expect_dir, &curr);
@@ -180,13 +243,13 @@ int hexagonfs_openat(struct hexagonfs_fd **fds, int rootfd, int dirfd, const cha
 		goto err;
 
 	ret = allocate_file_number(fds, fd);
-	if (ret)
+	if (ret < 0)
 		goto err;
 
 	return ret;
 
 err:
-	destroy_file_descriptor(fd);
+	put_file_descriptor(fd);
 
 	return ret;
 }
@@ -202,14 +265,23 @@ int hexagonfs_close(struct hexagonfs_fd **fds, int fileno)
 	if (fd == NULL || fd->ops == NULL)
 		return -EBADF;
 
-	fd->is_assigned = false;
-	destroy_file_descriptor(fd);
-
 	fds[fileno] = NULL;
 
+	put_file_descriptor(fd);
+
 	return 0;
 }
 
+void hexagonfs_close_all(struct hexagonfs_fd **fds)
+{
+	int i;
+
+	for (i = 0; i < HEXAGONFS_MAX_FD; i++) {
+		if (fds[i] != NULL)
+			hexagonfs_close(fds, i);
+	}
+}
+
 int hexagonfs_lseek(struct hexagonfs_fd **fds, int fileno, off_t off, int whence)
 {
 	struct hexagonfs_fd *fd;
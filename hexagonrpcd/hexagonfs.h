@@ -22,6 +22,7 @@
 #ifndef HEXAGONFS_H
 #define HEXAGONFS_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
@@ -55,9 +56,29 @@ struct hexagonfs_dirent {
 	} u;
 };
 
+struct hexagonfs_tree_block;
+
+/*
+ * Directory entries, and the names and paths they point to, are allocated
+ * with the tree they belong to and freed when its last reference is dropped.
+ * The root file descriptor holds a reference to its tree, and every other
+ * file descriptor keeps its parent alive, so open files keep using the tree
+ * they were opened from when the tree is replaced.
+ */
+struct hexagonfs_tree {
+	atomic_uint refs;
+	struct hexagonfs_dirent *root;
+	struct hexagonfs_tree_block *blocks;
+};
+
+/*
+ * A file descriptor is referenced by its file number and by the descriptors
+ * opened from it. New descriptors start with one reference.
+ */
 struct hexagonfs_fd {
-	bool is_assigned;
+	unsigned int refs;
 	struct hexagonfs_fd *up;
+	struct hexagonfs_tree *tree;
 	void *data;
 
 	struct hexagonfs_file_ops *ops;
@@ -69,9 +90,15 @@ extern struct hexagonfs_file_ops hexagonfs_mapped_sysfs_ops;
 extern struct hexagonfs_file_ops hexagonfs_plat_subtype_name_ops;
 extern struct hexagonfs_file_ops hexagonfs_virt_dir_ops;
 
-int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_dirent *root);
+struct hexagonfs_tree *hexagonfs_tree_new(void);
+void *hexagonfs_tree_alloc(struct hexagonfs_tree *tree, size_t size);
+struct hexagonfs_tree *hexagonfs_tree_get(struct hexagonfs_tree *tree);
+void hexagonfs_tree_put(struct hexagonfs_tree *tree);
+
+int hexagonfs_open_root(struct hexagonfs_fd **fds, struct hexagonfs_tree *tree);
 int hexagonfs_openat(struct hexagonfs_fd **fds, int rootfd, int dirfd, const char *name);
 int hexagonfs_close(struct hexagonfs_fd **fds, int fileno);
+void hexagonfs_close_all(struct hexagonfs_fd **fds);
 
 int hexagonfs_fstat(struct hexagonfs_fd **fds, int fileno, struct stat *stats);
 int hexagonfs_lseek(struct hexagonfs_fd **fds, int fileno, off_t pos, int whence);
@@ -110,7 +110,8 @@ static int mapped_openat(struct hexagonfs_fd *dir,
 
 	ctx->dir = NULL;
 
-	fd->is_assigned = false;
+	fd->refs = 1;
+	fd->tree = NULL;
 	fd->up = dir;
 	fd->ops = &hexagonfs_mapped_ops;
 	fd->data = ctx;
@@ -78,7 +78,8 @@ static int virt_dir_openat(struct hexagonfs_fd *dir,
 	if (fd == NULL)
 		return -ENOMEM;
 
-	fd->is_assigned = false;
+	fd->refs = 1;
+	fd->tree = NULL;
 	fd->up = dir;
 	fd->ops = ent->ops;
 
@@ -22,5 +22,7 @@
 #define HEXAGONRPC_BUILD_METHOD_DEFINITIONS 1
 
 #include "interfaces/adsp_default_listener.def"
+#include "interfaces/adspmsgd_apps.def"
+#include "interfaces/apps_mem.def"
 #include "interfaces/apps_std.def"
 #include "interfaces/adsp_listener.def"
@@ -19,6 +19,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <libhexagonrpc/fastrpc.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -28,6 +29,40 @@
 #include "iobuffer.h"
 
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
+
+// Allocations are aligned for the 64-bit values found in buffers
+#define ARENA_ALIGN 8
+
+struct iobuf_arena_block {
+	struct iobuf_arena_block *next;
+	size_t size;
+	size_t used;
+	uint64_t data[];
+};
+
+struct iobuf_arena {
+	// The current block, followed by the blocks that were filled before it
+	struct iobuf_arena_block *head;
+
+	// Bytes allocated since the last reset, across all blocks
+	size_t total;
+};
+
+static struct iobuf_arena_block *arena_block_new(size_t size)
+{
+	struct iobuf_arena_block *block;
+
+	block = malloc(sizeof(*block) + size);
+	if (block == NULL)
+		return NULL;
+
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+
+	return block;
+}
 
 static size_t consume_size(struct fastrpc_decoder_context *ctx,
 			   size_t len, const char *buf)
@@ -50,7 +85,14 @@ static int try_populate_inbuf(struct fastrpc_decoder_context *ctx)
 	if (ctx->size_off)
 		return 0;
 
-	buf = malloc(ctx->size);
+	// Views are only known to be possible once the data is reached.
+	if (ctx->views) {
+		ctx->inbufs[ctx->idx].s = ctx->size;
+		ctx->inbufs[ctx->idx].p = NULL;
+		return 0;
+	}
+
+	buf = iobuf_alloc(ctx->arena, ctx->size);
 	if (buf == NULL)
 		return -1;
 
@@ -60,6 +102,25 @@ static int try_populate_inbuf(struct fastrpc_decoder_context *ctx)
 	return 0;
 }
 
+static int try_populate_view(struct fastrpc_decoder_context *ctx,
+			     size_t len, const void *buf)
+{
+	void *p;
+
+	if (len >= ctx->size) {
+		ctx->inbufs[ctx->idx].p = (void *) buf;
+		return 0;
+	}
+
+	p = iobuf_alloc(ctx->arena, ctx->size);
+	if (p == NULL)
+		return -1;
+
+	ctx->inbufs[ctx->idx].p = p;
+
+	return 0;
+}
+
 static size_t consume_alignment(struct fastrpc_decoder_context *ctx, size_t len)
 {
 	size_t segment = 0;
@@ -81,7 +142,8 @@ static size_t consume_buf(struct fastrpc_decoder_context *ctx,
 	dest = (void *) &((char *) ctx->inbufs[ctx->idx].p)[ctx->buf_off];
 
 	segment = MIN(len, ctx->size - ctx->buf_off);
-	memcpy(dest, buf, segment);
+	if (dest != buf)
+		memcpy(dest, buf, segment);
 
 	if (ctx->buf_off + segment >= ctx->size) {
 		ctx->size = 0;
@@ -113,24 +175,119 @@ static size_t align_and_copy_outbuf(const struct fastrpc_io_buffer *outbuf,
 	return zero + outbuf->s;
 }
 
-void iobuf_free(size_t n_iobufs, struct fastrpc_io_buffer *iobufs)
+struct iobuf_arena *iobuf_arena_create(size_t size)
+{
+	struct iobuf_arena *arena;
+
+	arena = malloc(sizeof(*arena));
+	if (arena == NULL)
+		return NULL;
+
+	arena->head = arena_block_new(size);
+	if (arena->head == NULL) {
+		free(arena);
+		return NULL;
+	}
+
+	arena->total = 0;
+
+	return arena;
+}
+
+static void arena_free_blocks(struct iobuf_arena_block *block)
+{
+	struct iobuf_arena_block *next;
+
+	while (block != NULL) {
+		next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+void iobuf_arena_destroy(struct iobuf_arena *arena)
+{
+	if (arena == NULL)
+		return;
+
+	arena_free_blocks(arena->head);
+	free(arena);
+}
+
+void iobuf_arena_reset(struct iobuf_arena *arena)
+{
+	struct iobuf_arena_block *block;
+
+	/*
+	 * If the last request needed more than one block, replace them with a
+	 * block that fits everything. On failure, keep the current block.
+	 */
+	if (arena->head->next != NULL) {
+		block = arena_block_new(MAX(arena->total, arena->head->size));
+		if (block != NULL) {
+			arena_free_blocks(arena->head);
+			arena->head = block;
+		} else {
+			arena_free_blocks(arena->head->next);
+			arena->head->next = NULL;
+		}
+	}
+
+	arena->head->used = 0;
+	arena->total = 0;
+}
+
+void *iobuf_alloc(struct iobuf_arena *arena, size_t size)
+{
+	struct iobuf_arena_block *block;
+	void *ptr;
+
+	if (arena == NULL)
+		return malloc(size);
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+	block = arena->head;
+	if (block->size - block->used < size) {
+		block = arena_block_new(MAX(block->size * 2, size));
+		if (block == NULL)
+			return NULL;
+
+		block->next = arena->head;
+		arena->head = block;
+	}
+
+	ptr = &((char *) block->data)[block->used];
+	block->used += size;
+	arena->total += size;
+
+	return ptr;
+}
+
+void iobuf_free(struct iobuf_arena *arena,
+		size_t n_iobufs, struct fastrpc_io_buffer *iobufs)
 {
 	size_t i;
 
+	if (arena != NULL)
+		return;
+
 	for (i = 0; i < n_iobufs; i++)
 		free(iobufs[i].p);
 
 	free(iobufs);
 }
 
-struct fastrpc_decoder_context *inbuf_decode_start(uint32_t sc)
+struct fastrpc_decoder_context *inbuf_decode_start(struct iobuf_arena *arena,
+						   uint32_t sc)
 {
 	struct fastrpc_decoder_context *ctx;
 
-	ctx = malloc(sizeof(*ctx));
+	ctx = iobuf_alloc(arena, sizeof(*ctx));
 	if (ctx == NULL)
 		return ctx;
 
+	ctx->arena = arena;
 	ctx->idx = 0;
 	ctx->size = 0;
 	ctx->n_inbufs = REMOTE_SCALARS_INBUFS(sc);
@@ -138,15 +295,17 @@ struct fastrpc_decoder_context *inbuf_decode_start(uint32_t sc)
 	ctx->size_off = 0;
 	ctx->buf_off = 0;
 	ctx->align = 0;
+	ctx->views = false;
 
-	ctx->inbufs = malloc(sizeof(*ctx->inbufs) * ctx->n_inbufs);
+	ctx->inbufs = iobuf_alloc(arena, sizeof(*ctx->inbufs) * ctx->n_inbufs);
 	if (ctx->inbufs == NULL && ctx->n_inbufs != 0)
 		goto err;
 
 	return ctx;
 
 err:
-	free(ctx);
+	if (arena == NULL)
+		free(ctx);
 	return NULL;
 }
 
@@ -154,7 +313,8 @@ struct fastrpc_io_buffer *inbuf_decode_finish(struct fastrpc_decoder_context *ct
 {
 	struct fastrpc_io_buffer *inbufs = ctx->inbufs;
 
-	free(ctx);
+	if (ctx->arena == NULL)
+		free(ctx);
 
 	return inbufs;
 }
@@ -176,6 +336,8 @@ int inbuf_decode(struct fastrpc_decoder_context *ctx, size_t len, const void *sr
 			ret = try_populate_inbuf(ctx);
 		} else if (ctx->align && !ctx->buf_off) {
 			off += consume_alignment(ctx, len - off);
+		} else if (ctx->inbufs[ctx->idx].p == NULL) {
+			ret = try_populate_view(ctx, len - off, &buf[off]);
 		} else {
 			off += consume_buf(ctx, len - off, &buf[off]);
 		}
@@ -187,6 +349,18 @@ int inbuf_decode(struct fastrpc_decoder_context *ctx, size_t len, const void *sr
 	return 0;
 }
 
+int inbuf_decode_views(struct fastrpc_decoder_context *ctx, size_t len, const void *src)
+{
+	if (ctx->arena == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ctx->views = true;
+
+	return inbuf_decode(ctx, len, src);
+}
+
 size_t outbufs_calculate_size(size_t n_outbufs, const struct fastrpc_io_buffer *outbufs)
 {
 	size_t i;
@@ -212,7 +386,7 @@ void outbufs_encode(size_t n_outbufs, const struct fastrpc_io_buffer *outbufs,
 	size_t i;
 
 	for (i = 0; i < n_outbufs; i++) {
-		*(uint32_t *) ptr = outbufs[i].s;
+		memcpy(ptr, &outbufs[i].s, sizeof(uint32_t));
 		ptr = &ptr[4];
 		align = (align + 4) & 0x7;
 
@@ -223,3 +397,30 @@ void outbufs_encode(size_t n_outbufs, const struct fastrpc_io_buffer *outbufs,
 		}
 	}
 }
+
+void outbufs_layout(size_t n_outbufs, struct fastrpc_io_buffer *outbufs,
+		    void *dest)
+{
+	char *ptr = dest;
+	off_t align = 0;
+	size_t zero;
+	size_t i;
+
+	for (i = 0; i < n_outbufs; i++) {
+		memcpy(ptr, &outbufs[i].s, sizeof(uint32_t));
+		ptr = &ptr[4];
+		align = (align + 4) & 0x7;
+
+		if (!outbufs[i].s) {
+			outbufs[i].p = NULL;
+			continue;
+		}
+
+		zero = align? 8 - align: 0;
+		memset(ptr, 0, zero);
+
+		outbufs[i].p = &ptr[zero];
+		ptr = &ptr[zero + outbufs[i].s];
+		align = (align + zero + outbufs[i].s) & 0x7;
+	}
+}
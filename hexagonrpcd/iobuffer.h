@@ -22,16 +22,22 @@
 #ifndef IOBUFFER_H
 #define IOBUFFER_H
 
+#include <libhexagonrpc/fastrpc.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <sys/types.h>
 
-struct fastrpc_io_buffer {
-	uint32_t s;
-	void *p;
-};
+/*
+ * A bump allocator for buffers that only live until the next request. All
+ * memory is released at once by iobuf_arena_reset(). A request that does not
+ * fit in the arena gets extra blocks, which are merged into a single larger
+ * block on the next reset, so the arena settles at the largest request seen.
+ */
+struct iobuf_arena;
 
 struct fastrpc_decoder_context {
+	struct iobuf_arena *arena;
 	struct fastrpc_io_buffer *inbufs;
 	unsigned int n_inbufs;
 	unsigned int idx;
@@ -41,17 +47,47 @@ struct fastrpc_decoder_context {
 
 	unsigned int size_off;
 	unsigned int align;
+
+	bool views;
 };
 
-void iobuf_free(size_t n_iobufs, struct fastrpc_io_buffer *iobufs);
+struct iobuf_arena *iobuf_arena_create(size_t size);
+void iobuf_arena_destroy(struct iobuf_arena *arena);
+void iobuf_arena_reset(struct iobuf_arena *arena);
+
+/*
+ * These allocate from the arena if one is given, or with malloc otherwise.
+ * Freeing buffers from an arena does nothing until the arena is reset.
+ */
+void *iobuf_alloc(struct iobuf_arena *arena, size_t size);
+void iobuf_free(struct iobuf_arena *arena,
+		size_t n_iobufs, struct fastrpc_io_buffer *iobufs);
 
-struct fastrpc_decoder_context *inbuf_decode_start(uint32_t sc);
+struct fastrpc_decoder_context *inbuf_decode_start(struct iobuf_arena *arena,
+						   uint32_t sc);
 struct fastrpc_io_buffer *inbuf_decode_finish(struct fastrpc_decoder_context *ctx);
 int inbuf_decode_is_complete(struct fastrpc_decoder_context *ctx);
 int inbuf_decode(struct fastrpc_decoder_context *ctx, size_t len, const void *src);
 
+/*
+ * Decode like inbuf_decode(), but return buffers that are entirely in the
+ * source as pointers into it instead of copies. Only buffers that are split
+ * across calls are copied. This needs an arena, and the source must outlive
+ * the decoded buffers.
+ */
+int inbuf_decode_views(struct fastrpc_decoder_context *ctx, size_t len, const void *src);
+
 size_t outbufs_calculate_size(size_t n_outbufs, const struct fastrpc_io_buffer *outbufs);
 void outbufs_encode(size_t n_outbufs, const struct fastrpc_io_buffer *outbufs,
 		    void *dest);
 
+/*
+ * Write the sizes and padding of the output buffers to dest, which must be
+ * outbufs_calculate_size() bytes long, and point each output buffer at its
+ * place in dest. Filling in the buffers then gives the same result as
+ * outbufs_encode(), without copying them.
+ */
+void outbufs_layout(size_t n_outbufs, struct fastrpc_io_buffer *outbufs,
+		    void *dest);
+
 #endif
@@ -22,17 +22,98 @@
 #include <inttypes.h>
 #include <libhexagonrpc/fastrpc.h>
 #include <libhexagonrpc/interfaces/remotectl.def>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include "aee_error.h"
+#include "capture.h"
 #include "interfaces/adsp_listener.def"
 #include "iobuffer.h"
 #include "listener.h"
+#include "metrics.h"
+#include "recorder.h"
+
+#define LISTENER_RECV_BUF_SIZE 256
+#define LISTENER_ARENA_SIZE 4096
+
+// Threads started on demand to run deferred handlers
+#define LISTENER_MAX_WORKERS 8
+
+struct listener_recv_buf {
+	size_t size;
+	char *p;
+};
+
+/*
+ * Everything needed to receive, handle and reply to one request. A thread
+ * that defers a request passes its context on to the thread that runs the
+ * handler, which sends the reply and keeps the context for the next request.
+ */
+struct listener_ctx {
+	struct listener_recv_buf rbuf;
+	struct iobuf_arena *arena;
+	struct listener_reply reply;
+	struct recorder_entry entry;
+	struct fastrpc_io_buffer *decoded;
+	struct fastrpc_io_buffer *returned;
+	const struct fastrpc_function_impl *impl;
+	void *data;
+	uint32_t capture_id;
+	uint32_t result;
+	uint32_t rctx;
+	uint32_t handle;
+	uint32_t sc;
+
+	struct listener_ctx *next;
+};
+
+/*
+ * State shared by the listener threads and the thread waiting for them. The
+ * first thread to fail sets the stop flag and the result, and the remaining
+ * threads exit as soon as their current call to next2 returns, without
+ * touching the interfaces again. The waiter returns once no thread is
+ * handling a request, and the last reference frees the state, since threads
+ * may still be blocked in the kernel after the waiter returns.
+ *
+ * Every thread is either waiting in next2, handling a request, or idle and
+ * waiting for a deferred request. Requests are only deferred to idle threads
+ * while another thread waits in next2, so the remote processor can always
+ * send more requests.
+ */
+struct listener_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t stopped;
+	pthread_cond_t deferred;
+	unsigned int refs;
+	atomic_bool stop;
+	int ret;
+
+	// Becomes readable when the pool stops
+	int stop_fd;
+
+	unsigned int n_waiting;
+	unsigned int n_running;
+	unsigned int n_idle;
+	unsigned int n_workers;
+	unsigned int n_jobs;
+	struct listener_ctx *jobs;
+	struct listener_ctx **jobs_tail;
+
+	int fd;
+	size_t n_ifaces;
+	struct fastrpc_interface **ifaces;
+};
 
 static int adsp_listener_init2(int fd)
 {
-	return fastrpc2(&adsp_listener_init2_def, fd, ADSP_LISTENER_HANDLE);
+	return adsp_listener_init2_invoke(fd, ADSP_LISTENER_HANDLE, NULL);
 }
 
 static int adsp_listener_next2(int fd,
@@ -45,23 +126,77 @@ static int adsp_listener_next2(int fd,
 			       uint32_t *inbufs_len,
 			       uint32_t inbufs_size, void *inbufs)
 {
-	return fastrpc2(&adsp_listener_next2_def, fd, ADSP_LISTENER_HANDLE,
-			ret_rctx,
-			ret_res,
-			ret_outbuf_len, ret_outbuf,
-			rctx,
-			handle,
-			sc,
-			inbufs_len,
-			inbufs_size, inbufs);
+	struct adsp_listener_next2_args args = {
+		.in_nums = { ret_rctx, ret_res, },
+		.in_bufs = { { .s = ret_outbuf_len, .p = ret_outbuf, }, },
+		.out_bufs = { { .s = inbufs_size, .p = inbufs, }, },
+	};
+	int ret;
+
+	ret = adsp_listener_next2_invoke(fd, ADSP_LISTENER_HANDLE, &args);
+
+	*rctx = args.out_nums[0];
+	*handle = args.out_nums[1];
+	*sc = args.out_nums[2];
+	*inbufs_len = args.out_nums[3];
+
+	return ret;
+}
+
+static int adsp_listener_get_in_bufs2(int fd,
+				      uint32_t rctx,
+				      uint32_t offset,
+				      uint32_t *inbufs_len,
+				      uint32_t inbufs_size, void *inbufs)
+{
+	struct adsp_listener_get_in_bufs2_args args = {
+		.in_nums = { rctx, offset, },
+		.out_bufs = { { .s = inbufs_size, .p = inbufs, }, },
+	};
+	int ret;
+
+	ret = adsp_listener_get_in_bufs2_invoke(fd, ADSP_LISTENER_HANDLE, &args);
+
+	*inbufs_len = args.out_nums[0];
+
+	return ret;
 }
 
-static struct fastrpc_io_buffer *allocate_outbufs(const struct fastrpc_function_def_interp2 *def,
-						  uint32_t *first_inbuf)
+/*
+ * The receive buffer starts small and grows to fit the largest request seen
+ * so far. Requests that do not fit are received partially by next2, and the
+ * rest is fetched with get_in_bufs2.
+ */
+static int grow_recv_buf(struct listener_recv_buf *rbuf, size_t len)
+{
+	size_t size = rbuf->size;
+	char *p;
+
+	while (size < len)
+		size *= 2;
+
+	p = realloc(rbuf->p, size);
+	if (p == NULL)
+		return -1;
+
+	rbuf->size = size;
+	rbuf->p = p;
+
+	return 0;
+}
+
+/*
+ * The output buffers point into the reply that is sent to the remote
+ * processor, so the handler fills in the reply without another copy.
+ */
+static struct fastrpc_io_buffer *allocate_outbufs(struct iobuf_arena *arena,
+						  const struct fastrpc_function_def_interp2 *def,
+						  uint32_t *first_inbuf,
+						  struct listener_reply *reply)
 {
 	struct fastrpc_io_buffer *out;
 	size_t out_count;
-	size_t i, j;
+	size_t i;
 	off_t off;
 	uint32_t *sizes;
 
@@ -74,36 +209,28 @@ static struct fastrpc_io_buffer *allocate_outbufs(const struct fastrpc_function_
 	if (out_count == 0)
 		return NULL;
 
-	out = malloc(sizeof(struct fastrpc_io_buffer) * out_count);
+	out = iobuf_alloc(arena, sizeof(struct fastrpc_io_buffer) * out_count);
 	if (out == NULL)
 		return NULL;
 
 	out[0].s = def->out_nums * 4;
-	if (out[0].s) {
-		out[0].p = malloc(def->out_nums * 4);
-		if (out[0].p == NULL)
-			goto err_free_out;
-	}
 
 	off = def->out_nums && 1;
 	sizes = &first_inbuf[def->in_nums + def->in_bufs];
 
-	for (i = 0; i < def->out_bufs; i++) {
+	for (i = 0; i < def->out_bufs; i++)
 		out[off + i].s = sizes[i];
-		out[off + i].p = malloc(sizes[i]);
-		if (out[off + i].p == NULL)
-			goto err_free_prev;
-	}
 
-	return out;
+	reply->len = outbufs_calculate_size(out_count, out);
+	reply->p = iobuf_alloc(arena, reply->len);
+	if (reply->p == NULL) {
+		iobuf_free(arena, 0, out);
+		return NULL;
+	}
 
-err_free_prev:
-	for (j = 0; j < i; j++)
-		free(out[off + j].p);
+	outbufs_layout(out_count, out, reply->p);
 
-err_free_out:
-	free(out);
-	return NULL;
+	return out;
 }
 
 static int check_inbuf_sizes(const struct fastrpc_function_def_interp2 *def,
@@ -133,86 +260,119 @@ static int check_inbuf_sizes(const struct fastrpc_function_def_interp2 *def,
 	return 0;
 }
 
-static int return_for_next_invoke(int fd,
-				  uint32_t result,
-				  uint32_t *rctx,
-				  uint32_t *handle,
-				  uint32_t *sc,
-				  const struct fastrpc_io_buffer *returned,
-				  struct fastrpc_io_buffer **decoded)
+/*
+ * Return the result of the previous request and receive the next one. The
+ * output buffers of the previous request are no longer needed once they are
+ * sent, so the arena is reset before the next request is decoded into it.
+ */
+static int return_for_next_invoke(int fd, struct listener_ctx *lctx)
 {
 	struct fastrpc_decoder_context *ctx;
-	char inbufs[256];
-	char *outbufs = NULL;
+	struct listener_recv_buf *rbuf = &lctx->rbuf;
 	uint32_t inbufs_len;
-	uint32_t outbufs_len;
+	uint32_t received;
+	uint32_t msg_len;
 	int ret;
 
-	outbufs_len = outbufs_calculate_size(REMOTE_SCALARS_OUTBUFS(*sc), returned);
+	ret = adsp_listener_next2(fd,
+				  lctx->rctx, lctx->result,
+				  lctx->reply.len, lctx->reply.p,
+				  &lctx->rctx, &lctx->handle, &lctx->sc,
+				  &inbufs_len, rbuf->size, rbuf->p);
 
-	if (outbufs_len) {
-		outbufs = malloc(outbufs_len);
-		if (outbufs == NULL) {
-			perror("Could not allocate encoded output buffer");
-			return -1;
-		}
+	iobuf_arena_reset(lctx->arena);
 
-		outbufs_encode(REMOTE_SCALARS_OUTBUFS(*sc), returned, outbufs);
-	}
+	lctx->reply.len = 0;
+	lctx->reply.p = NULL;
 
-	ret = adsp_listener_next2(fd,
-				  *rctx, result,
-				  outbufs_len, outbufs,
-				  rctx, handle, sc,
-				  &inbufs_len, 256, inbufs);
 	if (ret) {
 		if (ret == -1)
 			perror("Could not fetch next FastRPC message");
 		else
 			fprintf(stderr, "Could not fetch next FastRPC message: %d\n", ret);
 
-		goto err_free_outbufs;
+		return ret;
 	}
 
-	if (inbufs_len > 256) {
-		fprintf(stderr, "Large (>256B) input buffers aren't implemented\n");
-		ret = -1;
-		goto err_free_outbufs;
+	/*
+	 * The remote processor reports the full length of the message with
+	 * every fetch, so keep fetching until everything it reports is here.
+	 */
+	received = inbufs_len < rbuf->size ? inbufs_len : rbuf->size;
+
+	while (received < inbufs_len) {
+		if (inbufs_len > rbuf->size) {
+			ret = grow_recv_buf(rbuf, inbufs_len);
+			if (ret) {
+				perror("Could not grow input buffer");
+				return ret;
+			}
+		}
+
+		ret = adsp_listener_get_in_bufs2(fd, lctx->rctx, received,
+						 &msg_len,
+						 inbufs_len - received,
+						 &rbuf->p[received]);
+		if (ret) {
+			if (ret == -1)
+				perror("Could not fetch large FastRPC message");
+			else
+				fprintf(stderr, "Could not fetch large FastRPC message: %d\n", ret);
+
+			return ret;
+		}
+
+		if (msg_len < inbufs_len) {
+			fprintf(stderr, "Short FastRPC message: %" PRIu32 " of %" PRIu32 " bytes\n",
+					msg_len, inbufs_len);
+			return -1;
+		}
+
+		received = inbufs_len;
+		inbufs_len = msg_len;
 	}
 
-	ctx = inbuf_decode_start(*sc);
+	lctx->entry.t[RECORDER_DECODE] = recorder_now();
+	lctx->entry.in_len = inbufs_len;
+
+	ctx = inbuf_decode_start(lctx->arena, lctx->sc);
 	if (!ctx) {
 		perror("Could not start decoding");
-		ret = -1;
-		goto err_free_outbufs;
+		return -1;
 	}
 
-	ret = inbuf_decode(ctx, inbufs_len, inbufs);
+	// The receive buffer is kept until the next request, so refer to it
+	ret = inbuf_decode_views(ctx, inbufs_len, rbuf->p);
 	if (ret) {
 		perror("Could not decode");
-		goto err_free_outbufs;
+		return ret;
 	}
 
 	if (!inbuf_decode_is_complete(ctx)) {
 		fprintf(stderr, "Expected more input buffers\n");
-		ret = -1;
-		goto err_free_outbufs;
+		return -1;
 	}
 
-	*decoded = inbuf_decode_finish(ctx);
+	lctx->decoded = inbuf_decode_finish(ctx);
 
-err_free_outbufs:
-	free(outbufs);
-	return ret;
+	return 0;
 }
 
-static int invoke_requested_procedure(size_t n_ifaces,
-				      struct fastrpc_interface **ifaces,
-				      uint32_t handle,
-				      uint32_t sc,
-			              uint32_t *result,
-				      const struct fastrpc_io_buffer *decoded,
-				      struct fastrpc_io_buffer **returned)
+/*
+ * Check a request and lay out its reply, returning the handler to call
+ * with the output buffers.
+ */
+static int prepare_requested_procedure(struct iobuf_arena *arena,
+				       size_t n_ifaces,
+				       struct fastrpc_interface **ifaces,
+				       uint32_t handle,
+				       uint32_t sc,
+				       uint32_t *result,
+				       const struct fastrpc_io_buffer *decoded,
+				       struct listener_reply *reply,
+				       struct recorder_entry *entry,
+				       const struct fastrpc_function_impl **impl_out,
+				       struct fastrpc_io_buffer **returned)
 {
 	const struct fastrpc_function_impl *impl;
 	uint8_t in_count;
@@ -265,58 +425,472 @@ static int invoke_requested_procedure(size_t n_ifaces,
 		return 1;
 	}
 
-	*returned = allocate_outbufs(impl->def, decoded[0].p);
+	entry->t[RECORDER_ENCODE] = recorder_now();
+
+	*returned = allocate_outbufs(arena, impl->def, decoded[0].p, reply);
 	if (*returned == NULL && out_count > 0) {
 		perror("Could not allocate output buffers");
 		*result = AEE_ENOMEMORY;
 		return 1;
 	}
 
-	*result = impl->impl(ifaces[handle]->data, decoded, *returned);
+	entry->t[RECORDER_HANDLER] = recorder_now();
+
+	*impl_out = impl;
 
 	return 0;
 }
 
-int run_fastrpc_listener(int fd,
-			 size_t n_ifaces,
-			 struct fastrpc_interface **ifaces)
+int invoke_requested_procedure(struct iobuf_arena *arena,
+			       size_t n_ifaces,
+			       struct fastrpc_interface **ifaces,
+			       uint32_t handle,
+			       uint32_t sc,
+			       uint32_t *result,
+			       const struct fastrpc_io_buffer *decoded,
+			       struct listener_reply *reply,
+			       struct recorder_entry *entry)
 {
-	struct fastrpc_io_buffer *decoded = NULL,
-				 *returned = NULL;
-	uint32_t result = 0xffffffff;
-	uint32_t handle;
-	uint32_t rctx = 0;
-	uint32_t sc = REMOTE_SCALARS_MAKE(0, 0, 0);
-	uint32_t n_outbufs = 0;
+	const struct fastrpc_function_impl *impl;
+	struct fastrpc_io_buffer *returned;
 	int ret;
 
-	ret = adsp_listener_init2(fd);
-	if (ret) {
-		fprintf(stderr, "Could not initialize the listener: %u\n", ret);
+	ret = prepare_requested_procedure(arena, n_ifaces, ifaces,
+					  handle, sc, result,
+					  decoded, reply, entry,
+					  &impl, &returned);
+	if (ret)
 		return ret;
+
+	*result = impl->impl(ifaces[handle]->data, decoded, returned);
+
+	return 0;
+}
+
+static struct listener_ctx *listener_ctx_new(void)
+{
+	struct listener_ctx *ctx;
+
+	ctx = calloc(1, sizeof(struct listener_ctx));
+	if (ctx == NULL)
+		return NULL;
+
+	// Nothing to return before the first request
+	ctx->result = 0xffffffff;
+
+	ctx->rbuf.size = LISTENER_RECV_BUF_SIZE;
+	ctx->rbuf.p = malloc(ctx->rbuf.size);
+	if (ctx->rbuf.p == NULL)
+		goto err_free_ctx;
+
+	/*
+	 * Everything allocated while handling a request comes from the arena,
+	 * which is reset for each request and only grows for requests larger
+	 * than any before.
+	 */
+	ctx->arena = iobuf_arena_create(LISTENER_ARENA_SIZE);
+	if (ctx->arena == NULL)
+		goto err_free_rbuf;
+
+	return ctx;
+
+err_free_rbuf:
+	free(ctx->rbuf.p);
+err_free_ctx:
+	free(ctx);
+	return NULL;
+}
+
+static void listener_ctx_free(struct listener_ctx *ctx)
+{
+	if (ctx == NULL)
+		return;
+
+	iobuf_arena_destroy(ctx->arena);
+	free(ctx->rbuf.p);
+	free(ctx);
+}
+
+static void finish_request(struct listener_ctx *ctx)
+{
+	capture_reply(ctx->capture_id, ctx->result, ctx->reply.len, ctx->reply.p);
+
+	ctx->entry.t[RECORDER_DONE] = recorder_now();
+	ctx->entry.handle = ctx->handle;
+	ctx->entry.sc = ctx->sc;
+	ctx->entry.result = ctx->result;
+	ctx->entry.out_len = ctx->reply.len;
+	recorder_record(&ctx->entry);
+	metrics_record(&ctx->entry);
+}
+
+static void run_handler(struct listener_ctx *ctx)
+{
+	ctx->result = ctx->impl->impl(ctx->data, ctx->decoded, ctx->returned);
+
+	finish_request(ctx);
+}
+
+// Called with the pool lock held
+static void listener_pool_fail(struct listener_pool *pool, int ret)
+{
+	if (atomic_load(&pool->stop))
+		return;
+
+	pool->ret = ret;
+	atomic_store(&pool->stop, true);
+	pthread_cond_broadcast(&pool->stopped);
+	pthread_cond_broadcast(&pool->deferred);
+
+	eventfd_write(pool->stop_fd, 1);
+}
+
+static void *run_worker_thread(void *data);
+
+/*
+ * Queue a request with a deferred handler for an idle thread, starting a new
+ * one if needed. This is called with the pool lock held. It returns the
+ * context the calling thread continues with: a new one to receive the next
+ * request if no other thread is waiting in next2, NULL if the calling thread
+ * should become idle, or the same one if the handler has to run here.
+ */
+static struct listener_ctx *defer_request(struct listener_pool *pool,
+					  struct listener_ctx *ctx)
+{
+	struct listener_ctx *next = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (!pool->n_waiting) {
+		if (pool->n_idle <= pool->n_jobs) {
+			if (pool->n_workers >= LISTENER_MAX_WORKERS)
+				return ctx;
+
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+			ret = pthread_create(&thread, &attr, run_worker_thread, pool);
+
+			pthread_attr_destroy(&attr);
+
+			if (ret)
+				return ctx;
+
+			pool->n_workers++;
+			pool->n_running++;
+			pool->refs++;
+		}
+
+		next = listener_ctx_new();
+		if (next == NULL)
+			return ctx;
 	}
 
-	while (!ret) {
-		ret = return_for_next_invoke(fd,
-					     result, &rctx, &handle, &sc,
-					     returned, &decoded);
-		if (ret)
+	ctx->next = NULL;
+	*pool->jobs_tail = ctx;
+	pool->jobs_tail = &ctx->next;
+	pool->n_jobs++;
+
+	pthread_cond_signal(&pool->deferred);
+
+	return next;
+}
+
+/*
+ * Serve requests until the pool stops. A thread starts with a context to
+ * receive requests into, or with none to wait for a deferred request.
+ */
+static void run_listener_loop(struct listener_pool *pool,
+			      struct listener_ctx *ctx)
+{
+	struct listener_ctx *next;
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+
+	/*
+	 * A thread with a context always calls next2, so that replies are sent
+	 * even after the pool stops, and checks the stop flag once it returns.
+	 */
+	while (true) {
+		if (ctx == NULL) {
+			pool->n_running--;
+			pool->n_idle++;
+
+			if (!pool->n_running)
+				pthread_cond_broadcast(&pool->stopped);
+
+			while (pool->jobs == NULL && !atomic_load(&pool->stop))
+				pthread_cond_wait(&pool->deferred, &pool->lock);
+
+			pool->n_idle--;
+			pool->n_running++;
+
+			if (atomic_load(&pool->stop))
+				break;
+
+			ctx = pool->jobs;
+			pool->jobs = ctx->next;
+			if (pool->jobs == NULL)
+				pool->jobs_tail = &pool->jobs;
+			pool->n_jobs--;
+
+			pthread_mutex_unlock(&pool->lock);
+
+			run_handler(ctx);
+
+			pthread_mutex_lock(&pool->lock);
+
+			continue;
+		}
+
+		pool->n_running--;
+		pool->n_waiting++;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		memset(&ctx->entry, 0, sizeof(ctx->entry));
+		ctx->entry.t[RECORDER_WAIT] = recorder_now();
+
+		ret = return_for_next_invoke(pool->fd, ctx);
+
+		pthread_mutex_lock(&pool->lock);
+
+		pool->n_waiting--;
+		pool->n_running++;
+
+		if (ret) {
+			listener_pool_fail(pool, ret);
+			break;
+		}
+
+		if (atomic_load(&pool->stop))
 			break;
 
-		if (returned != NULL)
-			iobuf_free(n_outbufs, returned);
+		pthread_mutex_unlock(&pool->lock);
 
-		ret = invoke_requested_procedure(n_ifaces, ifaces,
-						 handle, sc, &result,
-						 decoded, &returned);
-		if (ret)
+		ctx->capture_id = capture_request(ctx->handle, ctx->sc,
+						  ctx->entry.in_len, ctx->rbuf.p);
+
+		ret = prepare_requested_procedure(ctx->arena,
+						  pool->n_ifaces, pool->ifaces,
+						  ctx->handle, ctx->sc,
+						  &ctx->result, ctx->decoded,
+						  &ctx->reply, &ctx->entry,
+						  &ctx->impl, &ctx->returned);
+		if (ret) {
+			finish_request(ctx);
+
+			pthread_mutex_lock(&pool->lock);
+			listener_pool_fail(pool, ret);
 			break;
+		}
+
+		ctx->data = pool->ifaces[ctx->handle]->data;
+
+		if (ctx->impl->deferred) {
+			pthread_mutex_lock(&pool->lock);
+
+			next = defer_request(pool, ctx);
+			if (next != ctx) {
+				ctx = next;
+				continue;
+			}
+
+			pthread_mutex_unlock(&pool->lock);
+		}
+
+		run_handler(ctx);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	pool->n_running--;
+	if (!pool->n_running)
+		pthread_cond_broadcast(&pool->stopped);
+
+	pthread_mutex_unlock(&pool->lock);
+
+	listener_ctx_free(ctx);
+}
+
+static void listener_pool_put(struct listener_pool *pool)
+{
+	struct listener_ctx *ctx;
+	bool last;
+
+	pthread_mutex_lock(&pool->lock);
+
+	pool->refs--;
+	last = !pool->refs;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!last)
+		return;
+
+	// Deferred requests that no thread picked up before stopping
+	while (pool->jobs != NULL) {
+		ctx = pool->jobs;
+		pool->jobs = ctx->next;
+		listener_ctx_free(ctx);
+	}
 
-		if (decoded != NULL)
-			iobuf_free(REMOTE_SCALARS_INBUFS(sc), decoded);
+	close(pool->stop_fd);
+	pthread_cond_destroy(&pool->deferred);
+	pthread_cond_destroy(&pool->stopped);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+static void *run_listener_thread(void *data)
+{
+	struct listener_pool *pool = data;
+	struct listener_ctx *ctx;
+
+	ctx = listener_ctx_new();
+	if (ctx == NULL) {
+		perror("Could not allocate listener buffers");
+
+		pthread_mutex_lock(&pool->lock);
+
+		listener_pool_fail(pool, -1);
+
+		pool->n_running--;
+		if (!pool->n_running)
+			pthread_cond_broadcast(&pool->stopped);
+
+		pthread_mutex_unlock(&pool->lock);
+	} else {
+		run_listener_loop(pool, ctx);
+	}
+
+	listener_pool_put(pool);
+
+	return NULL;
+}
+
+static void *run_worker_thread(void *data)
+{
+	struct listener_pool *pool = data;
+
+	run_listener_loop(pool, NULL);
+
+	listener_pool_put(pool);
+
+	return NULL;
+}
+
+struct listener_pool *listener_start(int fd,
+				     unsigned int n_threads,
+				     size_t n_ifaces,
+				     struct fastrpc_interface **ifaces)
+{
+	struct listener_pool *pool;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned int i;
+	int ret;
+
+	ret = adsp_listener_init2(fd);
+	if (ret) {
+		fprintf(stderr, "Could not initialize the listener: %u\n", ret);
+		return NULL;
+	}
+
+	pool = malloc(sizeof(struct listener_pool));
+	if (pool == NULL) {
+		perror("Could not allocate listener threads");
+		return NULL;
+	}
+
+	pool->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (pool->stop_fd == -1) {
+		perror("Could not create listener event");
+		free(pool);
+		return NULL;
+	}
 
-		n_outbufs = REMOTE_SCALARS_OUTBUFS(sc);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->stopped, NULL);
+	pthread_cond_init(&pool->deferred, NULL);
+	atomic_init(&pool->stop, false);
+	pool->refs = 1;
+	pool->ret = 0;
+	pool->n_waiting = 0;
+	pool->n_running = 0;
+	pool->n_idle = 0;
+	pool->n_workers = 0;
+	pool->n_jobs = 0;
+	pool->jobs = NULL;
+	pool->jobs_tail = &pool->jobs;
+	pool->fd = fd;
+	pool->n_ifaces = n_ifaces;
+	pool->ifaces = ifaces;
+
+	if (n_threads < 1)
+		n_threads = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (i = 0; i < n_threads; i++) {
+		ret = pthread_create(&thread, &attr, run_listener_thread, pool);
+		if (ret) {
+			fprintf(stderr, "Could not start listener thread: %s\n",
+					strerror(ret));
+			listener_pool_fail(pool, -1);
+			break;
+		}
+
+		pool->refs++;
+		pool->n_running++;
 	}
 
+	pthread_mutex_unlock(&pool->lock);
+
+	pthread_attr_destroy(&attr);
+
+	return pool;
+}
+
+int listener_stop_fd(const struct listener_pool *pool)
+{
+	return pool->stop_fd;
+}
+
+int listener_wait(struct listener_pool *pool)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+
+	// Wait for the handlers to finish before the interfaces go away
+	while (!atomic_load(&pool->stop) || pool->n_running)
+		pthread_cond_wait(&pool->stopped, &pool->lock);
+
+	ret = pool->ret;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	listener_pool_put(pool);
+
 	return ret;
 }
+
+int run_fastrpc_listener(int fd,
+			 unsigned int n_threads,
+			 size_t n_ifaces,
+			 struct fastrpc_interface **ifaces)
+{
+	struct listener_pool *pool;
+
+	pool = listener_start(fd, n_threads, n_ifaces, ifaces);
+	if (pool == NULL)
+		return -1;
+
+	return listener_wait(pool);
+}
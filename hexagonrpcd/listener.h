@@ -23,6 +23,7 @@
 #define LISTENER_H
 
 #include <libhexagonrpc/fastrpc.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -33,6 +34,13 @@ struct fastrpc_function_impl {
 	uint32_t (*impl)(void *data,
 			 const struct fastrpc_io_buffer *inbufs,
 			 struct fastrpc_io_buffer *outbufs);
+
+	/*
+	 * Handlers that may block, such as file reads, can be deferred to
+	 * another thread while the listener receives more requests. These
+	 * handlers are called concurrently with the rest of the interface.
+	 */
+	bool deferred;
 };
 
 struct fastrpc_interface {
@@ -42,11 +50,60 @@ struct fastrpc_interface {
 	const struct fastrpc_function_impl *procs;
 };
 
+// Output buffers of a request, already in the format sent by next2
+struct listener_reply {
+	uint32_t len;
+	void *p;
+};
+
+struct recorder_entry;
+
 extern const struct fastrpc_interface localctl_interface;
 
+extern const struct fastrpc_interface apps_mem_interface;
+
 extern const struct fastrpc_interface apps_std_interface;
 
+extern const struct fastrpc_interface adspmsgd_apps_interface;
+
+/*
+ * Call the handler for a decoded request, allocating the reply from the
+ * arena. Returns 1 if the request could not be handled, with the error in
+ * result. This is also used to replay captured requests.
+ */
+int invoke_requested_procedure(struct iobuf_arena *arena,
+			       size_t n_ifaces,
+			       struct fastrpc_interface **ifaces,
+			       uint32_t handle,
+			       uint32_t sc,
+			       uint32_t *result,
+			       const struct fastrpc_io_buffer *decoded,
+			       struct listener_reply *reply,
+			       struct recorder_entry *entry);
+
+struct listener_pool;
+
+/*
+ * Start serving requests from the DSP on background threads. The file
+ * descriptor from listener_stop_fd() becomes readable when the reverse
+ * tunnel fails, and listener_wait() then returns the error once no handler
+ * is running.
+ */
+struct listener_pool *listener_start(int fd,
+				     unsigned int n_threads,
+				     size_t n_ifaces,
+				     struct fastrpc_interface **ifaces);
+int listener_stop_fd(const struct listener_pool *pool);
+int listener_wait(struct listener_pool *pool);
+
+/*
+ * Serve requests from the DSP until the reverse tunnel fails. With more than
+ * one thread, each thread waits for its own requests, so the interfaces must
+ * be safe to call concurrently. Deferred handlers run on extra threads that
+ * are started when needed, and reply when they finish.
+ */
 int run_fastrpc_listener(int fd,
+			 unsigned int n_threads,
 			 size_t n_ifaces,
 			 struct fastrpc_interface **ifaces);
 
@@ -29,10 +29,10 @@
 #include "iobuffer.h"
 #include "listener.h"
 #include "localctl.h"
+#include "registry.h"
 
 struct remotectl_ctx {
-	size_t n_ifaces;
-	struct fastrpc_interface **ifaces;
+	const struct fastrpc_registry *reg;
 };
 
 struct remotectl_open_invoke {
@@ -46,12 +46,12 @@ struct remotectl_open_return {
 };
 
 /*
- * This is a function that "opens" (searches an array for) an interface for the
- * remote endpoint to use. If it cannot find the requested interface, it
+ * This is a function that "opens" (looks up in the registry) an interface for
+ * the remote endpoint to use. If it cannot find the requested interface, it
  * returns -5 with no error string.
  *
- * Having a constant compile-time list of interfaces lets the reverse tunnel
- * easily sanitize inputs.
+ * Having a list of interfaces that is fixed once the listener starts lets the
+ * reverse tunnel easily sanitize inputs.
  *
  * The -5 error was taken from Android code.
  */
@@ -62,20 +62,18 @@ static uint32_t localctl_open(void *data,
 	struct remotectl_ctx *ctx = data;
 	const struct remotectl_open_invoke *first_in = inbufs[0].p;
 	struct remotectl_open_return *first_out = outbufs[0].p;
-	size_t i;
+	int handle;
 
 	if (((const char *) inbufs[1].p)[inbufs[1].s - 1] != 0)
 		return AEE_EBADPARM;
 
 	memset(outbufs[1].p, 0, first_in->outlen);
 
-	for (i = 0; i < ctx->n_ifaces; i++) {
-		if (!strcmp(ctx->ifaces[i]->name,
-			    inbufs[1].p)) {
-			first_out->handle = i;
-			first_out->error = 0;
-			return 0;
-		}
+	handle = fastrpc_registry_find(ctx->reg, inbufs[1].p);
+	if (handle != -1) {
+		first_out->handle = handle;
+		first_out->error = 0;
+		return 0;
 	}
 
 	fprintf(stderr, "Could not find local interface %s\n",
@@ -106,8 +104,7 @@ static uint32_t localctl_close(void *data,
 	return 0;
 }
 
-struct fastrpc_interface *fastrpc_localctl_init(size_t n_ifaces,
-						struct fastrpc_interface **ifaces)
+struct fastrpc_interface *fastrpc_localctl_init(const struct fastrpc_registry *reg)
 {
 	struct fastrpc_interface *iface;
 	struct remotectl_ctx *ctx;
@@ -122,8 +119,7 @@ struct fastrpc_interface *fastrpc_localctl_init(size_t n_ifaces,
 
 	memcpy(iface, &localctl_interface, sizeof(struct fastrpc_interface));
 
-	ctx->n_ifaces = n_ifaces;
-	ctx->ifaces = ifaces;
+	ctx->reg = reg;
 
 	iface->data = ctx;
 
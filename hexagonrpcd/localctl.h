@@ -23,14 +23,13 @@
 #define LOCALCTL_H
 
 #include "listener.h"
+#include "registry.h"
 
 /*
- * Obtain a localctl interface instance. The interfaces array must be fully
- * initialized once the interface instance is used (when run_fastrpc_listener()
- * is called).
+ * Obtain a localctl interface instance. The registry must be fully populated
+ * once the interface instance is used (when run_fastrpc_listener() is called).
  */
-struct fastrpc_interface *fastrpc_localctl_init(size_t n_ifaces,
-						struct fastrpc_interface **ifaces);
+struct fastrpc_interface *fastrpc_localctl_init(const struct fastrpc_registry *reg);
 
 void fastrpc_localctl_deinit(struct fastrpc_interface *iface);
 
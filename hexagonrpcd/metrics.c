@@ -0,0 +1,267 @@
+/*
+ * FastRPC reverse tunnel - metrics
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "eventloop.h"
+#include "listener.h"
+#include "metrics.h"
+#include "recorder.h"
+
+// The first bucket holds durations below 2^10 ns, about 1 us
+#define HIST_MIN_SHIFT 10
+#define HIST_BUCKETS 21
+
+// AEE error codes above this are counted together
+#define MAX_AEE_CODE 63
+
+// Time for a client to send an HTTP request before it gets plain text
+#define REQUEST_TIMEOUT_MS 100
+
+struct metrics_hist {
+	atomic_uint_fast64_t buckets[HIST_BUCKETS + 1];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum_ns;
+};
+
+struct metrics_method {
+	atomic_uint_fast64_t requests;
+	atomic_uint_fast64_t errors;
+};
+
+struct metrics_server {
+	size_t n_ifaces;
+	struct fastrpc_interface **ifaces;
+};
+
+static struct metrics_method methods[METRICS_MAX_HANDLES][METRICS_MAX_METHODS];
+static atomic_uint_fast64_t other_requests;
+static atomic_uint_fast64_t aee_errors[MAX_AEE_CODE + 2];
+static atomic_uint_fast64_t read_bytes;
+static atomic_int open_fds;
+
+static struct metrics_hist stages[RECORDER_DONE];
+
+static struct metrics_server server;
+
+static const char *const stage_names[] = {
+	[RECORDER_WAIT] = "wait",
+	[RECORDER_DECODE] = "decode",
+	[RECORDER_ENCODE] = "encode",
+	[RECORDER_HANDLER] = "handler",
+};
+
+static void hist_add(struct metrics_hist *hist, uint64_t ns)
+{
+	unsigned int bucket = 0;
+
+	while (bucket < HIST_BUCKETS && ns >= (UINT64_C(1) << (bucket + HIST_MIN_SHIFT)))
+		bucket++;
+
+	atomic_fetch_add_explicit(&hist->buckets[bucket], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum_ns, ns, memory_order_relaxed);
+}
+
+void metrics_record(const struct recorder_entry *entry)
+{
+	uint64_t t[RECORDER_N_STAMPS];
+	uint32_t method = REMOTE_SCALARS_METHOD(entry->sc);
+	size_t i;
+
+	if (entry->handle < METRICS_MAX_HANDLES && method < METRICS_MAX_METHODS) {
+		atomic_fetch_add_explicit(&methods[entry->handle][method].requests,
+					  1, memory_order_relaxed);
+		if (entry->result)
+			atomic_fetch_add_explicit(&methods[entry->handle][method].errors,
+						  1, memory_order_relaxed);
+	} else {
+		atomic_fetch_add_explicit(&other_requests, 1, memory_order_relaxed);
+	}
+
+	if (entry->result) {
+		i = entry->result <= MAX_AEE_CODE? entry->result: MAX_AEE_CODE + 1;
+		atomic_fetch_add_explicit(&aee_errors[i], 1, memory_order_relaxed);
+	}
+
+	// Skipped stages take no time
+	for (i = 0; i < RECORDER_N_STAMPS; i++)
+		t[i] = entry->t[i]? entry->t[i]: (i? t[i - 1]: 0);
+
+	for (i = 0; i < RECORDER_DONE; i++)
+		hist_add(&stages[i], t[i + 1] - t[i]);
+}
+
+void metrics_add_read_bytes(uint64_t bytes)
+{
+	atomic_fetch_add_explicit(&read_bytes, bytes, memory_order_relaxed);
+}
+
+void metrics_add_open_fds(int delta)
+{
+	atomic_fetch_add_explicit(&open_fds, delta, memory_order_relaxed);
+}
+
+static uint64_t load(atomic_uint_fast64_t *counter)
+{
+	return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void write_methods(FILE *f, size_t n_ifaces, struct fastrpc_interface **ifaces)
+{
+	const char *name;
+	uint64_t requests;
+	size_t i, j;
+
+	fprintf(f, "# HELP hexagonrpcd_requests_total Reverse tunnel requests by interface and method.\n"
+		   "# TYPE hexagonrpcd_requests_total counter\n");
+
+	for (i = 0; i < METRICS_MAX_HANDLES; i++) {
+		name = i < n_ifaces? ifaces[i]->name: NULL;
+
+		for (j = 0; j < METRICS_MAX_METHODS; j++) {
+			requests = load(&methods[i][j].requests);
+			if (!requests)
+				continue;
+
+			if (name != NULL)
+				fprintf(f, "hexagonrpcd_requests_total{interface=\"%s\",method=\"%zu\"} %" PRIu64 "\n",
+					name, j, requests);
+			else
+				fprintf(f, "hexagonrpcd_requests_total{handle=\"%zu\",method=\"%zu\"} %" PRIu64 "\n",
+					i, j, requests);
+		}
+	}
+
+	fprintf(f, "hexagonrpcd_requests_total{interface=\"other\"} %" PRIu64 "\n",
+		load(&other_requests));
+
+	fprintf(f, "# HELP hexagonrpcd_request_errors_total Reverse tunnel requests that failed, by interface and method.\n"
+		   "# TYPE hexagonrpcd_request_errors_total counter\n");
+
+	for (i = 0; i < METRICS_MAX_HANDLES; i++) {
+		name = i < n_ifaces? ifaces[i]->name: NULL;
+
+		for (j = 0; j < METRICS_MAX_METHODS; j++) {
+			if (!load(&methods[i][j].requests))
+				continue;
+
+			if (name != NULL)
+				fprintf(f, "hexagonrpcd_request_errors_total{interface=\"%s\",method=\"%zu\"} %" PRIu64 "\n",
+					name, j, load(&methods[i][j].errors));
+			else
+				fprintf(f, "hexagonrpcd_request_errors_total{handle=\"%zu\",method=\"%zu\"} %" PRIu64 "\n",
+					i, j, load(&methods[i][j].errors));
+		}
+	}
+}
+
+static void write_errors(FILE *f)
+{
+	uint64_t count;
+	size_t i;
+
+	fprintf(f, "# HELP hexagonrpcd_aee_errors_total Failed reverse tunnel requests by AEE error code.\n"
+		   "# TYPE hexagonrpcd_aee_errors_total counter\n");
+
+	for (i = 1; i <= MAX_AEE_CODE; i++) {
+		count = load(&aee_errors[i]);
+		if (count)
+			fprintf(f, "hexagonrpcd_aee_errors_total{code=\"%zu\"} %" PRIu64 "\n", i, count);
+	}
+
+	fprintf(f, "hexagonrpcd_aee_errors_total{code=\"other\"} %" PRIu64 "\n",
+		load(&aee_errors[MAX_AEE_CODE + 1]));
+}
+
+static void write_stages(FILE *f)
+{
+	uint64_t total;
+	size_t i, j;
+
+	fprintf(f, "# HELP hexagonrpcd_stage_seconds Time spent in each stage of a reverse tunnel request.\n"
+		   "# TYPE hexagonrpcd_stage_seconds histogram\n");
+
+	for (i = 0; i < RECORDER_DONE; i++) {
+		total = 0;
+
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			total += load(&stages[i].buckets[j]);
+			fprintf(f, "hexagonrpcd_stage_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %" PRIu64 "\n",
+				stage_names[i],
+				(double) (UINT64_C(1) << (j + HIST_MIN_SHIFT)) / 1e9,
+				total);
+		}
+
+		total += load(&stages[i].buckets[HIST_BUCKETS]);
+		fprintf(f, "hexagonrpcd_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+			stage_names[i], total);
+		fprintf(f, "hexagonrpcd_stage_seconds_sum{stage=\"%s\"} %.9f\n",
+			stage_names[i], (double) load(&stages[i].sum_ns) / 1e9);
+		fprintf(f, "hexagonrpcd_stage_seconds_count{stage=\"%s\"} %" PRIu64 "\n",
+			stage_names[i], total);
+	}
+}
+
+void metrics_write(FILE *f, size_t n_ifaces, struct fastrpc_interface **ifaces)
+{
+	write_methods(f, n_ifaces, ifaces);
+	write_errors(f);
+
+	fprintf(f, "# HELP hexagonrpcd_apps_std_read_bytes_total Bytes of files read by the remote processor.\n"
+		   "# TYPE hexagonrpcd_apps_std_read_bytes_total counter\n"
+		   "hexagonrpcd_apps_std_read_bytes_total %" PRIu64 "\n",
+		   load(&read_bytes));
+
+	fprintf(f, "# HELP hexagonrpcd_hexagonfs_open_fds Files and directories opened by the remote processor.\n"
+		   "# TYPE hexagonrpcd_hexagonfs_open_fds gauge\n"
+		   "hexagonrpcd_hexagonfs_open_fds %d\n",
+		   atomic_load_explicit(&open_fds, memory_order_relaxed));
+
+	write_stages(f);
+}
+
+static void respond(void *data, uid_t uid, const char *req, size_t len, FILE *out)
+{
+	const struct metrics_server *server = data;
+
+	// Only the start of a request matters, the path is ignored
+	if (len >= 4 && !memcmp(req, "GET ", 4)) {
+		fprintf(out, "HTTP/1.0 200 OK\r\n"
+			     "Content-Type: text/plain; version=0.0.4\r\n"
+			     "Connection: close\r\n\r\n");
+	}
+
+	metrics_write(out, server->n_ifaces, server->ifaces);
+}
+
+int metrics_start(struct event_loop *loop, const char *path,
+		  size_t n_ifaces, struct fastrpc_interface **ifaces)
+{
+	server.n_ifaces = n_ifaces;
+	server.ifaces = ifaces;
+
+	return event_loop_serve(loop, path, REQUEST_TIMEOUT_MS, respond, &server);
+}
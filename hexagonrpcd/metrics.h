@@ -0,0 +1,60 @@
+/*
+ * FastRPC reverse tunnel - metrics
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "eventloop.h"
+#include "listener.h"
+#include "recorder.h"
+
+/*
+ * Counters are kept for the first METRICS_MAX_HANDLES interfaces, and stage
+ * latencies in histograms with power-of-two buckets from 1 us to 1 s.
+ */
+#define METRICS_MAX_HANDLES 32
+#define METRICS_MAX_METHODS 32
+
+// Count a handled request from the listener
+void metrics_record(const struct recorder_entry *entry);
+
+void metrics_add_read_bytes(uint64_t bytes);
+void metrics_add_open_fds(int delta);
+
+/*
+ * Write all metrics in the Prometheus text format, naming interfaces after
+ * the given array.
+ */
+void metrics_write(FILE *f, size_t n_ifaces, struct fastrpc_interface **ifaces);
+
+/*
+ * Serve the metrics on a Unix socket at the given path from the event loop.
+ * Each client gets the metrics once, either as plain text or as an HTTP
+ * response if it sends an HTTP request. The interfaces must stay valid.
+ */
+int metrics_start(struct event_loop *loop, const char *path,
+		  size_t n_ifaces, struct fastrpc_interface **ifaces);
+
+#endif
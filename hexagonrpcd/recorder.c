@@ -0,0 +1,336 @@
+/*
+ * FastRPC reverse tunnel - flight recorder
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+/*
+ * Slots are written without locks, so a dump can run at any time, even from
+ * a signal handler. The sequence number of a slot is zero while it is being
+ * written, and readers skip slots whose sequence number changes while they
+ * are copied.
+ */
+struct recorder_slot {
+	atomic_uint_fast64_t seq;
+
+	atomic_uint_fast32_t tid;
+	atomic_uint_fast32_t handle;
+	atomic_uint_fast32_t sc;
+	atomic_uint_fast32_t result;
+	atomic_uint_fast32_t in_len;
+	atomic_uint_fast32_t out_len;
+	atomic_uint_fast64_t t[RECORDER_N_STAMPS];
+};
+
+struct recorder_writer {
+	int fd;
+	size_t len;
+	char buf[1024];
+};
+
+static struct recorder_slot slots[RECORDER_SIZE];
+static atomic_uint_fast64_t next_seq = 1;
+
+static const char *dump_path;
+static atomic_flag dumping = ATOMIC_FLAG_INIT;
+
+static const char *const stage_names[] = {
+	[RECORDER_WAIT] = "wait",
+	[RECORDER_DECODE] = "decode",
+	[RECORDER_ENCODE] = "encode",
+	[RECORDER_HANDLER] = "handler",
+};
+
+static const int crash_signals[] = {
+	SIGABRT,
+	SIGBUS,
+	SIGFPE,
+	SIGILL,
+	SIGSEGV,
+};
+
+static _Thread_local uint32_t current_tid;
+
+uint64_t recorder_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void recorder_record(const struct recorder_entry *entry)
+{
+	struct recorder_slot *slot;
+	uint64_t seq, t = 0;
+	size_t i;
+
+	if (!current_tid)
+		current_tid = syscall(SYS_gettid);
+
+	seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+	slot = &slots[seq % RECORDER_SIZE];
+
+	atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	atomic_store_explicit(&slot->tid, current_tid, memory_order_relaxed);
+	atomic_store_explicit(&slot->handle, entry->handle, memory_order_relaxed);
+	atomic_store_explicit(&slot->sc, entry->sc, memory_order_relaxed);
+	atomic_store_explicit(&slot->result, entry->result, memory_order_relaxed);
+	atomic_store_explicit(&slot->in_len, entry->in_len, memory_order_relaxed);
+	atomic_store_explicit(&slot->out_len, entry->out_len, memory_order_relaxed);
+
+	// Skipped stages take no time
+	for (i = 0; i < RECORDER_N_STAMPS; i++) {
+		if (entry->t[i])
+			t = entry->t[i];
+
+		atomic_store_explicit(&slot->t[i], t, memory_order_relaxed);
+	}
+
+	atomic_store_explicit(&slot->seq, seq, memory_order_release);
+}
+
+static int read_slot(struct recorder_slot *slot, uint64_t seq,
+		     struct recorder_entry *entry, uint32_t *tid)
+{
+	size_t i;
+
+	if (atomic_load_explicit(&slot->seq, memory_order_acquire) != seq)
+		return -1;
+
+	*tid = atomic_load_explicit(&slot->tid, memory_order_relaxed);
+	entry->handle = atomic_load_explicit(&slot->handle, memory_order_relaxed);
+	entry->sc = atomic_load_explicit(&slot->sc, memory_order_relaxed);
+	entry->result = atomic_load_explicit(&slot->result, memory_order_relaxed);
+	entry->in_len = atomic_load_explicit(&slot->in_len, memory_order_relaxed);
+	entry->out_len = atomic_load_explicit(&slot->out_len, memory_order_relaxed);
+
+	for (i = 0; i < RECORDER_N_STAMPS; i++)
+		entry->t[i] = atomic_load_explicit(&slot->t[i], memory_order_relaxed);
+
+	atomic_thread_fence(memory_order_acquire);
+
+	if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The output functions below only use write(), since stdio is not safe to use
+ * from a signal handler.
+ */
+static void flush(struct recorder_writer *w)
+{
+	size_t off = 0;
+	ssize_t ret;
+
+	while (off < w->len) {
+		ret = write(w->fd, &w->buf[off], w->len - off);
+		if (ret <= 0)
+			break;
+
+		off += ret;
+	}
+
+	w->len = 0;
+}
+
+static void put_str(struct recorder_writer *w, const char *str)
+{
+	while (*str) {
+		if (w->len == sizeof(w->buf))
+			flush(w);
+
+		w->buf[w->len++] = *str++;
+	}
+}
+
+static void put_u64(struct recorder_writer *w, uint64_t n)
+{
+	char digits[21];
+	size_t i = sizeof(digits) - 1;
+
+	digits[i] = '\0';
+
+	do {
+		digits[--i] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+
+	put_str(w, &digits[i]);
+}
+
+// Trace event timestamps are in microseconds
+static void put_us(struct recorder_writer *w, uint64_t ns)
+{
+	char frac[5] = { '.', '0', '0', '0', '\0', };
+
+	put_u64(w, ns / 1000);
+
+	frac[1] += ns / 100 % 10;
+	frac[2] += ns / 10 % 10;
+	frac[3] += ns % 10;
+	put_str(w, frac);
+}
+
+static void put_event(struct recorder_writer *w, bool *first,
+		      const struct recorder_entry *entry, uint32_t tid,
+		      enum recorder_stage stage)
+{
+	put_str(w, *first? "\n": ",\n");
+	*first = false;
+
+	put_str(w, "{\"name\":\"");
+	put_str(w, stage_names[stage]);
+	put_str(w, "\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+	put_u64(w, tid);
+	put_str(w, ",\"ts\":");
+	put_us(w, entry->t[stage]);
+	put_str(w, ",\"dur\":");
+	put_us(w, entry->t[stage + 1] - entry->t[stage]);
+
+	if (stage == RECORDER_HANDLER) {
+		put_str(w, ",\"args\":{\"handle\":");
+		put_u64(w, entry->handle);
+		put_str(w, ",\"method\":");
+		put_u64(w, entry->sc >> 24 & 0x1f);
+		put_str(w, ",\"sc\":");
+		put_u64(w, entry->sc);
+		put_str(w, ",\"in_len\":");
+		put_u64(w, entry->in_len);
+		put_str(w, ",\"out_len\":");
+		put_u64(w, entry->out_len);
+		put_str(w, ",\"result\":");
+		put_u64(w, entry->result);
+		put_str(w, "}");
+	}
+
+	put_str(w, "}");
+}
+
+int recorder_dump(int fd)
+{
+	struct recorder_writer w = { .fd = fd, .len = 0, };
+	struct recorder_entry entry;
+	uint64_t seq, last;
+	uint32_t tid;
+	bool first = true;
+	int stage;
+
+	last = atomic_load_explicit(&next_seq, memory_order_relaxed);
+	seq = last > RECORDER_SIZE? last - RECORDER_SIZE: 1;
+
+	put_str(&w, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	for (; seq < last; seq++) {
+		if (read_slot(&slots[seq % RECORDER_SIZE], seq, &entry, &tid))
+			continue;
+
+		for (stage = RECORDER_WAIT; stage < RECORDER_DONE; stage++)
+			put_event(&w, &first, &entry, tid, stage);
+	}
+
+	put_str(&w, "\n]}\n");
+	flush(&w);
+
+	return 0;
+}
+
+static void dump_to_path(void)
+{
+	int fd = STDERR_FILENO;
+
+	if (atomic_flag_test_and_set(&dumping))
+		return;
+
+	if (dump_path != NULL)
+		fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (fd != -1) {
+		recorder_dump(fd);
+
+		if (fd != STDERR_FILENO)
+			close(fd);
+	}
+
+	atomic_flag_clear(&dumping);
+}
+
+static void handle_dump_signal(int sig)
+{
+	int saved_errno = errno;
+
+	dump_to_path();
+
+	errno = saved_errno;
+}
+
+// The handler is reset before it runs, so raising the signal again crashes
+static void handle_crash_signal(int sig)
+{
+	dump_to_path();
+	raise(sig);
+}
+
+int recorder_install(const char *path)
+{
+	struct sigaction sa;
+	size_t i;
+	int ret;
+
+	dump_path = path;
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+
+	sa.sa_handler = handle_dump_signal;
+	sa.sa_flags = SA_RESTART;
+
+	ret = sigaction(SIGUSR1, &sa, NULL);
+	if (ret)
+		return ret;
+
+	sa.sa_handler = handle_crash_signal;
+	sa.sa_flags = SA_RESETHAND;
+
+	for (i = 0; i < sizeof(crash_signals) / sizeof(*crash_signals); i++) {
+		ret = sigaction(crash_signals[i], &sa, NULL);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * FastRPC reverse tunnel - flight recorder
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+/*
+ * The flight recorder keeps the last RECORDER_SIZE reverse tunnel requests in
+ * a fixed ring buffer. Recording a request takes no locks and no system calls
+ * besides reading the clock, so it is always enabled.
+ */
+#define RECORDER_SIZE 4096
+
+// Each stage lasts from its own timestamp to the timestamp of the next one
+enum recorder_stage {
+	RECORDER_WAIT,
+	RECORDER_DECODE,
+	RECORDER_ENCODE,
+	RECORDER_HANDLER,
+	RECORDER_DONE,
+	RECORDER_N_STAMPS,
+};
+
+struct recorder_entry {
+	uint32_t handle;
+	uint32_t sc;
+	uint32_t result;
+	uint32_t in_len;
+	uint32_t out_len;
+
+	// CLOCK_MONOTONIC time in nanoseconds, or 0 if the stage was skipped
+	uint64_t t[RECORDER_N_STAMPS];
+};
+
+uint64_t recorder_now(void);
+
+void recorder_record(const struct recorder_entry *entry);
+
+/*
+ * Write the recorded requests as Chrome trace event JSON, which Perfetto and
+ * chrome://tracing can open. This is async-signal-safe.
+ */
+int recorder_dump(int fd);
+
+/*
+ * Dump the recorder to the file at path, or to stderr if path is NULL, when
+ * SIGUSR1 is received or the process crashes.
+ */
+int recorder_install(const char *path);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * FastRPC reverse tunnel - interface registry
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "listener.h"
+#include "registry.h"
+
+// The index is kept at most half full
+#define REGISTRY_INIT_SIZE 16
+
+struct registry_entry {
+	struct fastrpc_interface *iface;
+	fastrpc_module_deinit_fn deinit;
+	void *module;
+};
+
+struct fastrpc_registry {
+	size_t n_ifaces;
+	size_t max_ifaces;
+	struct fastrpc_interface **ifaces;
+	struct registry_entry *entries;
+
+	/*
+	 * Open-addressed hash table of handles plus one, so that zero marks
+	 * an empty slot.
+	 */
+	size_t index_size;
+	uint32_t *index;
+};
+
+static uint32_t hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char) *name++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static void index_insert(uint32_t *index, size_t size,
+			 const char *name, uint32_t handle)
+{
+	size_t i = hash_name(name) & (size - 1);
+
+	while (index[i])
+		i = (i + 1) & (size - 1);
+
+	index[i] = handle + 1;
+}
+
+static int grow(struct fastrpc_registry *reg)
+{
+	struct fastrpc_interface **ifaces;
+	struct registry_entry *entries;
+	uint32_t *index;
+	size_t max = reg->max_ifaces * 2;
+	size_t i;
+
+	ifaces = realloc(reg->ifaces, sizeof(*ifaces) * max);
+	if (ifaces == NULL)
+		return -1;
+
+	reg->ifaces = ifaces;
+
+	entries = realloc(reg->entries, sizeof(*entries) * max);
+	if (entries == NULL)
+		return -1;
+
+	reg->entries = entries;
+
+	index = calloc(max * 2, sizeof(*index));
+	if (index == NULL)
+		return -1;
+
+	for (i = 0; i < reg->n_ifaces; i++)
+		index_insert(index, max * 2, ifaces[i]->name, i);
+
+	free(reg->index);
+	reg->index = index;
+	reg->index_size = max * 2;
+	reg->max_ifaces = max;
+
+	return 0;
+}
+
+struct fastrpc_registry *fastrpc_registry_new(void)
+{
+	struct fastrpc_registry *reg;
+
+	reg = calloc(1, sizeof(*reg));
+	if (reg == NULL)
+		return NULL;
+
+	reg->max_ifaces = REGISTRY_INIT_SIZE / 2;
+	reg->index_size = REGISTRY_INIT_SIZE;
+
+	reg->ifaces = malloc(sizeof(*reg->ifaces) * reg->max_ifaces);
+	reg->entries = malloc(sizeof(*reg->entries) * reg->max_ifaces);
+	reg->index = calloc(reg->index_size, sizeof(*reg->index));
+	if (reg->ifaces == NULL || reg->entries == NULL || reg->index == NULL) {
+		fastrpc_registry_free(reg);
+		return NULL;
+	}
+
+	return reg;
+}
+
+void fastrpc_registry_free(struct fastrpc_registry *reg)
+{
+	struct registry_entry *entry;
+	size_t i;
+
+	if (reg == NULL)
+		return;
+
+	for (i = reg->n_ifaces; i > 0; i--) {
+		entry = &reg->entries[i - 1];
+
+		if (entry->deinit != NULL)
+			entry->deinit(entry->iface);
+
+		if (entry->module != NULL)
+			dlclose(entry->module);
+	}
+
+	free(reg->index);
+	free(reg->entries);
+	free(reg->ifaces);
+	free(reg);
+}
+
+static int add_entry(struct fastrpc_registry *reg,
+		     struct fastrpc_interface *iface,
+		     fastrpc_module_deinit_fn deinit,
+		     void *module)
+{
+	uint32_t handle;
+	int ret;
+
+	if (iface == NULL || iface->name == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (fastrpc_registry_find(reg, iface->name) != -1) {
+		fprintf(stderr, "Interface %s is already registered\n", iface->name);
+		errno = EEXIST;
+		return -1;
+	}
+
+	if (reg->n_ifaces == reg->max_ifaces) {
+		ret = grow(reg);
+		if (ret)
+			return ret;
+	}
+
+	handle = reg->n_ifaces;
+
+	reg->ifaces[handle] = iface;
+	reg->entries[handle].iface = iface;
+	reg->entries[handle].deinit = deinit;
+	reg->entries[handle].module = module;
+	index_insert(reg->index, reg->index_size, iface->name, handle);
+
+	reg->n_ifaces++;
+
+	return handle;
+}
+
+int fastrpc_registry_add(struct fastrpc_registry *reg,
+			 struct fastrpc_interface *iface,
+			 fastrpc_module_deinit_fn deinit)
+{
+	int ret;
+
+	ret = add_entry(reg, iface, deinit, NULL);
+	if (ret == -1 && iface != NULL && deinit != NULL)
+		deinit(iface);
+
+	return ret;
+}
+
+int fastrpc_registry_load(struct fastrpc_registry *reg, const char *path)
+{
+	fastrpc_module_deinit_fn deinit;
+	fastrpc_module_init_fn init;
+	struct fastrpc_interface *iface;
+	void *module;
+	int ret;
+
+	module = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (module == NULL) {
+		fprintf(stderr, "Could not load %s: %s\n", path, dlerror());
+		return -1;
+	}
+
+	*(void **) &init = dlsym(module, FASTRPC_MODULE_INIT);
+	if (init == NULL) {
+		fprintf(stderr, "Could not find %s in %s\n",
+				FASTRPC_MODULE_INIT, path);
+		goto err;
+	}
+
+	*(void **) &deinit = dlsym(module, FASTRPC_MODULE_DEINIT);
+
+	iface = init();
+	if (iface == NULL) {
+		fprintf(stderr, "Could not initialize interface from %s\n", path);
+		goto err;
+	}
+
+	ret = add_entry(reg, iface, deinit, module);
+	if (ret == -1) {
+		if (deinit != NULL)
+			deinit(iface);
+		goto err;
+	}
+
+	return ret;
+
+err:
+	dlclose(module);
+	return -1;
+}
+
+int fastrpc_registry_find(const struct fastrpc_registry *reg, const char *name)
+{
+	size_t i = hash_name(name) & (reg->index_size - 1);
+	uint32_t handle;
+
+	while (reg->index[i]) {
+		handle = reg->index[i] - 1;
+
+		if (!strcmp(reg->ifaces[handle]->name, name))
+			return handle;
+
+		i = (i + 1) & (reg->index_size - 1);
+	}
+
+	return -1;
+}
+
+struct fastrpc_interface **fastrpc_registry_ifaces(const struct fastrpc_registry *reg,
+						   size_t *n_ifaces)
+{
+	*n_ifaces = reg->n_ifaces;
+
+	return reg->ifaces;
+}
@@ -0,0 +1,82 @@
+/*
+ * FastRPC reverse tunnel - interface registry
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "listener.h"
+
+/*
+ * Shared objects loaded with fastrpc_registry_load() export this function,
+ * which returns a new interface instance, or NULL on failure. They can also
+ * export FASTRPC_MODULE_DEINIT to free the instance when the registry is
+ * freed.
+ */
+#define FASTRPC_MODULE_INIT "fastrpc_module_init"
+#define FASTRPC_MODULE_DEINIT "fastrpc_module_deinit"
+
+typedef struct fastrpc_interface *(*fastrpc_module_init_fn)(void);
+typedef void (*fastrpc_module_deinit_fn)(struct fastrpc_interface *iface);
+
+/*
+ * The registry assigns each interface the next handle and indexes interfaces
+ * by name. Interfaces are added before the listener starts, and the registry
+ * is only read afterwards.
+ */
+struct fastrpc_registry;
+
+struct fastrpc_registry *fastrpc_registry_new(void);
+
+/*
+ * Free the registry. Each interface is passed to the deinit function it was
+ * added with, and loaded modules are unloaded.
+ */
+void fastrpc_registry_free(struct fastrpc_registry *reg);
+
+/*
+ * Add an interface and return its handle, or -1 if the name is already taken
+ * or memory could not be allocated. The deinit function may be NULL, and is
+ * called right away if the interface could not be added.
+ */
+int fastrpc_registry_add(struct fastrpc_registry *reg,
+			 struct fastrpc_interface *iface,
+			 fastrpc_module_deinit_fn deinit);
+
+/*
+ * Load an interface from a shared object and add it. Returns the handle, or -1
+ * on failure.
+ */
+int fastrpc_registry_load(struct fastrpc_registry *reg, const char *path);
+
+// Return the handle of the interface with the given name, or -1.
+int fastrpc_registry_find(const struct fastrpc_registry *reg, const char *name);
+
+/*
+ * Return the interfaces, indexed by handle, for run_fastrpc_listener(). The
+ * array is valid until another interface is added.
+ */
+struct fastrpc_interface **fastrpc_registry_ifaces(const struct fastrpc_registry *reg,
+						   size_t *n_ifaces);
+
+#endif
@@ -0,0 +1,323 @@
+/*
+ * FastRPC reverse tunnel - capture replay
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/interfaces/remotectl.def>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adspmsgd.h"
+#include "apps_mem.h"
+#include "apps_std.h"
+#include "capture.h"
+#include "iobuffer.h"
+#include "listener.h"
+#include "localctl.h"
+#include "recorder.h"
+#include "registry.h"
+#include "rpcd_builder.h"
+
+struct replay_stats {
+	uint64_t n_requests;
+	uint64_t n_failed;
+	uint64_t n_mismatched;
+	uint64_t total_ns;
+	uint64_t max_ns;
+
+	// Results of replayed requests, indexed by capture id
+	size_t n_results;
+	uint32_t *results;
+};
+
+static void print_usage(const char *argv0)
+{
+	printf("Usage: %s [options] CAPTURE\n\n", argv0);
+	printf("Replay reverse tunnel requests captured by hexagonrpcd -C\n\n"
+	       "Options:\n"
+	       "\t-d DSP\t\tDSP name (default: "")\n"
+	       "\t-m MODULE\tLoad a reverse tunnel interface from a shared object\n"
+	       "\t-R DIR\t\tRoot directory of served files (default: /usr/share/qcom/)\n"
+	       "\t-T\t\tKeep the original timing between requests\n");
+}
+
+static void sleep_until(uint64_t ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000,
+		.tv_nsec = ns % 1000000000,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static int store_result(struct replay_stats *stats, uint32_t id, uint32_t result)
+{
+	uint32_t *results;
+	size_t n = stats->n_results;
+
+	if (id >= n) {
+		while (id >= n)
+			n = n? n * 2: 256;
+
+		results = realloc(stats->results, sizeof(*results) * n);
+		if (results == NULL)
+			return -1;
+
+		memset(&results[stats->n_results], 0xff,
+		       sizeof(*results) * (n - stats->n_results));
+
+		stats->results = results;
+		stats->n_results = n;
+	}
+
+	stats->results[id] = result;
+
+	return 0;
+}
+
+static int replay_request(struct iobuf_arena *arena,
+			  size_t n_ifaces, struct fastrpc_interface **ifaces,
+			  const struct capture_record *rec, const char *buf,
+			  struct replay_stats *stats)
+{
+	struct fastrpc_decoder_context *ctx;
+	struct fastrpc_io_buffer *decoded;
+	struct listener_reply reply = { .len = 0, .p = NULL, };
+	struct recorder_entry entry;
+	uint32_t result;
+	uint64_t start, elapsed;
+	int ret;
+
+	memset(&entry, 0, sizeof(entry));
+
+	iobuf_arena_reset(arena);
+
+	start = recorder_now();
+
+	ctx = inbuf_decode_start(arena, rec->sc);
+	if (ctx == NULL)
+		return -1;
+
+	ret = inbuf_decode_views(ctx, rec->len, buf);
+	if (ret || !inbuf_decode_is_complete(ctx)) {
+		fprintf(stderr, "Could not decode request %" PRIu32 "\n", rec->id);
+		return -1;
+	}
+
+	decoded = inbuf_decode_finish(ctx);
+
+	ret = invoke_requested_procedure(arena, n_ifaces, ifaces,
+					 rec->handle, rec->sc, &result,
+					 decoded, &reply, &entry);
+
+	elapsed = recorder_now() - start;
+
+	stats->n_requests++;
+	stats->total_ns += elapsed;
+	if (elapsed > stats->max_ns)
+		stats->max_ns = elapsed;
+
+	if (ret)
+		stats->n_failed++;
+
+	return store_result(stats, rec->id, result);
+}
+
+static int replay(FILE *f, bool timed,
+		  size_t n_ifaces, struct fastrpc_interface **ifaces,
+		  struct replay_stats *stats)
+{
+	struct capture_record rec;
+	struct iobuf_arena *arena;
+	char *buf = NULL;
+	size_t buf_size = 0;
+	uint64_t epoch;
+	int ret;
+
+	arena = iobuf_arena_create(4096);
+	if (arena == NULL)
+		return -1;
+
+	epoch = recorder_now();
+
+	while (!(ret = capture_read(f, &rec, &buf, &buf_size))) {
+		if (rec.type == CAPTURE_REPLY) {
+			if (rec.id < stats->n_results
+			 && stats->results[rec.id] != rec.result)
+				stats->n_mismatched++;
+
+			continue;
+		}
+
+		if (timed)
+			sleep_until(epoch + rec.time);
+
+		ret = replay_request(arena, n_ifaces, ifaces, &rec, buf, stats);
+		if (ret)
+			break;
+	}
+
+	free(buf);
+	iobuf_arena_destroy(arena);
+
+	return ret == 1? 0: -1;
+}
+
+int main(int argc, char *argv[])
+{
+	struct fastrpc_interface **ifaces;
+	struct fastrpc_registry *reg;
+	struct hexagonfs_tree *tree;
+	struct replay_stats stats;
+	const char *device_dir = "/usr/share/qcom/";
+	const char *dsp = "";
+	const char **modules;
+	size_t n_modules = 0;
+	size_t n_ifaces;
+	size_t i;
+	bool timed = false;
+	FILE *f;
+	int ret, opt;
+
+	modules = malloc(sizeof(const char *) * argc);
+	if (modules == NULL)
+		return 1;
+
+	reg = fastrpc_registry_new();
+	if (reg == NULL)
+		goto err_free_modules;
+
+	while ((opt = getopt(argc, argv, "d:m:R:T")) != -1) {
+		switch (opt) {
+			case 'd':
+				dsp = optarg;
+				break;
+			case 'm':
+				modules[n_modules] = optarg;
+				n_modules++;
+				break;
+			case 'R':
+				device_dir = optarg;
+				break;
+			case 'T':
+				timed = true;
+				break;
+			default:
+				print_usage(argv[0]);
+				goto err_free_reg;
+		}
+	}
+
+	if (optind != argc - 1) {
+		print_usage(argv[0]);
+		goto err_free_reg;
+	}
+
+	/*
+	 * The interfaces are registered in the same order as in hexagonrpcd,
+	 * so that the captured handles refer to the same interfaces, as long as
+	 * modules are given in the same order too.
+	 */
+	ret = fastrpc_registry_add(reg, fastrpc_localctl_init(reg),
+				   fastrpc_localctl_deinit);
+	if (ret != REMOTECTL_HANDLE)
+		goto err_free_reg;
+
+	tree = construct_root_dir(device_dir, dsp);
+	if (tree == NULL)
+		goto err_free_reg;
+
+	ret = fastrpc_registry_add(reg, fastrpc_apps_std_init(tree),
+				   fastrpc_apps_std_deinit);
+	hexagonfs_tree_put(tree);
+	if (ret == -1)
+		goto err_free_reg;
+
+	ret = fastrpc_registry_add(reg, fastrpc_adspmsgd_init(NULL),
+				   fastrpc_adspmsgd_deinit);
+	if (ret == -1)
+		goto err_free_reg;
+
+	// There is no remote processor to map shared buffers into
+	ret = fastrpc_registry_add(reg, fastrpc_apps_mem_init(-1),
+				   fastrpc_apps_mem_deinit);
+	if (ret == -1)
+		goto err_free_reg;
+
+	for (i = 0; i < n_modules; i++) {
+		ret = fastrpc_registry_load(reg, modules[i]);
+		if (ret == -1)
+			goto err_free_reg;
+	}
+
+	f = fopen(argv[optind], "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Could not open %s: %s\n", argv[optind], strerror(errno));
+		goto err_free_reg;
+	}
+
+	ret = capture_read_header(f);
+	if (ret) {
+		fprintf(stderr, "%s is not a capture\n", argv[optind]);
+		goto err_close;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+
+	ifaces = fastrpc_registry_ifaces(reg, &n_ifaces);
+
+	ret = replay(f, timed, n_ifaces, ifaces, &stats);
+	if (ret)
+		fprintf(stderr, "Replay stopped early\n");
+
+	printf("Replayed %" PRIu64 " requests in %" PRIu64 " us\n",
+	       stats.n_requests, stats.total_ns / 1000);
+
+	if (stats.n_requests) {
+		printf("Latency: mean %" PRIu64 " us, max %" PRIu64 " us\n",
+		       stats.total_ns / stats.n_requests / 1000,
+		       stats.max_ns / 1000);
+	}
+
+	printf("Failed: %" PRIu64 ", different results: %" PRIu64 "\n",
+	       stats.n_failed, stats.n_mismatched);
+
+	free(stats.results);
+	fclose(f);
+	fastrpc_registry_free(reg);
+	free(modules);
+
+	return ret? 1: 0;
+
+err_close:
+	fclose(f);
+err_free_reg:
+	fastrpc_registry_free(reg);
+err_free_modules:
+	free(modules);
+	return 1;
+}
@@ -21,85 +21,44 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <libhexagonrpc/fastrpc.h>
 #include <libhexagonrpc/interfaces/remotectl.def>
+#include <libhexagonrpc/remotectl.h>
 #include <misc/fastrpc.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
+#include "adspmsgd.h"
 #include "aee_error.h"
+#include "apps_mem.h"
 #include "apps_std.h"
+#include "broker.h"
+#include "capture.h"
+#include "eventloop.h"
 #include "hexagonfs.h"
 #include "interfaces/adsp_default_listener.def"
 #include "listener.h"
 #include "localctl.h"
+#include "metrics.h"
+#include "recorder.h"
+#include "registry.h"
 #include "rpcd_builder.h"
 
-static int remotectl_open(int fd, char *name, struct fastrpc_context **ctx, void (*err_cb)(const char *err))
-{
-	uint32_t handle;
-	int32_t dlret;
-	char err[256];
-	int ret;
-
-	ret = fastrpc2(&remotectl_open_def, fd, REMOTECTL_HANDLE,
-		       strlen(name) + 1, name,
-		       &handle,
-		       &dlret,
-		       256, err);
-
-	if (ret == -1) {
-		err_cb(strerror(errno));
-		return ret;
-	}
-
-	if (dlret == -5) {
-		err_cb(err);
-		return dlret;
-	} else if (dlret) {
-		err_cb(aee_strerror[dlret]);
-		return dlret;
-	}
-
-	*ctx = fastrpc_create_context(fd, handle);
-
-	return ret;
-}
-
-static int remotectl_close(struct fastrpc_context *ctx, void (*err_cb)(const char *err))
-{
-	uint32_t dlret;
-	char err[256];
-	int ret;
-
-	ret = fastrpc2(&remotectl_close_def, ctx->fd, REMOTECTL_HANDLE,
-		       ctx->handle,
-		       &dlret,
-		       256, err);
-
-	if (ret == -1) {
-		err_cb(strerror(errno));
-		return ret;
-	}
-
-	if (dlret) {
-		err_cb(aee_strerror[dlret]);
-		return dlret;
-	}
-
-	fastrpc_destroy_context(ctx);
-
-	return ret;
-}
-
 static int adsp_default_listener_register(struct fastrpc_context *ctx)
 {
-	return fastrpc(&adsp_default_listener_register_def, ctx);
+	return adsp_default_listener_register_invoke(ctx->fd, ctx->handle, NULL);
 }
 
 static void remotectl_err(const char *err)
@@ -110,9 +69,12 @@ static void remotectl_err(const char *err)
 static int register_fastrpc_listener(int fd)
 {
 	struct fastrpc_context *ctx;
-	int ret;
+	int ret, close_ret;
 
 	ret = remotectl_open(fd, "adsp_default_listener", &ctx, remotectl_err);
+	if (ret > 0)
+		remotectl_err(aee_strerror[ret]);
+
 	if (ret)
 		return 1;
 
@@ -123,7 +85,10 @@ static int register_fastrpc_listener(int fd)
 	}
 
 err:
-	remotectl_close(ctx, remotectl_err);
+	close_ret = remotectl_close(ctx, remotectl_err);
+	if (close_ret > 0)
+		remotectl_err(aee_strerror[close_ret]);
+
 	return ret;
 }
 
@@ -132,11 +97,20 @@ static void print_usage(const char *argv0)
 	printf("Usage: %s [options] -f DEVICE\n\n", argv0);
 	printf("Server for FastRPC remote procedure calls from Qualcomm DSPs\n\n"
 	       "Options:\n"
+	       "\t-b SOCKET\tAccept clients on a Unix socket\n"
+	       "\t-B MODE\t\tPermissions of the client socket (default: 0600)\n"
+	       "\t-c SOCKET\tAccept control commands on a Unix socket\n"
+	       "\t-C FILE\t\tCapture reverse tunnel requests to FILE for hexagonrpc-replay\n"
 	       "\t-d DSP\t\tDSP name (default: "")\n"
 	       "\t-f DEVICE\tFastRPC device node to attach to\n"
+	       "\t-l FILE\t\tAppend DSP log messages to FILE (default: stdout)\n"
+	       "\t-m MODULE\tLoad a reverse tunnel interface from a shared object\n"
+	       "\t-M SOCKET\tServe Prometheus metrics on a Unix socket\n"
 	       "\t-p PROGRAM\tRun client program with shared file descriptor\n"
-	       "\t-R DIR\t\tRoot directory of served files (default: /usr/share/qcom/)\n"
-	       "\t-s\t\tAttach to sensorspd\n");
+	       "\t-R DIR\t\tRoot directory of served files, rebuilt on SIGHUP (default: /usr/share/qcom/)\n"
+	       "\t-s\t\tAttach to sensorspd\n"
+	       "\t-t THREADS\tNumber of listener threads (default: 1)\n"
+	       "\t-T FILE\t\tWrite recent requests to FILE on SIGUSR1 or crash (default: stderr)\n");
 }
 
 static int setup_environment(int fd)
@@ -160,88 +134,393 @@ static int setup_environment(int fd)
 	return ret;
 }
 
-static int terminate_clients(size_t n_pids, const pid_t *pids)
+struct rpcd_client {
+	const char *prog;
+	pid_t pid;
+	int pidfd;
+	struct event_source *src;
+};
+
+struct rpcd {
+	struct event_loop *loop;
+	struct listener_pool *listener;
+	struct event_source *listener_src;
+	int listener_ret;
+	size_t n_clients;
+	struct rpcd_client *clients;
+
+	struct fastrpc_interface *apps_std;
+	struct fastrpc_interface *adspmsgd;
+	char device_dir[PATH_MAX];
+	const char *dsp;
+};
+
+static int terminate_clients(size_t n_clients, const struct rpcd_client *clients)
 {
 	size_t i;
 
-	for (i = 0; i < n_pids; i++) {
-		kill(pids[i], SIGTERM);
+	// Clients that were already reaped may have had their PID reused
+	for (i = 0; i < n_clients; i++) {
+		if (clients[i].pid > 0)
+			kill(clients[i].pid, SIGTERM);
 	}
 
 	return 0;
 }
 
-static int start_clients(size_t n_progs, const char **progs, pid_t *pids)
+static int start_clients(size_t n_progs, const char **progs,
+			 struct rpcd_client *clients,
+			 const sigset_t *child_mask)
 {
 	size_t i;
 
 	for (i = 0; i < n_progs; i++) {
-		pids[i] = fork();
-		if (pids[i] == -1) {
+		clients[i].prog = progs[i];
+		clients[i].pidfd = -1;
+		clients[i].src = NULL;
+
+		clients[i].pid = fork();
+		if (clients[i].pid == -1) {
 			perror("Could not fork process");
-			terminate_clients(i, pids);
+			terminate_clients(i, clients);
 			return 1;
 		}
 
-		if (pids[i] == 0) {
+		if (clients[i].pid == 0) {
+			sigprocmask(SIG_SETMASK, child_mask, NULL);
 			execl("/usr/bin/env", "/usr/bin/env", progs[i], (const char *) NULL);
 			exit(1);
 		}
+
+		clients[i].pidfd = syscall(SYS_pidfd_open, clients[i].pid, 0);
+		if (clients[i].pidfd == -1)
+			perror("Could not watch client process");
 	}
 
 	return 0;
 }
 
-static void *start_reverse_tunnel(int fd, const char *device_dir, const char *dsp)
+static void handle_client_exit(struct event_loop *loop,
+			       struct event_source *src,
+			       uint32_t events,
+			       void *data)
 {
-	struct fastrpc_interface **ifaces;
-	struct hexagonfs_dirent *root_dir;
-	size_t n_ifaces = 2;
+	struct rpcd_client *client = data;
+	int status;
+
+	if (waitpid(client->pid, &status, WNOHANG) <= 0)
+		return;
+
+	if (WIFEXITED(status))
+		printf("Client %s exited with status %d\n", client->prog, WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		printf("Client %s was killed by signal %d\n", client->prog, WTERMSIG(status));
+
+	event_source_remove(loop, src);
+	close(client->pidfd);
+
+	client->pid = 0;
+	client->pidfd = -1;
+	client->src = NULL;
+}
+
+/*
+ * Rebuild the served directory tree, optionally from a new root directory,
+ * and switch the apps_std interface to it without reattaching to the DSP.
+ */
+static int reload_root_dir(struct rpcd *rpcd, const char *device_dir)
+{
+	struct hexagonfs_tree *tree;
+	int ret;
+
+	if (device_dir == NULL)
+		device_dir = rpcd->device_dir;
+	else if (strlen(device_dir) >= sizeof(rpcd->device_dir))
+		return -ENAMETOOLONG;
+
+	tree = construct_root_dir(device_dir, rpcd->dsp);
+	if (tree == NULL)
+		return -ENOMEM;
+
+	ret = fastrpc_apps_std_reload(rpcd->apps_std, tree);
+	hexagonfs_tree_put(tree);
+	if (ret)
+		return ret;
+
+	if (device_dir != rpcd->device_dir)
+		strcpy(rpcd->device_dir, device_dir);
+
+	return 0;
+}
+
+static void handle_signal(struct event_loop *loop,
+			  struct event_source *src,
+			  uint32_t events,
+			  void *data)
+{
+	struct rpcd *rpcd = data;
+	struct signalfd_siginfo info;
+	ssize_t ret;
+
+	ret = read(event_source_fd(src), &info, sizeof(info));
+	if (ret != sizeof(info))
+		return;
+
+	if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM) {
+		printf("Received %s, exiting\n", strsignal(info.ssi_signo));
+		event_loop_quit(loop, 0);
+	} else if (info.ssi_signo == SIGHUP) {
+		printf("Received %s, reloading %s\n",
+		       strsignal(info.ssi_signo), rpcd->device_dir);
+
+		ret = reload_root_dir(rpcd, NULL);
+		if (ret)
+			fprintf(stderr, "Could not reload %s: %s\n",
+					rpcd->device_dir, strerror(-ret));
+	}
+}
+
+static void handle_listener_stop(struct event_loop *loop,
+				 struct event_source *src,
+				 uint32_t events,
+				 void *data)
+{
+	struct rpcd *rpcd = data;
+
+	event_source_remove(loop, src);
+	rpcd->listener_src = NULL;
+
+	rpcd->listener_ret = listener_wait(rpcd->listener);
+	rpcd->listener = NULL;
+
+	event_loop_quit(loop, rpcd->listener_ret);
+}
+
+static void respond_control(void *data, uid_t uid, const char *req, size_t len, FILE *out)
+{
+	struct rpcd *rpcd = data;
+	size_t cmd_len = strcspn(req, " \r\n");
+	char *arg;
+	size_t i;
+	int ret;
+
+	if (cmd_len == 6 && !strncmp(req, "status", 6)) {
+		fprintf(out, "listener: %s\n", rpcd->listener != NULL? "running": "stopped");
+
+		for (i = 0; i < rpcd->n_clients; i++) {
+			if (rpcd->clients[i].pid > 0)
+				fprintf(out, "client %s: running (%d)\n",
+					rpcd->clients[i].prog, rpcd->clients[i].pid);
+			else
+				fprintf(out, "client %s: exited\n", rpcd->clients[i].prog);
+		}
+	} else if (cmd_len == 4 && !strncmp(req, "stop", 4)) {
+		fprintf(out, "stopping\n");
+		event_loop_quit(rpcd->loop, 0);
+	} else if (cmd_len == 6 && !strncmp(req, "reload", 6)) {
+		// The request is NULL-terminated and owned by the server
+		arg = (char *) req + cmd_len + strspn(req + cmd_len, " ");
+		arg[strcspn(arg, "\r\n")] = '\0';
+
+		// Other users must not choose the files served to the DSP
+		if (*arg != '\0' && uid != geteuid()) {
+			fprintf(out, "could not reload: %s\n", strerror(EPERM));
+			return;
+		}
+
+		ret = reload_root_dir(rpcd, *arg != '\0'? arg: NULL);
+		if (ret)
+			fprintf(out, "could not reload: %s\n", strerror(-ret));
+		else
+			fprintf(out, "reloaded %s\n", rpcd->device_dir);
+	} else {
+		fprintf(out, "Commands:\n"
+			     "\tstatus\t\tShow the listener and client processes\n"
+			     "\treload [DIR]\tRebuild the served files, optionally from DIR\n"
+			     "\tstop\t\tTerminate the clients and exit\n");
+	}
+}
+
+static int watch_clients(struct rpcd *rpcd)
+{
+	struct rpcd_client *client;
+	size_t i;
+
+	for (i = 0; i < rpcd->n_clients; i++) {
+		client = &rpcd->clients[i];
+
+		if (client->pidfd == -1)
+			continue;
+
+		client->src = event_loop_add(rpcd->loop, client->pidfd, EPOLLIN,
+					     handle_client_exit, client);
+		if (client->src == NULL) {
+			perror("Could not watch client process");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static struct fastrpc_registry *setup_reverse_tunnel(struct rpcd *rpcd, int fd,
+						     const char *log_path,
+						     size_t n_modules,
+						     const char **modules)
+{
+	struct fastrpc_registry *reg;
+	struct hexagonfs_tree *tree;
+	size_t i;
 	int ret;
 
-	ifaces = malloc(sizeof(struct fastrpc_interface) * n_ifaces);
-	if (ifaces == NULL)
+	reg = fastrpc_registry_new();
+	if (reg == NULL)
 		return NULL;
 
-	root_dir = construct_root_dir(device_dir, dsp);
+	tree = construct_root_dir(rpcd->device_dir, rpcd->dsp);
+	if (tree == NULL)
+		goto err;
 
 	/*
-	 * The apps_remotectl interface patiently waits for this function to
-	 * fully populate the ifaces array as long as it receives a pointer to
-	 * it.
+	 * The apps_remotectl interface patiently waits for the registry to be
+	 * fully populated, and needs to be the first interface so that it gets
+	 * the hardcoded handle.
 	 */
-	ifaces[REMOTECTL_HANDLE] = fastrpc_localctl_init(n_ifaces, ifaces);
+	ret = fastrpc_registry_add(reg, fastrpc_localctl_init(reg),
+				   fastrpc_localctl_deinit);
+	if (ret != REMOTECTL_HANDLE)
+		goto err;
 
 	// Dynamic interfaces with no hardcoded handle
-	ifaces[1] = fastrpc_apps_std_init(root_dir);
+	rpcd->apps_std = fastrpc_apps_std_init(tree);
+	hexagonfs_tree_put(tree);
 
-	ret = register_fastrpc_listener(fd);
-	if (ret)
+	ret = fastrpc_registry_add(reg, rpcd->apps_std, fastrpc_apps_std_deinit);
+	if (ret == -1)
 		goto err;
 
-	run_fastrpc_listener(fd, n_ifaces, ifaces);
+	rpcd->adspmsgd = fastrpc_adspmsgd_init(log_path);
 
-	fastrpc_localctl_deinit(ifaces[REMOTECTL_HANDLE]);
+	ret = fastrpc_registry_add(reg, rpcd->adspmsgd,
+				   fastrpc_adspmsgd_deinit);
+	if (ret == -1)
+		goto err;
 
-	free(ifaces);
+	ret = fastrpc_registry_add(reg, fastrpc_apps_mem_init(fd),
+				   fastrpc_apps_mem_deinit);
+	if (ret == -1)
+		goto err;
 
-	return NULL;
+	for (i = 0; i < n_modules; i++) {
+		ret = fastrpc_registry_load(reg, modules[i]);
+		if (ret == -1)
+			goto err;
+	}
+
+	ret = register_fastrpc_listener(fd);
+	if (ret)
+		goto err;
+
+	return reg;
 
 err:
-	free(ifaces);
+	fastrpc_registry_free(reg);
 
 	return NULL;
 }
 
+/*
+ * Serve the reverse tunnel and react to signals, client exits and control
+ * requests until the listener fails or hexagonrpcd is asked to stop.
+ */
+static int run_main_loop(struct rpcd *rpcd, int fd, unsigned int n_threads,
+			 struct fastrpc_registry *reg,
+			 const sigset_t *signals,
+			 const char *metrics_path,
+			 const char *control_path)
+{
+	struct fastrpc_interface **ifaces;
+	size_t n_ifaces;
+	int sigfd;
+	int ret;
+
+	sigfd = signalfd(-1, signals, SFD_CLOEXEC);
+	if (sigfd == -1) {
+		perror("Could not watch signals");
+		return -1;
+	}
+
+	if (event_loop_add(rpcd->loop, sigfd, EPOLLIN, handle_signal, rpcd) == NULL) {
+		perror("Could not watch signals");
+		ret = -1;
+		goto err_close_sigfd;
+	}
+
+	ret = watch_clients(rpcd);
+	if (ret)
+		goto err_close_sigfd;
+
+	ifaces = fastrpc_registry_ifaces(reg, &n_ifaces);
+
+	if (metrics_path != NULL) {
+		ret = metrics_start(rpcd->loop, metrics_path, n_ifaces, ifaces);
+		if (ret)
+			goto err_close_sigfd;
+	}
+
+	if (control_path != NULL) {
+		ret = event_loop_serve(rpcd->loop, control_path, 1000,
+				       respond_control, rpcd);
+		if (ret)
+			goto err_close_sigfd;
+	}
+
+	rpcd->listener = listener_start(fd, n_threads, n_ifaces, ifaces);
+	if (rpcd->listener == NULL) {
+		ret = -1;
+		goto err_close_sigfd;
+	}
+
+	rpcd->listener_src = event_loop_add(rpcd->loop,
+					    listener_stop_fd(rpcd->listener),
+					    EPOLLIN, handle_listener_stop, rpcd);
+	if (rpcd->listener_src == NULL) {
+		perror("Could not watch the listener");
+		ret = -1;
+		goto err_close_sigfd;
+	}
+
+	ret = event_loop_run(rpcd->loop);
+
+err_close_sigfd:
+	close(sigfd);
+
+	return ret;
+}
+
 int main(int argc, char* argv[])
 {
 	char *fastrpc_node = NULL;
+	const char *broker_path = NULL;
+	mode_t broker_mode = 0600;
+	const char *control_path = NULL;
+	const char *trace_path = NULL;
+	const char *capture_path = NULL;
+	const char *metrics_path = NULL;
+	const char *log_path = NULL;
 	const char *device_dir = "/usr/share/qcom/";
 	const char *dsp = "";
 	const char **progs;
-	pid_t *pids;
+	const char **modules;
+	struct fastrpc_registry *reg;
+	struct rpcd rpcd = { .listener = NULL, };
+	sigset_t signals, old_signals;
 	size_t n_progs = 0;
+	size_t n_modules = 0;
+	unsigned int n_threads = 1;
+	char *end;
 	int fd, ret, opt;
+	int status = 4;
 	bool attach_sns = false;
 
 	progs = malloc(sizeof(const char *) * argc);
@@ -250,20 +529,53 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	pids = malloc(sizeof(pid_t) * argc);
-	if (pids == NULL) {
-		perror("Could not list client PIDs");
+	rpcd.clients = malloc(sizeof(struct rpcd_client) * argc);
+	if (rpcd.clients == NULL) {
+		perror("Could not list client processes");
 		goto err_free_progs;
 	}
 
-	while ((opt = getopt(argc, argv, "d:f:p:R:s")) != -1) {
+	modules = malloc(sizeof(const char *) * argc);
+	if (modules == NULL) {
+		perror("Could not list interface modules");
+		goto err_free_clients;
+	}
+
+	while ((opt = getopt(argc, argv, "b:B:c:C:d:f:l:m:M:p:R:st:T:")) != -1) {
 		switch (opt) {
+			case 'b':
+				broker_path = optarg;
+				break;
+			case 'B':
+				broker_mode = strtoul(optarg, &end, 8);
+				if (*optarg == '\0' || *end != '\0'
+				 || broker_mode & ~0777) {
+					fprintf(stderr, "Invalid socket mode: %s\n", optarg);
+					goto err_free_modules;
+				}
+				break;
+			case 'c':
+				control_path = optarg;
+				break;
+			case 'C':
+				capture_path = optarg;
+				break;
 			case 'd':
 				dsp = optarg;
 				break;
 			case 'f':
 				fastrpc_node = optarg;
 				break;
+			case 'l':
+				log_path = optarg;
+				break;
+			case 'm':
+				modules[n_modules] = optarg;
+				n_modules++;
+				break;
+			case 'M':
+				metrics_path = optarg;
+				break;
 			case 'p':
 				progs[n_progs] = optarg;
 				n_progs++;
@@ -274,15 +586,58 @@ int main(int argc, char* argv[])
 			case 's':
 				attach_sns = true;
 				break;
+			case 't':
+				n_threads = strtoul(optarg, NULL, 10);
+				if (n_threads < 1 || n_threads > 64) {
+					fprintf(stderr, "Invalid thread count: %s\n", optarg);
+					goto err_free_modules;
+				}
+				break;
+			case 'T':
+				trace_path = optarg;
+				break;
 			default:
 				print_usage(argv[0]);
-				goto err_free_pids;
+				goto err_free_modules;
 		}
 	}
 
 	if (!fastrpc_node) {
 		print_usage(argv[0]);
-		goto err_free_pids;
+		goto err_free_modules;
+	}
+
+	if (strlen(device_dir) >= sizeof(rpcd.device_dir)) {
+		fprintf(stderr, "Root directory is too long: %s\n", device_dir);
+		goto err_free_modules;
+	}
+
+	strcpy(rpcd.device_dir, device_dir);
+	rpcd.dsp = dsp;
+
+	/*
+	 * Signals are received by the main loop, so they are blocked before any
+	 * thread is started, and unblocked again in client processes.
+	 */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+
+	ret = recorder_install(trace_path);
+	if (ret) {
+		perror("Could not set up the flight recorder");
+		goto err_free_modules;
+	}
+
+	if (capture_path != NULL) {
+		ret = capture_start(capture_path);
+		if (ret) {
+			fprintf(stderr, "Could not open capture file (%s): %s\n",
+					capture_path, strerror(errno));
+			goto err_free_modules;
+		}
 	}
 
 	printf("Starting %s (%s) on %s\n", argv[0], attach_sns? "INIT_ATTACH_SNS": "INIT_ATTACH", fastrpc_node);
@@ -290,7 +645,7 @@ int main(int argc, char* argv[])
 	fd = open(fastrpc_node, O_RDWR);
 	if (fd < 0) {
 		fprintf(stderr, "Could not open FastRPC node (%s): %s\n", fastrpc_node, strerror(errno));
-		goto err_free_pids;
+		goto err_free_modules;
 	}
 
 	if (attach_sns)
@@ -308,24 +663,63 @@ int main(int argc, char* argv[])
 		goto err_close_dev;
 	}
 
-	ret = start_clients(n_progs, progs, pids);
-	if (ret)
+	if (broker_path != NULL) {
+		ret = broker_start(fd, broker_path, broker_mode);
+		if (ret)
+			goto err_close_dev;
+	}
+
+	rpcd.loop = event_loop_new();
+	if (rpcd.loop == NULL) {
+		perror("Could not create the main loop");
 		goto err_close_dev;
+	}
+
+	ret = start_clients(n_progs, progs, rpcd.clients, &old_signals);
+	if (ret)
+		goto err_free_loop;
+
+	rpcd.n_clients = n_progs;
 
-	start_reverse_tunnel(fd, device_dir, dsp);
+	reg = setup_reverse_tunnel(&rpcd, fd, log_path, n_modules, modules);
+	if (reg != NULL) {
+		ret = run_main_loop(&rpcd, fd, n_threads, reg, &signals,
+				    metrics_path, control_path);
 
-	terminate_clients(n_progs, pids);
+		// Stopping on request is a success, but losing the listener is not
+		status = ret || rpcd.listener_ret ? 1 : 0;
 
+		/*
+		 * Listener threads may still be running handlers if hexagonrpcd
+		 * was asked to stop, so the interfaces stay until it exits, but
+		 * the buffered remote processor logs are written out now.
+		 */
+		fastrpc_adspmsgd_stop(rpcd.adspmsgd);
+
+		if (rpcd.listener == NULL)
+			fastrpc_registry_free(reg);
+	}
+
+	terminate_clients(rpcd.n_clients, rpcd.clients);
+
+	event_loop_free(rpcd.loop);
+	capture_stop();
 	close(fd);
-	free(pids);
+	free(modules);
+	free(rpcd.clients);
 	free(progs);
 
-	return 0;
+	return status;
 
+err_free_loop:
+	event_loop_free(rpcd.loop);
 err_close_dev:
 	close(fd);
-err_free_pids:
-	free(pids);
+	capture_stop();
+err_free_modules:
+	free(modules);
+err_free_clients:
+	free(rpcd.clients);
 err_free_progs:
 	free(progs);
 	return 4;
@@ -20,7 +20,6 @@
  */
 
 #include <stdarg.h>
-#include <stdlib.h>
 #include <string.h>
 
 #include "hexagonfs.h"
@@ -33,7 +32,8 @@
 #define SNS_REG_CONFIG		"/sensors/sns_reg.conf"
 #define SYSFS_SOCINFO		"/socinfo/"
 
-static struct hexagonfs_dirent *hfs_mkdir(const char *name, size_t n_ents, ...)
+static struct hexagonfs_dirent *hfs_mkdir(struct hexagonfs_tree *tree,
+					  const char *name, size_t n_ents, ...)
 {
 	struct hexagonfs_dirent *dir;
 	struct hexagonfs_dirent **list;
@@ -41,19 +41,25 @@ static struct hexagonfs_dirent *hfs_mkdir(const char *name, size_t n_ents, ...)
 	va_list va;
 	size_t i;
 
-	list = malloc(sizeof(struct hexagonfs_dirent *) * (n_ents + 1));
+	list = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent *) * (n_ents + 1));
 	if (list == NULL)
 		return NULL;
 
-	dir = malloc(sizeof(struct hexagonfs_dirent));
+	dir = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent));
 	if (dir == NULL)
-		goto err_free_list;
+		return NULL;
 
+	/*
+	 * Nothing is freed on failure, since the allocations belong to the
+	 * tree and go away when the caller drops it.
+	 */
 	va_start(va, n_ents);
 	for (i = 0; i < n_ents; i++) {
 		ent = va_arg(va, struct hexagonfs_dirent *);
-		if (ent == NULL)
-			goto err_free_dir;
+		if (ent == NULL) {
+			va_end(va);
+			return NULL;
+		}
 
 		list[i] = ent;
 	}
@@ -66,19 +72,14 @@ static struct hexagonfs_dirent *hfs_mkdir(const char *name, size_t n_ents, ...)
 	dir->u.dir = list;
 
 	return dir;
-
-err_free_dir:
-	free(dir);
-err_free_list:
-	free(list);
-	return NULL;
 }
 
-static struct hexagonfs_dirent *hfs_map(const char *name, const char *path)
+static struct hexagonfs_dirent *hfs_map(struct hexagonfs_tree *tree,
+					const char *name, const char *path)
 {
 	struct hexagonfs_dirent *file;
 
-	file = malloc(sizeof(struct hexagonfs_dirent));
+	file = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent));
 	if (file == NULL)
 		return NULL;
 
@@ -89,11 +90,12 @@ static struct hexagonfs_dirent *hfs_map(const char *name, const char *path)
 	return file;
 }
 
-static struct hexagonfs_dirent *hfs_map_or_empty(const char *name, const char *path)
+static struct hexagonfs_dirent *hfs_map_or_empty(struct hexagonfs_tree *tree,
+						 const char *name, const char *path)
 {
 	struct hexagonfs_dirent *file;
 
-	file = malloc(sizeof(struct hexagonfs_dirent));
+	file = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent));
 	if (file == NULL)
 		return NULL;
 
@@ -107,23 +109,29 @@ static struct hexagonfs_dirent *hfs_map_or_empty(const char *name, const char *p
 /*
  * Construct the root directory
  *
- * TODO: Make this free()-able with reference counts
+ * Everything is allocated from the returned tree, which holds one reference
+ * for the caller.
  */
-struct hexagonfs_dirent *construct_root_dir(const char *prefix, const char *dsp)
+struct hexagonfs_tree *construct_root_dir(const char *prefix, const char *dsp)
 {
 	char *acdbdata, *dsp_libs, *sns_cfg, *sns_reg, *sns_reg_config, *socinfo;
 	size_t n_prefix;
 	struct hexagonfs_dirent *persist_dir, *vendor_dir;
+	struct hexagonfs_tree *tree;
+
+	tree = hexagonfs_tree_new();
+	if (tree == NULL)
+		return NULL;
 
 	n_prefix = strlen(prefix);
 
-	acdbdata = malloc(n_prefix + strlen(ACDBDATA) + 1);
-	sns_cfg = malloc(n_prefix + strlen(SENSORS_CONFIG) + 1);
-	sns_reg = malloc(n_prefix + strlen(SENSORS_REGISTRY) + 1);
-	sns_reg_config = malloc(n_prefix + strlen(SNS_REG_CONFIG) + 1);
-	socinfo = malloc(n_prefix + strlen(SYSFS_SOCINFO) + 1);
+	acdbdata = hexagonfs_tree_alloc(tree, n_prefix + strlen(ACDBDATA) + 1);
+	sns_cfg = hexagonfs_tree_alloc(tree, n_prefix + strlen(SENSORS_CONFIG) + 1);
+	sns_reg = hexagonfs_tree_alloc(tree, n_prefix + strlen(SENSORS_REGISTRY) + 1);
+	sns_reg_config = hexagonfs_tree_alloc(tree, n_prefix + strlen(SNS_REG_CONFIG) + 1);
+	socinfo = hexagonfs_tree_alloc(tree, n_prefix + strlen(SYSFS_SOCINFO) + 1);
 
-	dsp_libs = malloc(n_prefix + strlen(DSP_LIBS) + strlen(dsp) + 1);
+	dsp_libs = hexagonfs_tree_alloc(tree, n_prefix + strlen(DSP_LIBS) + strlen(dsp) + 1);
 
 	if (acdbdata != NULL) {
 		strcpy(acdbdata, prefix);
@@ -160,10 +168,10 @@ struct hexagonfs_dirent *construct_root_dir(const char *prefix, const char *dsp)
 	 * Some platforms need this in / and some need it in /mnt/vendor. Form
 	 * a hard link between both locations.
 	 */
-	persist_dir = hfs_mkdir("persist", 1,
-				hfs_mkdir("sensors", 1,
-					hfs_mkdir("registry", 1,
-						hfs_map("registry", sns_reg)
+	persist_dir = hfs_mkdir(tree, "persist", 1,
+				hfs_mkdir(tree, "sensors", 1,
+					hfs_mkdir(tree, "registry", 1,
+						hfs_map(tree, "registry", sns_reg)
 					)
 				)
 		      );
@@ -172,38 +180,44 @@ struct hexagonfs_dirent *construct_root_dir(const char *prefix, const char *dsp)
 	 * Some platforms need vendor in / and some need it in /system. Form
 	 * a hard link between both locations.
 	 */
-	vendor_dir = hfs_mkdir("vendor", 1,
-				hfs_mkdir("etc", 2,
-					hfs_mkdir("sensors", 2,
-						hfs_map_or_empty("config", sns_cfg),
-						hfs_map("sns_reg_config", sns_reg_config)
+	vendor_dir = hfs_mkdir(tree, "vendor", 1,
+				hfs_mkdir(tree, "etc", 2,
+					hfs_mkdir(tree, "sensors", 2,
+						hfs_map_or_empty(tree, "config", sns_cfg),
+						hfs_map(tree, "sns_reg_config", sns_reg_config)
 					),
-					hfs_map("acdbdata", acdbdata)
+					hfs_map(tree, "acdbdata", acdbdata)
 				)
 			);
 
-	return hfs_mkdir("/", 6,
-			hfs_mkdir("mnt", 1,
-				hfs_mkdir("vendor", 1,
+	tree->root = hfs_mkdir(tree, "/", 6,
+			hfs_mkdir(tree, "mnt", 1,
+				hfs_mkdir(tree, "vendor", 1,
 					persist_dir
 				)
 			),
 			persist_dir,
-			hfs_mkdir("sys", 1,
-				hfs_mkdir("devices", 1,
-					hfs_map_or_empty("soc0", socinfo)
+			hfs_mkdir(tree, "sys", 1,
+				hfs_mkdir(tree, "devices", 1,
+					hfs_map_or_empty(tree, "soc0", socinfo)
 				)
 			),
-			hfs_mkdir("system", 1,
+			hfs_mkdir(tree, "system", 1,
 				vendor_dir
 			),
-			hfs_mkdir("usr", 1,
-				hfs_mkdir("lib", 1,
-					hfs_mkdir("qcom", 1,
-						hfs_map_or_empty("adsp", dsp_libs)
+			hfs_mkdir(tree, "usr", 1,
+				hfs_mkdir(tree, "lib", 1,
+					hfs_mkdir(tree, "qcom", 1,
+						hfs_map_or_empty(tree, "adsp", dsp_libs)
 					)
 				)
 			),
 			vendor_dir
 		);
+	if (tree->root == NULL) {
+		hexagonfs_tree_put(tree);
+		return NULL;
+	}
+
+	return tree;
 }
@@ -0,0 +1,64 @@
+/*
+ * FastRPC API Replacement - asynchronous invocations
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_ASYNC_H
+#define LIBHEXAGONRPC_ASYNC_H
+
+#include <libhexagonrpc/batch.h>
+
+/*
+ * An asynchronous queue submits remote method calls to a worker pool that
+ * grows with the number of calls in flight, and reports their completion
+ * through an eventfd. The eventfd is readable (in semaphore mode) whenever
+ * there are completed calls that have not been collected, so it can be watched
+ * with poll() or epoll.
+ */
+struct fastrpc_async_queue;
+
+struct fastrpc_async_queue *fastrpc_async_queue_create(int fd);
+
+/*
+ * Destroy the queue after waiting for every submitted call to complete.
+ * Completed calls that were not collected are dropped.
+ */
+void fastrpc_async_queue_destroy(struct fastrpc_async_queue *queue);
+
+int fastrpc_async_eventfd(const struct fastrpc_async_queue *queue);
+
+/*
+ * Submit a call without waiting for it to complete. The call and its argument
+ * arrays must stay valid until the call is collected. The call pointer is the
+ * completion token that fastrpc_async_collect() returns.
+ *
+ * Returns 0 on success, or -1 if the call could not be submitted.
+ */
+int fastrpc_async_submit(struct fastrpc_async_queue *queue,
+			 struct fastrpc_call *call);
+
+/*
+ * Collect a completed call, in order of completion. Its ret and err members
+ * hold the result.
+ *
+ * Returns NULL if no call has completed yet.
+ */
+struct fastrpc_call *fastrpc_async_collect(struct fastrpc_async_queue *queue);
+
+#endif /* LIBHEXAGONRPC_ASYNC_H */
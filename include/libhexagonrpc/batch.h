@@ -0,0 +1,56 @@
+/*
+ * FastRPC API Replacement - batched invocations
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_BATCH_H
+#define LIBHEXAGONRPC_BATCH_H
+
+#include <libhexagonrpc/fastrpc.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A single remote method call, with its arguments in the same form as
+ * fastrpc2_array(). The ret and err members are filled in with the return
+ * value and errno of the ioctl when the call completes.
+ */
+struct fastrpc_call {
+	const struct fastrpc_function_def_interp2 *def;
+	uint32_t handle;
+
+	const uint32_t *in_nums;
+	const struct fastrpc_io_buffer *in_bufs;
+	uint32_t *const *out_nums;
+	const struct fastrpc_io_buffer *out_bufs;
+
+	int ret;
+	int err;
+};
+
+/*
+ * Invoke independent remote methods concurrently on the library's worker
+ * pool, and wait for all of them to complete. The calls may run in any order.
+ *
+ * Returns 0 if every call succeeded, or -1 if any of them failed. The result
+ * of each call is in its ret and err members.
+ */
+int fastrpc_batch(int fd, size_t n_calls, struct fastrpc_call *calls);
+
+#endif /* LIBHEXAGONRPC_BATCH_H */
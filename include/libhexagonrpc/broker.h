@@ -0,0 +1,89 @@
+/*
+ * FastRPC API Replacement - session broker protocol
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_BROKER_H
+#define LIBHEXAGONRPC_BROKER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/*
+ * The broker in hexagonrpcd lets processes that do not share its file
+ * descriptor make calls on it.
+ *
+ * A client connects to the broker's Unix socket and receives a shared memory
+ * file descriptor through SCM_RIGHTS, together with a single byte of data. The
+ * shared memory holds a number of request slots and two rings of slot
+ * indices: the submission ring, which the client writes and the broker reads,
+ * and the completion ring, which the broker writes and the client reads.
+ *
+ * To make a call, the client fills a free slot, adds its index to the
+ * submission ring and writes a byte to the socket. The broker makes the call
+ * and writes the results to the slot, adds its index to the completion ring
+ * and writes a byte to the socket.
+ *
+ * The buffers of a request are stored in the data area of its slot. Each
+ * buffer is described by an offset into the data area and a length, in the
+ * same order as in the ioctl argument list.
+ */
+
+#define HEXAGONRPC_BROKER_MAGIC 0x6b727062
+#define HEXAGONRPC_BROKER_VERSION 1
+
+#define HEXAGONRPC_BROKER_SLOTS 16
+#define HEXAGONRPC_BROKER_MAX_BUFS 16
+#define HEXAGONRPC_BROKER_SLOT_DATA 65536
+
+struct hexagonrpc_broker_buf {
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct hexagonrpc_broker_slot {
+	uint32_t handle;
+	uint32_t sc;
+	int32_t ret;
+	int32_t err;
+	struct hexagonrpc_broker_buf bufs[HEXAGONRPC_BROKER_MAX_BUFS];
+	uint64_t data[HEXAGONRPC_BROKER_SLOT_DATA / sizeof(uint64_t)];
+};
+
+/*
+ * The producer stores a slot index at head % HEXAGONRPC_BROKER_SLOTS before
+ * incrementing head, and the consumer increments tail after loading it.
+ */
+struct hexagonrpc_broker_ring {
+	atomic_uint head;
+	atomic_uint tail;
+	uint32_t slots[HEXAGONRPC_BROKER_SLOTS];
+};
+
+struct hexagonrpc_broker_shm {
+	uint32_t magic;
+	uint32_t version;
+
+	struct hexagonrpc_broker_ring sq;
+	struct hexagonrpc_broker_ring cq;
+
+	struct hexagonrpc_broker_slot slots[HEXAGONRPC_BROKER_SLOTS];
+};
+
+#endif /* LIBHEXAGONRPC_BROKER_H */
@@ -22,7 +22,9 @@
 #ifndef FASTRPC_H
 #define FASTRPC_H
 
+#include <misc/fastrpc.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -41,9 +43,28 @@
 #define REMOTE_SCALARS_INBUFS(sc) (((sc) >> 16) & 0xff)
 #define REMOTE_SCALARS_OUTBUFS(sc) (((sc) >> 8) & 0xff)
 
+struct fastrpc_thread_scratch;
+
+/*
+ * A context is not modified by calls, so it can be shared between threads.
+ *
+ * Contexts created with fastrpc_create_context_mt() additionally give each
+ * thread its own scratch memory for the ioctl arguments and first buffers,
+ * instead of taking it from the stack. The scratch memory grows to fit the
+ * largest method called through the context, and new threads start with that
+ * size, so calls from any number of threads are allocation-free and lock-free
+ * after the first call from each thread.
+ */
 struct fastrpc_context {
 	int fd;
 	uint32_t handle;
+
+	struct fastrpc_thread_scratch *scratch;
+};
+
+struct fastrpc_io_buffer {
+	uint32_t s;
+	void *p;
 };
 
 struct fastrpc_function_def_interp2 {
@@ -54,12 +75,102 @@ struct fastrpc_function_def_interp2 {
 	uint8_t out_bufs;
 };
 
+/*
+ * A call plan is the part of an invocation that only depends on the method
+ * definition: the number of ioctl-level buffers, the scalars word, and the
+ * sizes of the first input and output buffers. It can be computed once per
+ * method and reused for every call.
+ *
+ * Each call through a plan needs scratch_len bytes of scratch memory, aligned
+ * to 8 bytes, for the ioctl argument list and the first input and output
+ * buffers. The same scratch memory can be reused for sequential calls.
+ */
+struct fastrpc_call_plan {
+	const struct fastrpc_function_def_interp2 *def;
+	uint32_t sc;
+	uint8_t in_count;
+	uint8_t out_count;
+	size_t inbuf_len;
+	size_t outbuf_len;
+	size_t scratch_len;
+};
+
+#define FASTRPC_IN_COUNT(innums, inbufs, outbufs) \
+	((inbufs) + ((innums) || (inbufs) || (outbufs)))
+#define FASTRPC_OUT_COUNT(outnums, outbufs) \
+	((outbufs) + ((outnums) != 0))
+
+#define FASTRPC_SCRATCH_LEN(innums, inbufs, outnums, outbufs)		\
+	((sizeof(struct fastrpc_invoke_args)				\
+	  * (FASTRPC_IN_COUNT(innums, inbufs, outbufs)			\
+	   + FASTRPC_OUT_COUNT(outnums, outbufs))			\
+	  + sizeof(uint32_t) * ((innums) + (inbufs) + (outbufs))	\
+	  + sizeof(uint32_t) * (outnums)				\
+	  + 7) & ~(size_t) 7)
+
+#define FASTRPC_CALL_PLAN_INIT(fdef, mid, innums, inbufs, outnums, outbufs) \
+	{								\
+		.def = (fdef),						\
+		.sc = REMOTE_SCALARS_MAKE(mid,				\
+			FASTRPC_IN_COUNT(innums, inbufs, outbufs),	\
+			FASTRPC_OUT_COUNT(outnums, outbufs)),		\
+		.in_count = FASTRPC_IN_COUNT(innums, inbufs, outbufs),	\
+		.out_count = FASTRPC_OUT_COUNT(outnums, outbufs),	\
+		.inbuf_len = sizeof(uint32_t)				\
+			   * ((innums) + (inbufs) + (outbufs)),		\
+		.outbuf_len = sizeof(uint32_t) * (outnums),		\
+		.scratch_len = FASTRPC_SCRATCH_LEN(innums, inbufs,	\
+						   outnums, outbufs),	\
+	}
+
+/*
+ * Issue FASTRPC_IOCTL_INVOKE with a prepared argument list, or forward it if
+ * the file descriptor is a broker connection, recording the call in the
+ * per-method statistics from libhexagonrpc/stats.h.
+ */
+int fastrpc_invoke(int fd, uint32_t handle, uint32_t sc,
+		   struct fastrpc_invoke_args *args);
+
 struct fastrpc_context *fastrpc_create_context(int fd, uint32_t handle);
+struct fastrpc_context *fastrpc_create_context_mt(int fd, uint32_t handle);
+void fastrpc_destroy_context(struct fastrpc_context *ctx);
 
-static inline void fastrpc_destroy_context(struct fastrpc_context *ctx)
-{
-	free(ctx);
-}
+void fastrpc_plan_init(struct fastrpc_call_plan *plan,
+		       const struct fastrpc_function_def_interp2 *def);
+
+/*
+ * Invoke a remote method through a call plan. If scratch is NULL, the scratch
+ * memory is taken from the stack.
+ */
+int vfastrpc_plan(const struct fastrpc_call_plan *plan, void *scratch,
+		  int fd, uint32_t handle, va_list arg_list);
+int fastrpc_plan(const struct fastrpc_call_plan *plan, void *scratch,
+		 int fd, uint32_t handle, ...);
+
+/*
+ * Invoke a remote method with arguments from arrays. Each array must have as
+ * many elements as the method definition specifies for that kind of argument,
+ * and may be NULL if there are none. The arrays are not modified, so they can
+ * be reused across calls.
+ */
+int fastrpc_plan_array(const struct fastrpc_call_plan *plan, void *scratch,
+		       int fd, uint32_t handle,
+		       const uint32_t *in_nums,
+		       const struct fastrpc_io_buffer *in_bufs,
+		       uint32_t *const *out_nums,
+		       const struct fastrpc_io_buffer *out_bufs);
+int fastrpc2_array(const struct fastrpc_function_def_interp2 *def,
+		   int fd, uint32_t handle,
+		   const uint32_t *in_nums,
+		   const struct fastrpc_io_buffer *in_bufs,
+		   uint32_t *const *out_nums,
+		   const struct fastrpc_io_buffer *out_bufs);
+int fastrpc_array(const struct fastrpc_function_def_interp2 *def,
+		  const struct fastrpc_context *ctx,
+		  const uint32_t *in_nums,
+		  const struct fastrpc_io_buffer *in_bufs,
+		  uint32_t *const *out_nums,
+		  const struct fastrpc_io_buffer *out_bufs);
 
 int vfastrpc2(const struct fastrpc_function_def_interp2 *def,
 	      int fd, uint32_t handle, va_list arg_list);
@@ -23,6 +23,117 @@
 #define LIBHEXAGONRPC_INTERFACE_H
 
 #include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/mem.h>
+#include <misc/fastrpc.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Arrays in argument structs need at least one element to be valid C
+#define HEXAGONRPC_ARRAY_LEN(n) ((n) ? (n) : 1)
+
+/*
+ * This is the body of every typed stub. The counts are constants in each stub,
+ * so the compiler can unroll the loops and drop the unused arrays after
+ * inlining.
+ *
+ * The output words are received directly in the caller's argument struct,
+ * which is laid out the same way as the first output buffer.
+ */
+static inline int hexagonrpc_stub_invoke(int fd, uint32_t handle, uint32_t sc,
+					 int innums, int inbufs,
+					 int outnums, int outbufs,
+					 struct fastrpc_invoke_args *args,
+					 uint32_t *inbuf,
+					 const uint32_t *in_nums,
+					 const struct fastrpc_io_buffer *in_bufs,
+					 uint32_t *out_nums,
+					 const struct fastrpc_io_buffer *out_bufs)
+{
+	int in_count = FASTRPC_IN_COUNT(innums, inbufs, outbufs);
+	int off;
+	int i;
+
+	if (in_count) {
+		args[0].ptr = (__u64) inbuf;
+		args[0].length = sizeof(uint32_t) * (innums + inbufs + outbufs);
+		args[0].fd = -1;
+	}
+
+	for (i = 0; i < innums; i++)
+		inbuf[i] = in_nums[i];
+
+	for (i = 0; i < inbufs; i++) {
+		args[1 + i].ptr = (__u64) in_bufs[i].p;
+		args[1 + i].length = in_bufs[i].s;
+		args[1 + i].fd = fastrpc_mem_fd(in_bufs[i].p, in_bufs[i].s);
+
+		inbuf[innums + i] = in_bufs[i].s;
+	}
+
+	if (outnums) {
+		args[in_count].ptr = (__u64) out_nums;
+		args[in_count].length = sizeof(uint32_t) * outnums;
+		args[in_count].fd = -1;
+	}
+
+	off = in_count + (outnums != 0);
+
+	for (i = 0; i < outbufs; i++) {
+		args[off + i].ptr = (__u64) out_bufs[i].p;
+		args[off + i].length = out_bufs[i].s;
+		args[off + i].fd = fastrpc_mem_fd(out_bufs[i].p, out_bufs[i].s);
+
+		inbuf[innums + inbufs + i] = out_bufs[i].s;
+	}
+
+	return fastrpc_invoke(fd, handle, sc, args);
+}
+
+/*
+ * Each method definition comes with a typed stub that takes its arguments in
+ * a struct with fixed-size arrays:
+ *
+ *	struct remotectl_open_args args = {
+ *		.in_bufs = { { .s = strlen(name) + 1, .p = name, }, },
+ *		.out_bufs = { { .s = sizeof(err), .p = err, }, },
+ *	};
+ *
+ *	ret = remotectl_open_invoke(fd, REMOTECTL_HANDLE, &args);
+ *	handle = args.out_nums[0];
+ *
+ * Initializing an array with too many elements is only a warning, and missing
+ * elements are zero, so the arguments are not checked against the method.
+ * The argument struct pointer may be NULL for methods without arguments.
+ */
+#define HEXAGONRPC_DEFINE_REMOTE_STUB(mid, name,			\
+				      innums, inbufs,			\
+				      outnums, outbufs)			\
+	struct name##_args {						\
+		uint32_t in_nums[HEXAGONRPC_ARRAY_LEN(innums)];		\
+		struct fastrpc_io_buffer in_bufs[HEXAGONRPC_ARRAY_LEN(inbufs)]; \
+		uint32_t out_nums[HEXAGONRPC_ARRAY_LEN(outnums)];	\
+		struct fastrpc_io_buffer out_bufs[HEXAGONRPC_ARRAY_LEN(outbufs)]; \
+	};								\
+									\
+	static inline int name##_invoke(int fd, uint32_t handle,	\
+					struct name##_args *a)		\
+	{								\
+		struct fastrpc_invoke_args args[HEXAGONRPC_ARRAY_LEN(	\
+			FASTRPC_IN_COUNT(innums, inbufs, outbufs)	\
+		      + FASTRPC_OUT_COUNT(outnums, outbufs))];		\
+		uint32_t inbuf[HEXAGONRPC_ARRAY_LEN(innums + inbufs + outbufs)]; \
+									\
+		return hexagonrpc_stub_invoke(fd, handle,		\
+			REMOTE_SCALARS_MAKE(mid,			\
+				FASTRPC_IN_COUNT(innums, inbufs, outbufs), \
+				FASTRPC_OUT_COUNT(outnums, outbufs)),	\
+			innums, inbufs, outnums, outbufs,		\
+			args, inbuf,					\
+			(innums) ? a->in_nums : NULL,			\
+			(inbufs) ? a->in_bufs : NULL,			\
+			(outnums) ? a->out_nums : NULL,			\
+			(outbufs) ? a->out_bufs : NULL);		\
+	}
 
 /*
  * We want to declare method definitions as external by default so we only need
@@ -34,7 +145,11 @@
 #define HEXAGONRPC_DEFINE_REMOTE_METHOD(mid, name,			\
 					innums, inbufs,			\
 					outnums, outbufs)		\
-	extern const struct fastrpc_function_def_interp2 name##_def;
+	extern const struct fastrpc_function_def_interp2 name##_def;	\
+	extern const struct fastrpc_call_plan name##_plan;		\
+	HEXAGONRPC_DEFINE_REMOTE_STUB(mid, name,			\
+				      innums, inbufs,			\
+				      outnums, outbufs)
 
 #else /* HEXAGONRPC_BUILD_METHOD_DEFINITIONS */
 
@@ -47,7 +162,14 @@
 		.in_bufs = inbufs,					\
 		.out_nums = outnums,					\
 		.out_bufs = outbufs,					\
-	};
+	};								\
+	const struct fastrpc_call_plan name##_plan =			\
+		FASTRPC_CALL_PLAN_INIT(&name##_def, mid,		\
+				       innums, inbufs,			\
+				       outnums, outbufs);		\
+	HEXAGONRPC_DEFINE_REMOTE_STUB(mid, name,			\
+				      innums, inbufs,			\
+				      outnums, outbufs)
 
 #endif /* HEXAGONRPC_BUILD_METHOD_DEFINITIONS */
 
@@ -0,0 +1,110 @@
+/*
+ * FastRPC API Replacement - shared memory buffers
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_MEM_H
+#define LIBHEXAGONRPC_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct fastrpc_map_cache;
+
+/*
+ * Buffers from fastrpc_mem_alloc() are backed by a dma-buf that the kernel can
+ * map for the remote processor. When an argument buffer lies within one of
+ * them, its file descriptor is passed to the kernel instead of having the
+ * kernel copy the buffer.
+ *
+ * The dma-buf is allocated from the heap given to fastrpc_mem_set_heap(), or
+ * from the heap named by HEXAGONRPC_DMA_HEAP (/dev/dma_heap/system by
+ * default). If no heap is available, it is allocated with
+ * FASTRPC_IOCTL_ALLOC_DMA_BUFF on the FastRPC device.
+ */
+
+/*
+ * Use an open dma-buf heap for all future allocations. The file descriptor is
+ * not closed by the library.
+ */
+void fastrpc_mem_set_heap(int heap_fd);
+
+/*
+ * Allocate a shared buffer. The fd argument is an open FastRPC device, or -1
+ * to only allocate from a dma-buf heap.
+ *
+ * Returns the mapped buffer, or NULL on failure.
+ */
+void *fastrpc_mem_alloc(int fd, size_t size);
+
+/*
+ * Free a shared buffer, unmapping it from the remote process if a map cache
+ * still holds a released mapping of it.
+ *
+ * Returns 0 on success, or -1 with errno set to EBUSY if a mapping of the
+ * buffer is still in use, in which case the buffer is not freed.
+ */
+int fastrpc_mem_free(void *ptr);
+
+/*
+ * Find the dma-buf that backs a range of memory.
+ *
+ * Returns its file descriptor, or -1 if the range is not entirely inside a
+ * shared buffer.
+ */
+int fastrpc_mem_fd(const void *ptr, size_t len);
+
+/*
+ * Map a buffer into the remote process with FASTRPC_IOCTL_MMAP, storing the
+ * remote address in raddr.
+ *
+ * Returns 0 on success, or -1 with errno set on failure.
+ */
+int fastrpc_mmap(int fd, int buf_fd, const void *addr, size_t len,
+		 uint32_t flags, uint64_t *raddr);
+int fastrpc_munmap(int fd, uint64_t raddr, size_t len);
+
+/*
+ * A map cache keeps buffers mapped into the remote process after they are
+ * released, so a buffer that is passed to the remote processor again does not
+ * need to be mapped again. Mappings are identified by the dma-buf file
+ * descriptor, address and length.
+ *
+ * Released mappings are unmapped, least recently used first, when the cache
+ * holds more than max_bytes or when the remote processor runs out of memory
+ * for a new mapping.
+ */
+struct fastrpc_map_cache *fastrpc_map_cache_create(int fd, uint32_t flags,
+						   size_t max_bytes);
+void fastrpc_map_cache_destroy(struct fastrpc_map_cache *cache);
+
+/*
+ * Get a mapping from the cache, mapping the buffer if needed. Each successful
+ * call must be followed by a call to fastrpc_map_cache_put().
+ */
+int fastrpc_map_cache_get(struct fastrpc_map_cache *cache,
+			  int buf_fd, const void *addr, size_t len,
+			  uint64_t *raddr);
+void fastrpc_map_cache_put(struct fastrpc_map_cache *cache,
+			   int buf_fd, const void *addr, size_t len);
+
+// Unmap all released mappings
+void fastrpc_map_cache_trim(struct fastrpc_map_cache *cache);
+
+#endif /* LIBHEXAGONRPC_MEM_H */
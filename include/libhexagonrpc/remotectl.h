@@ -0,0 +1,54 @@
+/*
+ * FastRPC API Replacement - remote handle management
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_REMOTECTL_H
+#define LIBHEXAGONRPC_REMOTECTL_H
+
+#include <libhexagonrpc/fastrpc.h>
+
+/*
+ * Open an interface on the remote processor and create a context for it.
+ *
+ * Handles are shared within the process: opening an interface that is
+ * already open on the same file descriptor, still referring to the same file,
+ * reuses its handle without asking the remote processor, and the handle is
+ * only closed on the remote processor when the last context for it is closed.
+ *
+ * Returns 0 on success, -1 if the invocation failed, -5 if the remote
+ * processor could not load the interface, or the positive AEE error code
+ * returned by the remote processor. The error callback is called with a
+ * description of the first two kinds of errors.
+ */
+int remotectl_open(int fd, const char *name,
+		   struct fastrpc_context **ctx,
+		   void (*err_cb)(const char *err));
+
+/*
+ * Destroy a context from remotectl_open(), closing the handle on the remote
+ * processor if this was its last user. The context is destroyed even if the
+ * handle could not be closed.
+ *
+ * Returns the same kinds of errors as remotectl_open().
+ */
+int remotectl_close(struct fastrpc_context *ctx,
+		    void (*err_cb)(const char *err));
+
+#endif /* LIBHEXAGONRPC_REMOTECTL_H */
@@ -23,11 +23,33 @@
 #define LIBHEXAGONRPC_SESSION_H
 
 /*
- * Get the file descriptor from the environment variables. Due to its
- * usage of getenv, it is not thread-safe.
+ * Get the file descriptor from the environment variables. If HEXAGONRPC_FD
+ * is not set, this connects to the broker named by HEXAGONRPC_BROKER. Due to
+ * its usage of getenv, it is not thread-safe.
  *
  * On success, returns the file descriptor. On failure, returns -1.
  */
 int hexagonrpc_fd_from_env(void);
 
+/*
+ * Connect to the broker of a hexagonrpcd instance at the given socket path.
+ *
+ * The returned file descriptor can be used in place of a FastRPC device file
+ * descriptor for invocations, which are forwarded to the device that the
+ * broker is attached to. Buffers are copied through shared memory, and each
+ * call can have at most HEXAGONRPC_BROKER_SLOT_DATA bytes of buffers.
+ *
+ * On success, returns the file descriptor. On failure, returns -1.
+ */
+int hexagonrpc_broker_connect(const char *path);
+
+/*
+ * Connect to the broker at the path in HEXAGONRPC_BROKER. Due to its usage of
+ * getenv, it is not thread-safe.
+ */
+int hexagonrpc_broker_from_env(void);
+
+// Disconnect from a broker and close the file descriptor
+void hexagonrpc_broker_close(int fd);
+
 #endif /* LIBHEXAGONRPC_SESSION_H */
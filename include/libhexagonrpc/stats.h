@@ -0,0 +1,79 @@
+/*
+ * FastRPC API Replacement - per-method call statistics
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_STATS_H
+#define LIBHEXAGONRPC_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Latencies are counted in buckets of powers of two microseconds. Bucket 0
+ * holds calls that took less than 1us, bucket i holds calls that took between
+ * 2^(i-1)us and 2^i us, and the last bucket holds all longer calls.
+ */
+#define FASTRPC_STATS_BUCKETS 32
+
+/*
+ * Every invocation made through libhexagonrpc is timed and counted by remote
+ * handle and method. If the HEXAGONRPC_STATS environment variable is set, a
+ * summary is written at exit to the file it names, or to standard error if it
+ * is empty or "-".
+ */
+struct fastrpc_method_stats {
+	uint32_t handle;
+	uint32_t msg_id;
+
+	uint64_t calls;
+	uint64_t errors;
+
+	/*
+	 * The sizes of the argument buffers passed to the invocations. The input
+	 * bytes include the primary buffer with the input numbers and buffer
+	 * sizes, and the output bytes are the capacity of the output buffers,
+	 * not how much the remote processor wrote.
+	 */
+	uint64_t arg_bytes_in;
+	uint64_t arg_bytes_out;
+
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[FASTRPC_STATS_BUCKETS];
+};
+
+/*
+ * Copy the statistics of up to max_stats methods. Methods without calls are
+ * left out, so the copied number of calls is never zero.
+ *
+ * Returns the number of methods that have statistics, which may be larger
+ * than max_stats.
+ */
+size_t fastrpc_stats_snapshot(struct fastrpc_method_stats *stats,
+			      size_t max_stats);
+
+// Clear the statistics of all methods
+void fastrpc_stats_reset(void);
+
+// Write a human-readable summary
+void fastrpc_stats_dump(FILE *f);
+
+#endif /* LIBHEXAGONRPC_STATS_H */
@@ -0,0 +1,197 @@
+/*
+ * FastRPC API Replacement - asynchronous invocations
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <libhexagonrpc/async.h>
+#include <libhexagonrpc/batch.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+struct async_work {
+	struct hexagonrpc_work work;
+	struct fastrpc_async_queue *queue;
+	struct fastrpc_call *call;
+	struct async_work *next;
+};
+
+struct fastrpc_async_queue {
+	int fd;
+	int efd;
+
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	size_t in_flight;
+
+	struct async_work *done_head;
+	struct async_work *done_tail;
+};
+
+static void async_work_func(struct hexagonrpc_work *work)
+{
+	struct async_work *awork = (struct async_work *) work;
+	struct fastrpc_async_queue *queue = awork->queue;
+	struct fastrpc_call *call = awork->call;
+
+	errno = 0;
+
+	call->ret = fastrpc2_array(call->def, queue->fd, call->handle,
+				   call->in_nums, call->in_bufs,
+				   call->out_nums, call->out_bufs);
+	call->err = call->ret ? errno : 0;
+
+	pthread_mutex_lock(&queue->lock);
+
+	awork->next = NULL;
+	if (queue->done_tail != NULL)
+		queue->done_tail->next = awork;
+	else
+		queue->done_head = awork;
+	queue->done_tail = awork;
+
+	eventfd_write(queue->efd, 1);
+
+	queue->in_flight--;
+	if (queue->in_flight == 0)
+		pthread_cond_broadcast(&queue->idle);
+
+	pthread_mutex_unlock(&queue->lock);
+}
+
+struct fastrpc_async_queue *fastrpc_async_queue_create(int fd)
+{
+	struct fastrpc_async_queue *queue;
+
+	queue = malloc(sizeof(*queue));
+	if (queue == NULL)
+		return NULL;
+
+	queue->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (queue->efd == -1)
+		goto err;
+
+	queue->fd = fd;
+	queue->in_flight = 0;
+	queue->done_head = NULL;
+	queue->done_tail = NULL;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->idle, NULL);
+
+	return queue;
+
+err:
+	free(queue);
+	return NULL;
+}
+
+void fastrpc_async_queue_destroy(struct fastrpc_async_queue *queue)
+{
+	struct async_work *awork, *next;
+
+	pthread_mutex_lock(&queue->lock);
+
+	while (queue->in_flight)
+		pthread_cond_wait(&queue->idle, &queue->lock);
+
+	pthread_mutex_unlock(&queue->lock);
+
+	for (awork = queue->done_head; awork != NULL; awork = next) {
+		next = awork->next;
+		free(awork);
+	}
+
+	pthread_cond_destroy(&queue->idle);
+	pthread_mutex_destroy(&queue->lock);
+	close(queue->efd);
+	free(queue);
+}
+
+int fastrpc_async_eventfd(const struct fastrpc_async_queue *queue)
+{
+	return queue->efd;
+}
+
+int fastrpc_async_submit(struct fastrpc_async_queue *queue,
+			 struct fastrpc_call *call)
+{
+	struct async_work *awork;
+	int ret;
+
+	awork = malloc(sizeof(*awork));
+	if (awork == NULL)
+		return -1;
+
+	awork->work.func = async_work_func;
+	awork->queue = queue;
+	awork->call = call;
+
+	pthread_mutex_lock(&queue->lock);
+	queue->in_flight++;
+	pthread_mutex_unlock(&queue->lock);
+
+	ret = hexagonrpc_async_pool_submit(&awork->work);
+	if (ret) {
+		pthread_mutex_lock(&queue->lock);
+		queue->in_flight--;
+		pthread_mutex_unlock(&queue->lock);
+
+		free(awork);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct fastrpc_call *fastrpc_async_collect(struct fastrpc_async_queue *queue)
+{
+	struct async_work *awork;
+	struct fastrpc_call *call;
+	eventfd_t count;
+
+	pthread_mutex_lock(&queue->lock);
+
+	awork = queue->done_head;
+	if (awork == NULL) {
+		pthread_mutex_unlock(&queue->lock);
+		return NULL;
+	}
+
+	queue->done_head = awork->next;
+	if (queue->done_head == NULL)
+		queue->done_tail = NULL;
+
+	// Consume the completion that was signalled for this call
+	eventfd_read(queue->efd, &count);
+
+	pthread_mutex_unlock(&queue->lock);
+
+	call = awork->call;
+	free(awork);
+
+	return call;
+}
@@ -0,0 +1,114 @@
+/*
+ * FastRPC API Replacement - batched invocations
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <libhexagonrpc/batch.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+struct batch {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	size_t remaining;
+	int fd;
+};
+
+struct batch_work {
+	struct hexagonrpc_work work;
+	struct batch *batch;
+	struct fastrpc_call *call;
+};
+
+static void run_call(int fd, struct fastrpc_call *call)
+{
+	errno = 0;
+
+	call->ret = fastrpc2_array(call->def, fd, call->handle,
+				   call->in_nums, call->in_bufs,
+				   call->out_nums, call->out_bufs);
+	call->err = call->ret ? errno : 0;
+}
+
+static void batch_work_func(struct hexagonrpc_work *work)
+{
+	struct batch_work *bwork = (struct batch_work *) work;
+	struct batch *batch = bwork->batch;
+
+	run_call(batch->fd, bwork->call);
+
+	pthread_mutex_lock(&batch->lock);
+
+	batch->remaining--;
+	if (batch->remaining == 0)
+		pthread_cond_signal(&batch->done);
+
+	pthread_mutex_unlock(&batch->lock);
+}
+
+int fastrpc_batch(int fd, size_t n_calls, struct fastrpc_call *calls)
+{
+	struct batch_work *works;
+	struct batch batch;
+	size_t i;
+	int ret;
+
+	works = malloc(sizeof(*works) * n_calls);
+	if (works == NULL && n_calls)
+		return -1;
+
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.done, NULL);
+	batch.remaining = n_calls;
+	batch.fd = fd;
+
+	for (i = 0; i < n_calls; i++) {
+		works[i].work.func = batch_work_func;
+		works[i].batch = &batch;
+		works[i].call = &calls[i];
+
+		ret = hexagonrpc_pool_submit(&works[i].work);
+		if (ret)
+			batch_work_func(&works[i].work);
+	}
+
+	pthread_mutex_lock(&batch.lock);
+
+	while (batch.remaining)
+		pthread_cond_wait(&batch.done, &batch.lock);
+
+	pthread_mutex_unlock(&batch.lock);
+
+	pthread_cond_destroy(&batch.done);
+	pthread_mutex_destroy(&batch.lock);
+	free(works);
+
+	ret = 0;
+	for (i = 0; i < n_calls; i++) {
+		if (calls[i].ret)
+			ret = -1;
+	}
+
+	return ret;
+}
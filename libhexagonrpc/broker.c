@@ -0,0 +1,452 @@
+/*
+ * FastRPC API Replacement - session broker client
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <libhexagonrpc/broker.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/session.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "transport.h"
+
+#define ALL_SLOTS ((uint32_t) ((1ULL << HEXAGONRPC_BROKER_SLOTS) - 1))
+
+/*
+ * Any thread that waits for a completion reads doorbells from the socket if no
+ * other thread is doing so, and wakes up the other threads when it finds
+ * completions for them.
+ *
+ * The list of brokers holds one reference and every caller of
+ * hexagonrpc_broker_find() holds another until hexagonrpc_broker_put().
+ */
+struct hexagonrpc_broker {
+	int fd;
+	struct hexagonrpc_broker_shm *shm;
+	atomic_uint refs;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t free_slots;
+	uint32_t done_slots;
+	bool reading;
+	bool dead;
+
+	struct hexagonrpc_broker *next;
+};
+
+static pthread_rwlock_t brokers_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct hexagonrpc_broker *brokers;
+static atomic_size_t n_brokers;
+
+static int receive_shm(int fd)
+{
+	char buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char byte;
+	ssize_t ret;
+	int shm_fd;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	ret = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (ret != 1)
+		return -1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL
+	 || cmsg->cmsg_level != SOL_SOCKET
+	 || cmsg->cmsg_type != SCM_RIGHTS
+	 || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+		return -1;
+
+	memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+
+	return shm_fd;
+}
+
+static struct hexagonrpc_broker_shm *map_shm(int shm_fd)
+{
+	struct hexagonrpc_broker_shm *shm;
+	struct stat st;
+	int ret;
+
+	ret = fstat(shm_fd, &st);
+	if (ret || (size_t) st.st_size < sizeof(*shm))
+		return NULL;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, shm_fd, 0);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (shm->magic != HEXAGONRPC_BROKER_MAGIC
+	 || shm->version != HEXAGONRPC_BROKER_VERSION) {
+		munmap(shm, sizeof(*shm));
+		return NULL;
+	}
+
+	return shm;
+}
+
+int hexagonrpc_broker_connect(const char *path)
+{
+	struct hexagonrpc_broker *broker;
+	struct sockaddr_un addr;
+	int shm_fd;
+	int ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	broker = malloc(sizeof(*broker));
+	if (broker == NULL)
+		return -1;
+
+	broker->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (broker->fd == -1)
+		goto err_free;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	ret = connect(broker->fd, (struct sockaddr *) &addr, sizeof(addr));
+	if (ret)
+		goto err_close;
+
+	shm_fd = receive_shm(broker->fd);
+	if (shm_fd == -1)
+		goto err_close;
+
+	broker->shm = map_shm(shm_fd);
+	close(shm_fd);
+
+	if (broker->shm == NULL)
+		goto err_close;
+
+	pthread_mutex_init(&broker->lock, NULL);
+	pthread_cond_init(&broker->cond, NULL);
+	broker->free_slots = ALL_SLOTS;
+	broker->done_slots = 0;
+	broker->reading = false;
+	broker->dead = false;
+	atomic_init(&broker->refs, 1);
+
+	pthread_rwlock_wrlock(&brokers_lock);
+
+	broker->next = brokers;
+	brokers = broker;
+	atomic_fetch_add(&n_brokers, 1);
+
+	pthread_rwlock_unlock(&brokers_lock);
+
+	return broker->fd;
+
+err_close:
+	close(broker->fd);
+err_free:
+	free(broker);
+	return -1;
+}
+
+int hexagonrpc_broker_from_env(void)
+{
+	const char *path;
+
+	path = getenv("HEXAGONRPC_BROKER");
+	if (path == NULL)
+		return -1;
+
+	return hexagonrpc_broker_connect(path);
+}
+
+void hexagonrpc_broker_close(int fd)
+{
+	struct hexagonrpc_broker **curr;
+	struct hexagonrpc_broker *broker = NULL;
+
+	pthread_rwlock_wrlock(&brokers_lock);
+
+	for (curr = &brokers; *curr != NULL; curr = &(*curr)->next) {
+		if ((*curr)->fd == fd) {
+			broker = *curr;
+			*curr = broker->next;
+			atomic_fetch_sub(&n_brokers, 1);
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&brokers_lock);
+
+	if (broker == NULL)
+		return;
+
+	// Wake up any thread still waiting for a completion.
+	shutdown(broker->fd, SHUT_RDWR);
+
+	hexagonrpc_broker_put(broker);
+}
+
+struct hexagonrpc_broker *hexagonrpc_broker_find(int fd)
+{
+	struct hexagonrpc_broker *broker;
+
+	if (!atomic_load_explicit(&n_brokers, memory_order_relaxed))
+		return NULL;
+
+	pthread_rwlock_rdlock(&brokers_lock);
+
+	for (broker = brokers; broker != NULL; broker = broker->next) {
+		if (broker->fd == fd) {
+			atomic_fetch_add(&broker->refs, 1);
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&brokers_lock);
+
+	return broker;
+}
+
+void hexagonrpc_broker_put(struct hexagonrpc_broker *broker)
+{
+	if (atomic_fetch_sub(&broker->refs, 1) != 1)
+		return;
+
+	munmap(broker->shm, sizeof(*broker->shm));
+	close(broker->fd);
+
+	pthread_cond_destroy(&broker->cond);
+	pthread_mutex_destroy(&broker->lock);
+	free(broker);
+}
+
+/*
+ * Copy the input buffers into the slot and describe all buffers. The output
+ * buffers are placed after the input buffers in the data area.
+ */
+static int fill_slot(struct hexagonrpc_broker_slot *slot,
+		     uint32_t handle, uint32_t sc,
+		     const struct fastrpc_invoke_args *args)
+{
+	uint32_t n_in = REMOTE_SCALARS_INBUFS(sc);
+	uint32_t n_out = REMOTE_SCALARS_OUTBUFS(sc);
+	uint64_t off = 0;
+	uint32_t i;
+
+	if (n_in + n_out > HEXAGONRPC_BROKER_MAX_BUFS)
+		return -1;
+
+	for (i = 0; i < n_in + n_out; i++) {
+		if (args[i].length > HEXAGONRPC_BROKER_SLOT_DATA - off)
+			return -1;
+
+		slot->bufs[i].offset = off;
+		slot->bufs[i].length = args[i].length;
+
+		if (i < n_in)
+			memcpy((char *) slot->data + off,
+			       (const void *) args[i].ptr, args[i].length);
+
+		off = (off + args[i].length + 7) & ~(uint64_t) 7;
+		if (off > HEXAGONRPC_BROKER_SLOT_DATA)
+			off = HEXAGONRPC_BROKER_SLOT_DATA;
+	}
+
+	slot->handle = handle;
+	slot->sc = sc;
+
+	return 0;
+}
+
+static void copy_outputs(const struct hexagonrpc_broker_slot *slot,
+			 uint32_t sc,
+			 const struct fastrpc_invoke_args *args)
+{
+	uint32_t n_in = REMOTE_SCALARS_INBUFS(sc);
+	uint32_t n_out = REMOTE_SCALARS_OUTBUFS(sc);
+	uint32_t i;
+
+	for (i = n_in; i < n_in + n_out; i++) {
+		memcpy((void *) args[i].ptr,
+		       (const char *) slot->data + slot->bufs[i].offset,
+		       args[i].length);
+	}
+}
+
+// Collect completions from the broker. The lock must be held.
+static void drain_completions(struct hexagonrpc_broker *broker)
+{
+	struct hexagonrpc_broker_ring *cq = &broker->shm->cq;
+	unsigned int head, tail, n;
+	uint32_t slot;
+
+	tail = atomic_load_explicit(&cq->tail, memory_order_relaxed);
+	head = atomic_load_explicit(&cq->head, memory_order_acquire);
+
+	for (n = 0; tail != head && n < HEXAGONRPC_BROKER_SLOTS; n++) {
+		slot = cq->slots[tail % HEXAGONRPC_BROKER_SLOTS];
+		if (slot < HEXAGONRPC_BROKER_SLOTS)
+			broker->done_slots |= 1 << slot;
+
+		tail++;
+	}
+
+	atomic_store_explicit(&cq->tail, tail, memory_order_release);
+}
+
+/*
+ * Wait for the broker to complete the request in a slot. The lock must be
+ * held.
+ */
+static void wait_for_slot(struct hexagonrpc_broker *broker, uint32_t slot)
+{
+	char buf[HEXAGONRPC_BROKER_SLOTS];
+	ssize_t ret;
+
+	while (!(broker->done_slots & (1 << slot)) && !broker->dead) {
+		if (broker->reading) {
+			pthread_cond_wait(&broker->cond, &broker->lock);
+			continue;
+		}
+
+		broker->reading = true;
+		pthread_mutex_unlock(&broker->lock);
+
+		ret = recv(broker->fd, buf, sizeof(buf), 0);
+
+		pthread_mutex_lock(&broker->lock);
+		broker->reading = false;
+
+		if (ret == 0 || (ret == -1 && errno != EINTR))
+			broker->dead = true;
+
+		drain_completions(broker);
+		pthread_cond_broadcast(&broker->cond);
+	}
+}
+
+int hexagonrpc_broker_invoke(struct hexagonrpc_broker *broker,
+			     uint32_t handle, uint32_t sc,
+			     const struct fastrpc_invoke_args *args)
+{
+	struct hexagonrpc_broker_ring *sq = &broker->shm->sq;
+	struct hexagonrpc_broker_slot *slot;
+	unsigned int head;
+	uint32_t i, done;
+	ssize_t sent;
+	int ret = -1, err;
+
+	pthread_mutex_lock(&broker->lock);
+
+	while (!broker->free_slots && !broker->dead)
+		pthread_cond_wait(&broker->cond, &broker->lock);
+
+	if (broker->dead) {
+		pthread_mutex_unlock(&broker->lock);
+		errno = EPIPE;
+		return -1;
+	}
+
+	i = __builtin_ctz(broker->free_slots);
+	broker->free_slots &= ~(1 << i);
+
+	pthread_mutex_unlock(&broker->lock);
+
+	slot = &broker->shm->slots[i];
+
+	if (fill_slot(slot, handle, sc, args)) {
+		err = EMSGSIZE;
+		goto out;
+	}
+
+	pthread_mutex_lock(&broker->lock);
+
+	head = atomic_load_explicit(&sq->head, memory_order_relaxed);
+	sq->slots[head % HEXAGONRPC_BROKER_SLOTS] = i;
+	atomic_store_explicit(&sq->head, head + 1, memory_order_release);
+
+	pthread_mutex_unlock(&broker->lock);
+
+	/*
+	 * The slot is visible to the broker from here on, so it must not be
+	 * reused unless the broker has completed it.
+	 */
+	do {
+		sent = send(broker->fd, "", 1, MSG_NOSIGNAL);
+	} while (sent == -1 && errno == EINTR);
+
+	pthread_mutex_lock(&broker->lock);
+
+	if (sent != 1) {
+		broker->dead = true;
+		pthread_cond_broadcast(&broker->cond);
+	}
+
+	wait_for_slot(broker, i);
+	done = broker->done_slots & (1 << i);
+	pthread_mutex_unlock(&broker->lock);
+
+	// Keep the slot reserved, since the broker may still write to it.
+	if (!done) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	ret = slot->ret;
+	err = slot->err;
+
+	copy_outputs(slot, sc, args);
+
+out:
+	pthread_mutex_lock(&broker->lock);
+
+	broker->done_slots &= ~(1 << i);
+	broker->free_slots |= 1 << i;
+	pthread_cond_broadcast(&broker->cond);
+
+	pthread_mutex_unlock(&broker->lock);
+
+	if (ret)
+		errno = err;
+
+	return ret;
+}
@@ -20,6 +20,193 @@
  */
 
 #include <libhexagonrpc/fastrpc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * Every scratch buffer is kept on a list shared by all contexts, along with
+ * the thread that created it.
+ */
+struct scratch_buf {
+	struct fastrpc_thread_scratch *owner;
+	pthread_t thread;
+	struct scratch_buf *prev;
+	struct scratch_buf *next;
+
+	size_t len;
+	void *buf;
+};
+
+struct fastrpc_thread_scratch {
+	pthread_key_t key;
+	atomic_size_t max_len;
+};
+
+/*
+ * The list is only used to free the buffers of threads that are still alive
+ * when their context is destroyed, so the lock is never taken when calling a
+ * method with an existing buffer. It is shared by all contexts, so that a
+ * thread destructor never takes a lock that belongs to a context being
+ * destroyed.
+ */
+static pthread_mutex_t scratch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct scratch_buf *scratch_bufs = NULL;
+
+// Called with the scratch lock held
+static void scratch_buf_unlink(struct scratch_buf *sbuf)
+{
+	if (sbuf->prev != NULL)
+		sbuf->prev->next = sbuf->next;
+	else
+		scratch_bufs = sbuf->next;
+
+	if (sbuf->next != NULL)
+		sbuf->next->prev = sbuf->prev;
+}
+
+/*
+ * The destructor of an exiting thread may already have been called when the
+ * context is destroyed and frees the buffer, so the buffer is only touched if
+ * it is still on the list and was created by the calling thread.
+ */
+static void scratch_buf_destroy(void *data)
+{
+	struct scratch_buf *sbuf;
+
+	pthread_mutex_lock(&scratch_lock);
+
+	for (sbuf = scratch_bufs; sbuf != NULL; sbuf = sbuf->next) {
+		if (sbuf == data && pthread_equal(sbuf->thread, pthread_self()))
+			break;
+	}
+
+	if (sbuf != NULL)
+		scratch_buf_unlink(sbuf);
+
+	pthread_mutex_unlock(&scratch_lock);
+
+	if (sbuf != NULL) {
+		free(sbuf->buf);
+		free(sbuf);
+	}
+}
+
+static struct scratch_buf *scratch_buf_create(struct fastrpc_thread_scratch *scratch)
+{
+	struct scratch_buf *sbuf;
+
+	sbuf = malloc(sizeof(*sbuf));
+	if (sbuf == NULL)
+		return NULL;
+
+	sbuf->owner = scratch;
+	sbuf->thread = pthread_self();
+	sbuf->prev = NULL;
+	sbuf->len = 0;
+	sbuf->buf = NULL;
+
+	if (pthread_setspecific(scratch->key, sbuf)) {
+		free(sbuf);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&scratch_lock);
+
+	sbuf->next = scratch_bufs;
+	if (scratch_bufs != NULL)
+		scratch_bufs->prev = sbuf;
+	scratch_bufs = sbuf;
+
+	pthread_mutex_unlock(&scratch_lock);
+
+	return sbuf;
+}
+
+/*
+ * Get scratch memory of at least the given length for the calling thread.
+ * Returns NULL if it could not be allocated, in which case the caller can fall
+ * back to the stack.
+ */
+static void *get_thread_scratch(struct fastrpc_thread_scratch *scratch, size_t len)
+{
+	struct scratch_buf *sbuf;
+	size_t max_len;
+	void *buf;
+
+	sbuf = pthread_getspecific(scratch->key);
+	if (sbuf == NULL) {
+		sbuf = scratch_buf_create(scratch);
+		if (sbuf == NULL)
+			return NULL;
+	}
+
+	if (sbuf->len >= len)
+		return sbuf->buf;
+
+	max_len = atomic_load(&scratch->max_len);
+	while (max_len < len) {
+		if (atomic_compare_exchange_weak(&scratch->max_len, &max_len, len))
+			max_len = len;
+	}
+
+	// Memory from malloc is suitably aligned for the ioctl arguments
+	buf = realloc(sbuf->buf, max_len);
+	if (buf == NULL)
+		return NULL;
+
+	sbuf->buf = buf;
+	sbuf->len = max_len;
+
+	return buf;
+}
+
+static struct fastrpc_thread_scratch *create_thread_scratch(void)
+{
+	struct fastrpc_thread_scratch *scratch;
+
+	scratch = malloc(sizeof(*scratch));
+	if (scratch == NULL)
+		return NULL;
+
+	if (pthread_key_create(&scratch->key, scratch_buf_destroy)) {
+		free(scratch);
+		return NULL;
+	}
+
+	atomic_init(&scratch->max_len, 0);
+
+	return scratch;
+}
+
+/*
+ * No destructors run for the key once it is deleted, so the buffers of the
+ * threads that are still alive are freed here.
+ */
+static void destroy_thread_scratch(struct fastrpc_thread_scratch *scratch)
+{
+	struct scratch_buf *sbuf, *next;
+
+	pthread_key_delete(scratch->key);
+
+	pthread_mutex_lock(&scratch_lock);
+
+	for (sbuf = scratch_bufs; sbuf != NULL; sbuf = next) {
+		next = sbuf->next;
+
+		if (sbuf->owner != scratch)
+			continue;
+
+		scratch_buf_unlink(sbuf);
+		free(sbuf->buf);
+		free(sbuf);
+	}
+
+	pthread_mutex_unlock(&scratch_lock);
+
+	free(scratch);
+}
 
 struct fastrpc_context *fastrpc_create_context(int fd, uint32_t handle)
 {
@@ -31,14 +218,49 @@ struct fastrpc_context *fastrpc_create_context(int fd, uint32_t handle)
 
 	ctx->fd = fd;
 	ctx->handle = handle;
+	ctx->scratch = NULL;
 
 	return ctx;
 }
 
+struct fastrpc_context *fastrpc_create_context_mt(int fd, uint32_t handle)
+{
+	struct fastrpc_context *ctx;
+
+	ctx = fastrpc_create_context(fd, handle);
+	if (ctx == NULL)
+		return NULL;
+
+	ctx->scratch = create_thread_scratch();
+	if (ctx->scratch == NULL) {
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+void fastrpc_destroy_context(struct fastrpc_context *ctx)
+{
+	if (ctx->scratch != NULL)
+		destroy_thread_scratch(ctx->scratch);
+
+	free(ctx);
+}
+
 int vfastrpc(const struct fastrpc_function_def_interp2 *def,
 	     const struct fastrpc_context *ctx, va_list arg_list)
 {
-	return vfastrpc2(def, ctx->fd, ctx->handle, arg_list);
+	struct fastrpc_call_plan plan;
+	void *scratch;
+
+	if (ctx->scratch == NULL)
+		return vfastrpc2(def, ctx->fd, ctx->handle, arg_list);
+
+	fastrpc_plan_init(&plan, def);
+	scratch = get_thread_scratch(ctx->scratch, plan.scratch_len);
+
+	return vfastrpc_plan(&plan, scratch, ctx->fd, ctx->handle, arg_list);
 }
 
 int fastrpc(const struct fastrpc_function_def_interp2 *def,
@@ -54,3 +276,23 @@ int fastrpc(const struct fastrpc_function_def_interp2 *def,
 	return ret;
 }
 
+int fastrpc_array(const struct fastrpc_function_def_interp2 *def,
+		  const struct fastrpc_context *ctx,
+		  const uint32_t *in_nums,
+		  const struct fastrpc_io_buffer *in_bufs,
+		  uint32_t *const *out_nums,
+		  const struct fastrpc_io_buffer *out_bufs)
+{
+	struct fastrpc_call_plan plan;
+	void *scratch;
+
+	if (ctx->scratch == NULL)
+		return fastrpc2_array(def, ctx->fd, ctx->handle,
+				      in_nums, in_bufs, out_nums, out_bufs);
+
+	fastrpc_plan_init(&plan, def);
+	scratch = get_thread_scratch(ctx->scratch, plan.scratch_len);
+
+	return fastrpc_plan_array(&plan, scratch, ctx->fd, ctx->handle,
+				  in_nums, in_bufs, out_nums, out_bufs);
+}
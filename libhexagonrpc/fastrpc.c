@@ -20,103 +20,228 @@
  */
 
 #include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/mem.h>
 #include <misc/fastrpc.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <sys/ioctl.h>
 #include <stdio.h>
 
-static void allocate_first_inbuf(const struct fastrpc_function_def_interp2 *def,
-				 struct fastrpc_invoke_args *arg,
-				 uint32_t **inbuf)
+static void setup_first_inbuf(const struct fastrpc_call_plan *plan,
+			      struct fastrpc_invoke_args *arg,
+			      uint32_t *inbuf)
 {
-	uint32_t *buf;
-	size_t len;
+	if (plan->inbuf_len) {
+		arg->ptr = (__u64) inbuf;
+		arg->length = plan->inbuf_len;
+		arg->fd = -1;
+	}
+}
 
-	len = sizeof(uint32_t) * (def->in_nums + def->in_bufs + def->out_bufs);
+static void setup_first_outbuf(const struct fastrpc_call_plan *plan,
+			       struct fastrpc_invoke_args *arg,
+			       uint32_t *outbuf)
+{
+	if (plan->outbuf_len) {
+		arg->ptr = (__u64) outbuf;
+		arg->length = plan->outbuf_len;
+		arg->fd = -1;
+	}
+}
 
-	if (len)
-		buf = malloc(len);
-	else
-		buf = NULL;
+/*
+ * Buffers that lie within a shared buffer from fastrpc_mem_alloc() are passed
+ * with the file descriptor of the dma-buf. The kernel finds the offset into the
+ * dma-buf from the pointer, and the remote processor accesses the memory
+ * directly instead of a copy.
+ */
+static void setup_inbufs(const struct fastrpc_call_plan *plan,
+			 struct fastrpc_invoke_args *args,
+			 uint32_t *inbuf,
+			 const uint32_t *in_nums,
+			 const struct fastrpc_io_buffer *in_bufs)
+{
+	const struct fastrpc_function_def_interp2 *def = plan->def;
+	uint8_t i;
+
+	for (i = 0; i < def->in_nums; i++)
+		inbuf[i] = in_nums[i];
 
-	*inbuf = buf;
+	for (i = 0; i < def->in_bufs; i++) {
+		args[i + 1].ptr = (__u64) in_bufs[i].p;
+		args[i + 1].length = in_bufs[i].s;
+		args[i + 1].fd = fastrpc_mem_fd(in_bufs[i].p, in_bufs[i].s);
 
-	if (buf != NULL) {
-		arg->ptr = (__u64) buf;
-		arg->length = len;
-		arg->fd = -1;
+		inbuf[def->in_nums + i] = in_bufs[i].s;
+	}
+}
+
+/*
+ * This populates the fastrpc_invoke_args struct to give information about the
+ * output buffers to the kernel, and adds an entry to the first input buffer to
+ * tell the remote processor how large each function-level output buffer can
+ * be.
+ */
+static void setup_outbufs(const struct fastrpc_call_plan *plan,
+			  struct fastrpc_invoke_args *args,
+			  uint32_t *inbuf,
+			  const struct fastrpc_io_buffer *out_bufs)
+{
+	const struct fastrpc_function_def_interp2 *def = plan->def;
+	uint8_t i;
+	int off;
+
+	off = def->out_nums && 1;
+
+	for (i = 0; i < def->out_bufs; i++) {
+		args[off + i].ptr = (__u64) out_bufs[i].p;
+		args[off + i].length = out_bufs[i].s;
+		args[off + i].fd = fastrpc_mem_fd(out_bufs[i].p, out_bufs[i].s);
+
+		inbuf[i] = out_bufs[i].s;
 	}
 }
 
-static void allocate_first_outbuf(const struct fastrpc_function_def_interp2 *def,
-				  struct fastrpc_invoke_args *arg,
-				  uint32_t **outbuf)
+void fastrpc_plan_init(struct fastrpc_call_plan *plan,
+		       const struct fastrpc_function_def_interp2 *def)
+{
+	*plan = (struct fastrpc_call_plan) FASTRPC_CALL_PLAN_INIT(def,
+								  def->msg_id,
+								  def->in_nums,
+								  def->in_bufs,
+								  def->out_nums,
+								  def->out_bufs);
+}
+
+static int plan_invoke(const struct fastrpc_call_plan *plan, void *scratch,
+		       int fd, uint32_t handle,
+		       const uint32_t *in_nums,
+		       const struct fastrpc_io_buffer *in_bufs,
+		       uint32_t *const *out_nums,
+		       const struct fastrpc_io_buffer *out_bufs)
+{
+	const struct fastrpc_function_def_interp2 *def = plan->def;
+	struct fastrpc_invoke_args *args = scratch;
+	uint32_t *inbuf;
+	uint32_t *outbuf;
+	uint8_t i;
+	int ret;
+
+	/*
+	 * The first input and output buffers are placed after the ioctl
+	 * argument list in the scratch memory.
+	 */
+	inbuf = (uint32_t *) &args[plan->in_count + plan->out_count];
+	outbuf = &inbuf[plan->inbuf_len / sizeof(uint32_t)];
+
+	setup_first_inbuf(plan, args, inbuf);
+	setup_inbufs(plan, args, inbuf, in_nums, in_bufs);
+
+	setup_first_outbuf(plan, &args[plan->in_count], outbuf);
+	setup_outbufs(plan,
+		      &args[plan->in_count],
+		      &inbuf[def->in_nums + def->in_bufs],
+		      out_bufs);
+
+	ret = fastrpc_invoke(fd, handle, plan->sc, args);
+
+	for (i = 0; i < def->out_nums; i++)
+		*out_nums[i] = outbuf[i];
+
+	return ret;
+}
+
+static int plan_invoke_on_stack(const struct fastrpc_call_plan *plan,
+				int fd, uint32_t handle,
+				const uint32_t *in_nums,
+				const struct fastrpc_io_buffer *in_bufs,
+				uint32_t *const *out_nums,
+				const struct fastrpc_io_buffer *out_bufs)
 {
-	uint32_t *buf;
-	size_t len;
+	uint64_t scratch[plan->scratch_len / sizeof(uint64_t) + 1];
 
-	len = sizeof(uint32_t) * def->out_nums;
+	return plan_invoke(plan, scratch, fd, handle,
+			   in_nums, in_bufs, out_nums, out_bufs);
+}
 
-	if (len)
-		buf = malloc(len);
+int fastrpc_plan_array(const struct fastrpc_call_plan *plan, void *scratch,
+		       int fd, uint32_t handle,
+		       const uint32_t *in_nums,
+		       const struct fastrpc_io_buffer *in_bufs,
+		       uint32_t *const *out_nums,
+		       const struct fastrpc_io_buffer *out_bufs)
+{
+	if (scratch == NULL)
+		return plan_invoke_on_stack(plan, fd, handle,
+					    in_nums, in_bufs,
+					    out_nums, out_bufs);
 	else
-		buf = NULL;
+		return plan_invoke(plan, scratch, fd, handle,
+				   in_nums, in_bufs, out_nums, out_bufs);
+}
 
-	*outbuf = buf;
+int fastrpc2_array(const struct fastrpc_function_def_interp2 *def,
+		   int fd, uint32_t handle,
+		   const uint32_t *in_nums,
+		   const struct fastrpc_io_buffer *in_bufs,
+		   uint32_t *const *out_nums,
+		   const struct fastrpc_io_buffer *out_bufs)
+{
+	struct fastrpc_call_plan plan;
 
-	if (buf != NULL) {
-		arg->ptr = (__u64) buf;
-		arg->length = len;
-		arg->fd = -1;
-	}
+	fastrpc_plan_init(&plan, def);
+
+	return plan_invoke_on_stack(&plan, fd, handle,
+				    in_nums, in_bufs, out_nums, out_bufs);
 }
 
 /*
- * This populates relevant inputs (in general) with information necessary to
- * receive output from the remote processor.
- *
- * First, it allocates a new first output buffer to contain the returned 32-bit
- * integers. This output buffer must be freed after use.
- *
- * With a peek at the output arguments, it populates the fastrpc_invoke_args
- * struct to give information about the buffer to the kernel, and adds an entry
- * to the first input buffer to tell the remote processor how large the
- * function-level output buffer can be.
- *
- * This is the only part of the argument processing that can be split off into
- * a different function because it is operating on a copy of the va_list.
- * Calling va_arg() on a va_list after the return of a function that already
- * used it causes undefined behavior.
+ * This unpacks the variadic arguments into arrays for fastrpc_plan_array().
+ * The va_list is only walked once, so nothing is read from it after the
+ * remote method returns.
  */
-static void prepare_outbufs(const struct fastrpc_function_def_interp2 *def,
-			    struct fastrpc_invoke_args *args,
-			    uint8_t out_count,
-			    uint32_t *inbuf,
-			    uint32_t **outbuf,
-			    va_list peek)
+int vfastrpc_plan(const struct fastrpc_call_plan *plan, void *scratch,
+		  int fd, uint32_t handle, va_list arg_list)
 {
-	int i;
-	int off;
-	int size;
+	const struct fastrpc_function_def_interp2 *def = plan->def;
+	// Add an unused element to each array to avoid zero-length arrays
+	uint32_t in_nums[def->in_nums + 1];
+	struct fastrpc_io_buffer in_bufs[def->in_bufs + 1];
+	uint32_t *out_nums[def->out_nums + 1];
+	struct fastrpc_io_buffer out_bufs[def->out_bufs + 1];
+	uint8_t i;
 
-	allocate_first_outbuf(def, args, outbuf);
+	for (i = 0; i < def->in_nums; i++)
+		in_nums[i] = va_arg(arg_list, uint32_t);
 
-	off = def->out_nums && 1;
+	for (i = 0; i < def->in_bufs; i++) {
+		in_bufs[i].s = va_arg(arg_list, uint32_t);
+		in_bufs[i].p = va_arg(arg_list, void *);
+	}
 
 	for (i = 0; i < def->out_nums; i++)
-		va_arg(peek, uint32_t *);
+		out_nums[i] = va_arg(arg_list, uint32_t *);
 
 	for (i = 0; i < def->out_bufs; i++) {
-		size = va_arg(peek, uint32_t);
+		out_bufs[i].s = va_arg(arg_list, uint32_t);
+		out_bufs[i].p = va_arg(arg_list, void *);
+	}
 
-		args[off + i].ptr = (__u64) va_arg(peek, void *);
-		args[off + i].length = size;
-		args[off + i].fd = -1;
+	return fastrpc_plan_array(plan, scratch, fd, handle,
+				  in_nums, in_bufs, out_nums, out_bufs);
+}
 
-		inbuf[i] = size;
-	}
+int fastrpc_plan(const struct fastrpc_call_plan *plan, void *scratch,
+		 int fd, uint32_t handle, ...)
+{
+	va_list arg_list;
+	int ret;
+
+	va_start(arg_list, handle);
+	ret = vfastrpc_plan(plan, scratch, fd, handle, arg_list);
+	va_end(arg_list);
+
+	return ret;
 }
 
 /*
@@ -164,78 +289,25 @@ static void prepare_outbufs(const struct fastrpc_function_def_interp2 *def,
  *		    nested_inbufs_size,
  *		    nested_inbufs);
  * }
+ *
+ * The call plan is computed on each call. Callers that invoke the same method
+ * repeatedly can use fastrpc_plan() with a precomputed plan instead.
+ *
+ * This is a wrapper around fastrpc2_array(), which takes the same arguments as
+ * arrays:
+ * - in_nums, with a uint32_t for each input number
+ * - in_bufs, with a struct fastrpc_io_buffer for each input buffer
+ * - out_nums, with a (uint32_t *) for each output number
+ * - out_bufs, with a struct fastrpc_io_buffer for each output buffer
  */
 int vfastrpc2(const struct fastrpc_function_def_interp2 *def,
 	      int fd, uint32_t handle, va_list arg_list)
 {
-	va_list peek;
-	struct fastrpc_invoke invoke;
-	struct fastrpc_invoke_args *args;
-	uint32_t *inbuf;
-	uint32_t *outbuf;
-	uint8_t in_count;
-	uint8_t out_count;
-	uint32_t size;
-	uint8_t i;
-	int ret;
-
-	/*
-	 * Calculate the amount of needed buffers, accounting for the need for
-	 * the maximum size of the output buffer.
-	 */
-	in_count = def->in_bufs + ((def->in_nums
-				 || def->in_bufs
-				 || def->out_bufs) && 1);
-	out_count = def->out_bufs + (def->out_nums && 1);
+	struct fastrpc_call_plan plan;
 
-	if (in_count || out_count)
-		args = malloc(sizeof(*args) * (in_count + out_count));
-	else
-		args = NULL;
-
-	allocate_first_inbuf(def, args, &inbuf);
-
-	for (i = 0; i < def->in_nums; i++)
-		inbuf[i] = va_arg(arg_list, uint32_t);
-
-	for (i = 0; i < def->in_bufs; i++) {
-		size = va_arg(arg_list, uint32_t);
+	fastrpc_plan_init(&plan, def);
 
-		args[i + 1].ptr = (__u64) va_arg(arg_list, void *);
-		args[i + 1].length = size;
-		args[i + 1].fd = -1;
-
-		inbuf[def->in_nums + i] = size;
-	}
-
-	va_copy(peek, arg_list);
-	prepare_outbufs(def,
-			&args[in_count],
-			out_count,
-			&inbuf[def->in_nums + def->in_bufs],
-			&outbuf,
-			peek);
-	va_end(peek);
-
-	invoke.handle = handle;
-	invoke.sc = REMOTE_SCALARS_MAKE(def->msg_id, in_count, out_count);
-	invoke.args = (__u64) args;
-
-	ret = ioctl(fd, FASTRPC_IOCTL_INVOKE, (__u64) &invoke);
-
-	for (i = 0; i < def->out_nums; i++)
-		*va_arg(arg_list, uint32_t *) = outbuf[i];
-
-	if (in_count || out_count)
-		free(args);
-
-	if (in_count)
-		free(inbuf);
-
-	if (out_count)
-		free(outbuf);
-
-	return ret;
+	return vfastrpc_plan(&plan, NULL, fd, handle, arg_list);
 }
 
 int fastrpc2(const struct fastrpc_function_def_interp2 *def,
@@ -0,0 +1,236 @@
+/*
+ * FastRPC API Replacement - shared memory buffers
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libhexagonrpc/mem.h>
+#include <linux/dma-heap.h>
+#include <misc/fastrpc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mmap.h"
+
+#define DEFAULT_DMA_HEAP "/dev/dma_heap/system"
+
+struct mem_region {
+	char *ptr;
+	size_t len;
+	int fd;
+
+	struct mem_region *next;
+};
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool heap_opened;
+static int heap_fd = -1;
+
+/*
+ * Most processes never allocate shared buffers, so the region count lets the
+ * lookup for every argument buffer skip the lock.
+ */
+static pthread_rwlock_t region_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct mem_region *regions;
+static atomic_size_t n_regions;
+
+static int get_heap(void)
+{
+	const char *path;
+	int fd;
+
+	pthread_mutex_lock(&heap_lock);
+
+	if (!heap_opened) {
+		path = getenv("HEXAGONRPC_DMA_HEAP");
+		if (path == NULL)
+			path = DEFAULT_DMA_HEAP;
+
+		heap_fd = open(path, O_RDONLY | O_CLOEXEC);
+		heap_opened = true;
+	}
+
+	fd = heap_fd;
+
+	pthread_mutex_unlock(&heap_lock);
+
+	return fd;
+}
+
+static int alloc_from_heap(int heap, size_t len)
+{
+	struct dma_heap_allocation_data data = {
+		.len = len,
+		.fd_flags = O_RDWR | O_CLOEXEC,
+	};
+	int ret;
+
+	ret = ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &data);
+	if (ret)
+		return -1;
+
+	return data.fd;
+}
+
+static int alloc_from_device(int fd, size_t len)
+{
+	struct fastrpc_alloc_dma_buf data = {
+		.fd = -1,
+		.size = len,
+	};
+	int ret;
+
+	ret = ioctl(fd, FASTRPC_IOCTL_ALLOC_DMA_BUFF, &data);
+	if (ret)
+		return -1;
+
+	return data.fd;
+}
+
+void fastrpc_mem_set_heap(int fd)
+{
+	pthread_mutex_lock(&heap_lock);
+
+	heap_fd = fd;
+	heap_opened = true;
+
+	pthread_mutex_unlock(&heap_lock);
+}
+
+void *fastrpc_mem_alloc(int fd, size_t size)
+{
+	struct mem_region *region;
+	size_t page;
+	int heap;
+
+	region = malloc(sizeof(*region));
+	if (region == NULL)
+		return NULL;
+
+	page = sysconf(_SC_PAGESIZE);
+	region->len = (size + page - 1) / page * page;
+	region->fd = -1;
+
+	heap = get_heap();
+	if (heap != -1)
+		region->fd = alloc_from_heap(heap, region->len);
+
+	if (region->fd == -1 && fd != -1)
+		region->fd = alloc_from_device(fd, region->len);
+
+	if (region->fd == -1)
+		goto err;
+
+	region->ptr = mmap(NULL, region->len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, region->fd, 0);
+	if (region->ptr == MAP_FAILED)
+		goto err_close;
+
+	pthread_rwlock_wrlock(&region_lock);
+
+	region->next = regions;
+	regions = region;
+	atomic_fetch_add(&n_regions, 1);
+
+	pthread_rwlock_unlock(&region_lock);
+
+	return region->ptr;
+
+err_close:
+	close(region->fd);
+err:
+	free(region);
+	return NULL;
+}
+
+int fastrpc_mem_free(void *ptr)
+{
+	struct mem_region **curr;
+	struct mem_region *region = NULL;
+
+	if (ptr == NULL)
+		return 0;
+
+	pthread_rwlock_wrlock(&region_lock);
+
+	for (curr = &regions; *curr != NULL; curr = &(*curr)->next) {
+		if ((*curr)->ptr != ptr)
+			continue;
+
+		/*
+		 * Cached mappings are found by file descriptor, address and
+		 * length, which the next buffer may reuse, so they go with the
+		 * buffer.
+		 */
+		if (hexagonrpc_map_caches_forget((*curr)->fd, ptr, (*curr)->len)) {
+			pthread_rwlock_unlock(&region_lock);
+			errno = EBUSY;
+			return -1;
+		}
+
+		region = *curr;
+		*curr = region->next;
+		atomic_fetch_sub(&n_regions, 1);
+		break;
+	}
+
+	pthread_rwlock_unlock(&region_lock);
+
+	if (region == NULL)
+		return 0;
+
+	munmap(region->ptr, region->len);
+	close(region->fd);
+	free(region);
+
+	return 0;
+}
+
+int fastrpc_mem_fd(const void *ptr, size_t len)
+{
+	const struct mem_region *region;
+	uintptr_t start = (uintptr_t) ptr;
+	int fd = -1;
+
+	if (!atomic_load_explicit(&n_regions, memory_order_relaxed) || !len)
+		return -1;
+
+	pthread_rwlock_rdlock(&region_lock);
+
+	for (region = regions; region != NULL; region = region->next) {
+		if (start >= (uintptr_t) region->ptr
+		 && start - (uintptr_t) region->ptr <= region->len
+		 && len <= region->len - (start - (uintptr_t) region->ptr)) {
+			fd = region->fd;
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&region_lock);
+
+	return fd;
+}
@@ -0,0 +1,343 @@
+/*
+ * FastRPC API Replacement - remote memory mappings
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <libhexagonrpc/mem.h>
+#include <misc/fastrpc.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+
+#include "mmap.h"
+
+struct map_entry {
+	int buf_fd;
+	const void *addr;
+	size_t len;
+
+	uint64_t raddr;
+	unsigned int refs;
+
+	struct map_entry *prev;
+	struct map_entry *next;
+};
+
+/*
+ * The entries are kept in order of last use, with the most recently used
+ * entry at the head. The lock is held while mapping so that two threads
+ * getting the same buffer do not map it twice.
+ */
+struct fastrpc_map_cache {
+	int fd;
+	uint32_t flags;
+	size_t max_bytes;
+
+	pthread_mutex_t lock;
+	size_t bytes;
+	struct map_entry *head;
+	struct map_entry *tail;
+
+	struct fastrpc_map_cache *next;
+};
+
+/*
+ * Every cache is listed so that freed buffers can be dropped from all of
+ * them. This lock is taken before the lock of a cache.
+ */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fastrpc_map_cache *caches;
+
+int fastrpc_mmap(int fd, int buf_fd, const void *addr, size_t len,
+		 uint32_t flags, uint64_t *raddr)
+{
+	struct fastrpc_req_mmap req = {
+		.fd = buf_fd,
+		.flags = flags,
+		.vaddrin = (__u64) addr,
+		.size = len,
+	};
+	int ret;
+
+	ret = ioctl(fd, FASTRPC_IOCTL_MMAP, &req);
+	if (ret)
+		return -1;
+
+	*raddr = req.vaddrout;
+
+	return 0;
+}
+
+int fastrpc_munmap(int fd, uint64_t raddr, size_t len)
+{
+	struct fastrpc_req_munmap req = {
+		.vaddrout = raddr,
+		.size = len,
+	};
+
+	return ioctl(fd, FASTRPC_IOCTL_MUNMAP, &req);
+}
+
+static void entry_unlink(struct fastrpc_map_cache *cache,
+			 struct map_entry *entry)
+{
+	if (entry->prev != NULL)
+		entry->prev->next = entry->next;
+	else
+		cache->head = entry->next;
+
+	if (entry->next != NULL)
+		entry->next->prev = entry->prev;
+	else
+		cache->tail = entry->prev;
+}
+
+static void entry_push(struct fastrpc_map_cache *cache,
+		       struct map_entry *entry)
+{
+	entry->prev = NULL;
+	entry->next = cache->head;
+
+	if (cache->head != NULL)
+		cache->head->prev = entry;
+	else
+		cache->tail = entry;
+
+	cache->head = entry;
+}
+
+static void entry_destroy(struct fastrpc_map_cache *cache,
+			  struct map_entry *entry)
+{
+	entry_unlink(cache, entry);
+	cache->bytes -= entry->len;
+
+	fastrpc_munmap(cache->fd, entry->raddr, entry->len);
+	free(entry);
+}
+
+static struct map_entry *cache_find(struct fastrpc_map_cache *cache,
+				    int buf_fd, const void *addr, size_t len)
+{
+	struct map_entry *entry;
+
+	for (entry = cache->head; entry != NULL; entry = entry->next) {
+		if (entry->buf_fd == buf_fd
+		 && entry->addr == addr
+		 && entry->len == len)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * Unmap released entries, least recently used first, until the cache holds
+ * at most the given number of bytes.
+ */
+static void cache_evict(struct fastrpc_map_cache *cache, size_t max_bytes)
+{
+	struct map_entry *entry, *prev;
+
+	for (entry = cache->tail;
+	     entry != NULL && cache->bytes > max_bytes;
+	     entry = prev) {
+		prev = entry->prev;
+
+		if (!entry->refs)
+			entry_destroy(cache, entry);
+	}
+}
+
+struct fastrpc_map_cache *fastrpc_map_cache_create(int fd, uint32_t flags,
+						   size_t max_bytes)
+{
+	struct fastrpc_map_cache *cache;
+
+	cache = malloc(sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+
+	cache->fd = fd;
+	cache->flags = flags;
+	cache->max_bytes = max_bytes;
+	cache->bytes = 0;
+	cache->head = NULL;
+	cache->tail = NULL;
+
+	pthread_mutex_init(&cache->lock, NULL);
+
+	pthread_mutex_lock(&caches_lock);
+	cache->next = caches;
+	caches = cache;
+	pthread_mutex_unlock(&caches_lock);
+
+	return cache;
+}
+
+void fastrpc_map_cache_destroy(struct fastrpc_map_cache *cache)
+{
+	struct fastrpc_map_cache **curr;
+
+	pthread_mutex_lock(&caches_lock);
+
+	for (curr = &caches; *curr != NULL; curr = &(*curr)->next) {
+		if (*curr == cache) {
+			*curr = cache->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&caches_lock);
+
+	while (cache->head != NULL)
+		entry_destroy(cache, cache->head);
+
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+int fastrpc_map_cache_get(struct fastrpc_map_cache *cache,
+			  int buf_fd, const void *addr, size_t len,
+			  uint64_t *raddr)
+{
+	struct map_entry *entry;
+	int ret;
+
+	pthread_mutex_lock(&cache->lock);
+
+	entry = cache_find(cache, buf_fd, addr, len);
+	if (entry != NULL) {
+		entry_unlink(cache, entry);
+		goto found;
+	}
+
+	entry = malloc(sizeof(*entry));
+	if (entry == NULL)
+		goto err;
+
+	ret = fastrpc_mmap(cache->fd, buf_fd, addr, len,
+			   cache->flags, &entry->raddr);
+	if (ret && errno == ENOMEM) {
+		cache_evict(cache, 0);
+		ret = fastrpc_mmap(cache->fd, buf_fd, addr, len,
+				   cache->flags, &entry->raddr);
+	}
+
+	if (ret)
+		goto err_free;
+
+	entry->buf_fd = buf_fd;
+	entry->addr = addr;
+	entry->len = len;
+	entry->refs = 0;
+
+	cache->bytes += len;
+
+found:
+	entry->refs++;
+	entry_push(cache, entry);
+
+	*raddr = entry->raddr;
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+
+err_free:
+	free(entry);
+err:
+	pthread_mutex_unlock(&cache->lock);
+	return -1;
+}
+
+void fastrpc_map_cache_put(struct fastrpc_map_cache *cache,
+			   int buf_fd, const void *addr, size_t len)
+{
+	struct map_entry *entry;
+
+	pthread_mutex_lock(&cache->lock);
+
+	entry = cache_find(cache, buf_fd, addr, len);
+	if (entry != NULL && entry->refs) {
+		entry->refs--;
+
+		if (!entry->refs)
+			cache_evict(cache, cache->max_bytes);
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void fastrpc_map_cache_trim(struct fastrpc_map_cache *cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	cache_evict(cache, 0);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static bool entry_in_range(const struct map_entry *entry,
+			   int buf_fd, const void *addr, size_t len)
+{
+	uintptr_t start = (uintptr_t) addr;
+
+	return entry->buf_fd == buf_fd
+	    && (uintptr_t) entry->addr >= start
+	    && (uintptr_t) entry->addr - start < len;
+}
+
+int hexagonrpc_map_caches_forget(int buf_fd, const void *addr, size_t len)
+{
+	struct fastrpc_map_cache *cache;
+	struct map_entry *entry, *next;
+	int ret = 0;
+
+	pthread_mutex_lock(&caches_lock);
+
+	for (cache = caches; cache != NULL; cache = cache->next)
+		pthread_mutex_lock(&cache->lock);
+
+	for (cache = caches; cache != NULL && !ret; cache = cache->next) {
+		for (entry = cache->head; entry != NULL; entry = entry->next) {
+			if (entry->refs && entry_in_range(entry, buf_fd, addr, len)) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+
+	for (cache = caches; cache != NULL; cache = cache->next) {
+		for (entry = cache->head; entry != NULL && !ret; entry = next) {
+			next = entry->next;
+
+			if (entry_in_range(entry, buf_fd, addr, len))
+				entry_destroy(cache, entry);
+		}
+
+		pthread_mutex_unlock(&cache->lock);
+	}
+
+	pthread_mutex_unlock(&caches_lock);
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+/*
+ * FastRPC API Replacement - internal map cache hooks
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_MMAP_H
+#define LIBHEXAGONRPC_MMAP_H
+
+#include <stddef.h>
+
+/*
+ * Unmap the released mappings of a buffer range in every map cache, before
+ * the buffer is freed and its file descriptor and address can be reused.
+ *
+ * Returns 0 on success, or -1 if a mapping of the range is still in use, in
+ * which case nothing is unmapped.
+ */
+int hexagonrpc_map_caches_forget(int buf_fd, const void *addr, size_t len);
+
+#endif /* LIBHEXAGONRPC_MMAP_H */
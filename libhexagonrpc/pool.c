@@ -0,0 +1,197 @@
+/*
+ * FastRPC API Replacement - internal worker pool
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define POOL_DEFAULT_THREADS 4
+#define POOL_MAX_THREADS 64
+
+/*
+ * The threads are detached and live as long as the process, so a pool never
+ * needs to be torn down.
+ *
+ * A fixed pool starts all of its threads on first use. A growing pool starts
+ * a thread whenever work is queued and no thread is idle, up to max_threads.
+ */
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct hexagonrpc_work *head;
+	struct hexagonrpc_work *tail;
+
+	bool grow;
+	long max_threads;
+	long n_threads;
+	long n_idle;
+	size_t n_queued;
+};
+
+static struct pool batch_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.grow = false,
+};
+
+static struct pool async_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.grow = true,
+	.max_threads = POOL_MAX_THREADS,
+};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+
+static void *pool_thread(void *data)
+{
+	struct pool *pool = data;
+	struct hexagonrpc_work *work;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (true) {
+		pool->n_idle++;
+
+		while (pool->head == NULL)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		pool->n_idle--;
+		pool->n_queued--;
+
+		work = pool->head;
+		pool->head = work->next;
+		if (pool->head == NULL)
+			pool->tail = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		work->func(work);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	return NULL;
+}
+
+static long pool_thread_count(void)
+{
+	const char *str;
+	char *end;
+	long n;
+
+	str = getenv("HEXAGONRPC_POOL_THREADS");
+	if (str == NULL)
+		return POOL_DEFAULT_THREADS;
+
+	n = strtol(str, &end, 10);
+	if (*end != '\0' || n < 1 || n > POOL_MAX_THREADS)
+		return POOL_DEFAULT_THREADS;
+
+	return n;
+}
+
+static void pool_init(void)
+{
+	batch_pool.max_threads = pool_thread_count();
+}
+
+// Start one more thread for the pool. The lock must be held.
+static int pool_spawn(struct pool *pool)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	if (pthread_attr_init(&attr))
+		return -1;
+
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	ret = pthread_create(&thread, &attr, pool_thread, pool);
+	if (!ret)
+		pool->n_threads++;
+
+	pthread_attr_destroy(&attr);
+
+	return ret ? -1 : 0;
+}
+
+/*
+ * Make sure there are threads to run the queued work. The lock must be held.
+ *
+ * Starting at least one thread is enough for the pool to make progress.
+ */
+static int pool_fill(struct pool *pool)
+{
+	if (pool->grow) {
+		if ((size_t) pool->n_idle < pool->n_queued + 1
+		 && pool->n_threads < pool->max_threads)
+			pool_spawn(pool);
+	} else {
+		while (pool->n_threads < pool->max_threads) {
+			if (pool_spawn(pool))
+				break;
+		}
+	}
+
+	return pool->n_threads ? 0 : -1;
+}
+
+static int pool_submit(struct pool *pool, struct hexagonrpc_work *work)
+{
+	pthread_once(&pool_once, pool_init);
+
+	work->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool_fill(pool)) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+
+	if (pool->tail != NULL)
+		pool->tail->next = work;
+	else
+		pool->head = work;
+
+	pool->tail = work;
+	pool->n_queued++;
+
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+int hexagonrpc_pool_submit(struct hexagonrpc_work *work)
+{
+	return pool_submit(&batch_pool, work);
+}
+
+int hexagonrpc_async_pool_submit(struct hexagonrpc_work *work)
+{
+	return pool_submit(&async_pool, work);
+}
@@ -0,0 +1,52 @@
+/*
+ * FastRPC API Replacement - internal worker pool
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_POOL_H
+#define LIBHEXAGONRPC_POOL_H
+
+/*
+ * A unit of work for the pool. It is embedded in a larger struct that holds
+ * the data for the work function.
+ */
+struct hexagonrpc_work {
+	void (*func)(struct hexagonrpc_work *work);
+	struct hexagonrpc_work *next;
+};
+
+/*
+ * Queue work to run on one of the pool threads. The pool is started on first
+ * use, with HEXAGONRPC_POOL_THREADS threads (4 by default).
+ *
+ * Returns 0 on success, or -1 if the pool could not be started. In that case,
+ * the caller should run the work itself.
+ */
+int hexagonrpc_pool_submit(struct hexagonrpc_work *work);
+
+/*
+ * Queue work on the pool for asynchronous calls. This pool is separate from
+ * the one above, so that long-running calls cannot starve batches, and it
+ * starts a new thread whenever no thread is idle, up to 64 threads.
+ *
+ * Returns 0 on success, or -1 if no thread could be started.
+ */
+int hexagonrpc_async_pool_submit(struct hexagonrpc_work *work);
+
+#endif /* LIBHEXAGONRPC_POOL_H */
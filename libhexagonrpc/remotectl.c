@@ -0,0 +1,341 @@
+/*
+ * FastRPC API Replacement - remote handle management
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/interfaces/remotectl.def>
+#include <libhexagonrpc/remotectl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * A handle is shared by the contexts for the same interface on the same open
+ * file. The file is identified by the device and inode numbers as well as
+ * the file descriptor, so that a file descriptor number that was closed and
+ * reused for another file does not find the handles of the old one.
+ */
+struct remote_handle {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	char *name;
+	uint32_t handle;
+	unsigned int refs;
+	bool opening;
+
+	struct remote_handle *next;
+};
+
+/*
+ * The lock protects the list of handles, but is not held while the remote
+ * processor opens or closes a handle. A handle that is being opened stays in
+ * the list so that concurrent users of the same interface wait for it instead
+ * of opening it again.
+ */
+static pthread_mutex_t handles_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t handles_cond = PTHREAD_COND_INITIALIZER;
+static struct remote_handle *handles;
+
+/*
+ * Handles of files that their file descriptor no longer refers to. They are
+ * not shared with new contexts, but are still counted so that only their last
+ * context closes them.
+ */
+static struct remote_handle *stale_handles;
+
+static void get_identity(int fd, dev_t *dev, ino_t *ino)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		*dev = 0;
+		*ino = 0;
+		return;
+	}
+
+	*dev = st.st_dev;
+	*ino = st.st_ino;
+}
+
+// Move the handles of a file that the file descriptor no longer refers to
+static void forget_stale(int fd, dev_t dev, ino_t ino)
+{
+	struct remote_handle **curr = &handles;
+	struct remote_handle *rh;
+
+	while (*curr != NULL) {
+		rh = *curr;
+
+		if (rh->fd == fd && !rh->opening
+		 && (rh->dev != dev || rh->ino != ino)) {
+			*curr = rh->next;
+			rh->next = stale_handles;
+			stale_handles = rh;
+		} else {
+			curr = &rh->next;
+		}
+	}
+}
+
+static struct remote_handle *find_by_name(int fd, dev_t dev, ino_t ino,
+					  const char *name)
+{
+	struct remote_handle *rh;
+
+	for (rh = handles; rh != NULL; rh = rh->next) {
+		if (rh->fd == fd && rh->dev == dev && rh->ino == ino
+		 && !strcmp(rh->name, name))
+			return rh;
+	}
+
+	return NULL;
+}
+
+static struct remote_handle **find_by_handle(int fd, dev_t dev, ino_t ino,
+					     uint32_t handle)
+{
+	struct remote_handle **curr;
+
+	for (curr = &handles; *curr != NULL; curr = &(*curr)->next) {
+		if ((*curr)->fd == fd && (*curr)->dev == dev && (*curr)->ino == ino
+		 && !(*curr)->opening && (*curr)->handle == handle)
+			return curr;
+	}
+
+	return NULL;
+}
+
+/*
+ * The contexts do not know which file they were opened on, so any stale
+ * handle with the same number on the same file descriptor is taken.
+ */
+static struct remote_handle **find_stale(int fd, uint32_t handle)
+{
+	struct remote_handle **curr;
+
+	for (curr = &stale_handles; *curr != NULL; curr = &(*curr)->next) {
+		if ((*curr)->fd == fd && (*curr)->handle == handle)
+			return curr;
+	}
+
+	return NULL;
+}
+
+static void unlink_handle(struct remote_handle *rh)
+{
+	struct remote_handle **curr;
+
+	for (curr = &handles; *curr != NULL; curr = &(*curr)->next) {
+		if (*curr == rh) {
+			*curr = rh->next;
+			break;
+		}
+	}
+}
+
+static int open_remote(int fd, const char *name, uint32_t *handle,
+		       void (*err_cb)(const char *err))
+{
+	char err[256] = { 0 };
+	struct remotectl_open_args args = {
+		.in_bufs = { { .s = strlen(name) + 1, .p = (void *) name, }, },
+		.out_bufs = { { .s = 256, .p = err, }, },
+	};
+	int32_t dlret;
+	int ret;
+
+	ret = remotectl_open_invoke(fd, REMOTECTL_HANDLE, &args);
+
+	*handle = args.out_nums[0];
+	dlret = args.out_nums[1];
+
+	if (ret == -1) {
+		err_cb(strerror(errno));
+		return ret;
+	}
+
+	if (dlret == -5)
+		err_cb(err);
+
+	return dlret;
+}
+
+static int close_remote(int fd, uint32_t handle,
+			void (*err_cb)(const char *err))
+{
+	char err[256] = { 0 };
+	struct remotectl_close_args args = {
+		.in_nums = { handle, },
+		.out_bufs = { { .s = 256, .p = err, }, },
+	};
+	int ret;
+
+	ret = remotectl_close_invoke(fd, REMOTECTL_HANDLE, &args);
+
+	if (ret == -1) {
+		err_cb(strerror(errno));
+		return ret;
+	}
+
+	return args.out_nums[0];
+}
+
+int remotectl_open(int fd, const char *name,
+		   struct fastrpc_context **ctx,
+		   void (*err_cb)(const char *err))
+{
+	struct remote_handle *rh;
+	dev_t dev;
+	ino_t ino;
+	int ret = -1;
+
+	get_identity(fd, &dev, &ino);
+
+	pthread_mutex_lock(&handles_lock);
+
+	forget_stale(fd, dev, ino);
+
+	// Wait for another thread that is opening the same interface
+	while ((rh = find_by_name(fd, dev, ino, name)) != NULL && rh->opening)
+		pthread_cond_wait(&handles_cond, &handles_lock);
+
+	if (rh != NULL)
+		goto found;
+
+	rh = malloc(sizeof(*rh));
+	if (rh == NULL) {
+		err_cb(strerror(ENOMEM));
+		goto err;
+	}
+
+	rh->name = strdup(name);
+	if (rh->name == NULL) {
+		err_cb(strerror(ENOMEM));
+		goto err_free;
+	}
+
+	rh->fd = fd;
+	rh->dev = dev;
+	rh->ino = ino;
+	rh->refs = 0;
+	rh->opening = true;
+	rh->next = handles;
+	handles = rh;
+
+	pthread_mutex_unlock(&handles_lock);
+
+	ret = open_remote(fd, name, &rh->handle, err_cb);
+
+	pthread_mutex_lock(&handles_lock);
+
+	rh->opening = false;
+	pthread_cond_broadcast(&handles_cond);
+
+	if (ret) {
+		unlink_handle(rh);
+		goto err_free_name;
+	}
+
+found:
+	*ctx = fastrpc_create_context(fd, rh->handle);
+	if (*ctx == NULL) {
+		err_cb(strerror(ENOMEM));
+		ret = -1;
+
+		if (!rh->refs)
+			goto err_close;
+
+		goto err;
+	}
+
+	rh->refs++;
+
+	pthread_mutex_unlock(&handles_lock);
+
+	return 0;
+
+err_close:
+	unlink_handle(rh);
+	pthread_mutex_unlock(&handles_lock);
+
+	close_remote(fd, rh->handle, err_cb);
+
+	free(rh->name);
+	free(rh);
+	return ret;
+
+err_free_name:
+	free(rh->name);
+err_free:
+	free(rh);
+err:
+	pthread_mutex_unlock(&handles_lock);
+	return ret;
+}
+
+int remotectl_close(struct fastrpc_context *ctx,
+		    void (*err_cb)(const char *err))
+{
+	struct remote_handle **curr;
+	struct remote_handle *rh = NULL;
+	dev_t dev;
+	ino_t ino;
+	int ret;
+
+	get_identity(ctx->fd, &dev, &ino);
+
+	pthread_mutex_lock(&handles_lock);
+
+	curr = find_by_handle(ctx->fd, dev, ino, ctx->handle);
+	if (curr == NULL)
+		curr = find_stale(ctx->fd, ctx->handle);
+
+	if (curr != NULL) {
+		(*curr)->refs--;
+
+		// The last user takes the handle out of the list to close it
+		if (!(*curr)->refs) {
+			rh = *curr;
+			*curr = rh->next;
+		}
+	}
+
+	pthread_mutex_unlock(&handles_lock);
+
+	// Contexts for handles opened elsewhere are closed directly
+	if (curr == NULL || rh != NULL)
+		ret = close_remote(ctx->fd, ctx->handle, err_cb);
+	else
+		ret = 0;
+
+	if (rh != NULL) {
+		free(rh->name);
+		free(rh);
+	}
+
+	fastrpc_destroy_context(ctx);
+
+	return ret;
+}
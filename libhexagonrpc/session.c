@@ -19,6 +19,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <libhexagonrpc/session.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -30,7 +31,7 @@ int hexagonrpc_fd_from_env(void)
 
 	fd_str = getenv("HEXAGONRPC_FD");
 	if (fd_str == NULL)
-		return -1;
+		return hexagonrpc_broker_from_env();
 
 	fd = strtol(fd_str, &num_end, 10);
 	if (fd != (int) fd || fd < 0 || *num_end != '\0')
@@ -0,0 +1,317 @@
+/*
+ * FastRPC API Replacement - per-method call statistics
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/stats.h>
+#include <misc/fastrpc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+
+#include "transport.h"
+
+#define STATS_TABLE_SIZE 256
+
+/*
+ * The table is filled with open addressing and entries are never removed, so
+ * recording a call only takes atomic operations. A key of 0 marks an unused
+ * entry.
+ */
+struct stats_entry {
+	atomic_uint_fast64_t key;
+
+	atomic_uint_fast64_t calls;
+	atomic_uint_fast64_t errors;
+	atomic_uint_fast64_t arg_bytes_in;
+	atomic_uint_fast64_t arg_bytes_out;
+	atomic_uint_fast64_t total_ns;
+	atomic_uint_fast64_t max_ns;
+	atomic_uint_fast64_t buckets[FASTRPC_STATS_BUCKETS];
+};
+
+static struct stats_entry stats_table[STATS_TABLE_SIZE];
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static const char *stats_path;
+
+static void dump_at_exit(void)
+{
+	FILE *f;
+
+	if (!stats_path[0] || !strcmp(stats_path, "-")) {
+		fastrpc_stats_dump(stderr);
+		return;
+	}
+
+	f = fopen(stats_path, "a");
+	if (f == NULL)
+		return;
+
+	fastrpc_stats_dump(f);
+	fclose(f);
+}
+
+static void stats_init(void)
+{
+	stats_path = getenv("HEXAGONRPC_STATS");
+	if (stats_path != NULL)
+		atexit(dump_at_exit);
+}
+
+static uint64_t make_key(uint32_t handle, uint32_t sc)
+{
+	return ((uint64_t) handle << 32 | REMOTE_SCALARS_METHOD(sc)) + 1;
+}
+
+static struct stats_entry *find_entry(uint64_t key)
+{
+	uint_fast64_t curr;
+	size_t i, n;
+
+	i = (key * 0x9e3779b97f4a7c15) >> 56;
+
+	for (n = 0; n < STATS_TABLE_SIZE; n++) {
+		curr = atomic_load_explicit(&stats_table[i].key,
+					    memory_order_acquire);
+		if (curr == key)
+			return &stats_table[i];
+
+		if (!curr && atomic_compare_exchange_strong(&stats_table[i].key,
+							    &curr, key))
+			return &stats_table[i];
+
+		// Another thread may have just claimed it for the same key
+		if (curr == key)
+			return &stats_table[i];
+
+		i = (i + 1) % STATS_TABLE_SIZE;
+	}
+
+	return NULL;
+}
+
+static unsigned int latency_bucket(uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int bucket;
+
+	bucket = us ? 64 - __builtin_clzll(us) : 0;
+	if (bucket >= FASTRPC_STATS_BUCKETS)
+		bucket = FASTRPC_STATS_BUCKETS - 1;
+
+	return bucket;
+}
+
+static void record(uint32_t handle, uint32_t sc,
+		   const struct fastrpc_invoke_args *args,
+		   uint64_t ns, int ret)
+{
+	struct stats_entry *entry;
+	uint_fast64_t max;
+	uint64_t bytes_in = 0, bytes_out = 0;
+	uint32_t i, n_in, n_out;
+
+	entry = find_entry(make_key(handle, sc));
+	if (entry == NULL)
+		return;
+
+	n_in = REMOTE_SCALARS_INBUFS(sc);
+	n_out = REMOTE_SCALARS_OUTBUFS(sc);
+
+	for (i = 0; i < n_in; i++)
+		bytes_in += args[i].length;
+
+	for (i = 0; i < n_out; i++)
+		bytes_out += args[n_in + i].length;
+
+	atomic_fetch_add_explicit(&entry->calls, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->arg_bytes_in, bytes_in, memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->arg_bytes_out, bytes_out, memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->total_ns, ns, memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->buckets[latency_bucket(ns)], 1,
+				  memory_order_relaxed);
+
+	if (ret)
+		atomic_fetch_add_explicit(&entry->errors, 1, memory_order_relaxed);
+
+	max = atomic_load_explicit(&entry->max_ns, memory_order_relaxed);
+	while (ns > max
+	    && !atomic_compare_exchange_weak_explicit(&entry->max_ns, &max, ns,
+						      memory_order_relaxed,
+						      memory_order_relaxed));
+}
+
+static uint64_t elapsed_ns(const struct timespec *start,
+			   const struct timespec *end)
+{
+	return (uint64_t) (end->tv_sec - start->tv_sec) * 1000000000
+	     + end->tv_nsec - start->tv_nsec;
+}
+
+int fastrpc_invoke(int fd, uint32_t handle, uint32_t sc,
+		   struct fastrpc_invoke_args *args)
+{
+	struct hexagonrpc_broker *broker;
+	struct fastrpc_invoke invoke;
+	struct timespec start, end;
+	int ret;
+
+	pthread_once(&stats_once, stats_init);
+
+	broker = hexagonrpc_broker_find(fd);
+
+	invoke.handle = handle;
+	invoke.sc = sc;
+	invoke.args = (__u64) args;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if (broker != NULL)
+		ret = hexagonrpc_broker_invoke(broker, handle, sc, args);
+	else
+		ret = ioctl(fd, FASTRPC_IOCTL_INVOKE, (__u64) &invoke);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (broker != NULL)
+		hexagonrpc_broker_put(broker);
+
+	record(handle, sc, args, elapsed_ns(&start, &end), ret);
+
+	return ret;
+}
+
+size_t fastrpc_stats_snapshot(struct fastrpc_method_stats *stats,
+			      size_t max_stats)
+{
+	const struct stats_entry *entry;
+	struct fastrpc_method_stats *out;
+	uint64_t key, calls;
+	size_t i, j, n = 0;
+
+	for (i = 0; i < STATS_TABLE_SIZE; i++) {
+		entry = &stats_table[i];
+
+		// The calls are only read once, since a reset may clear them
+		key = atomic_load_explicit(&entry->key, memory_order_acquire);
+		calls = atomic_load_explicit(&entry->calls, memory_order_relaxed);
+		if (!key || !calls)
+			continue;
+
+		if (n < max_stats) {
+			out = &stats[n];
+
+			out->handle = (key - 1) >> 32;
+			out->msg_id = (key - 1) & 0xffffffff;
+			out->calls = calls;
+			out->errors = atomic_load_explicit(&entry->errors, memory_order_relaxed);
+			out->arg_bytes_in = atomic_load_explicit(&entry->arg_bytes_in, memory_order_relaxed);
+			out->arg_bytes_out = atomic_load_explicit(&entry->arg_bytes_out, memory_order_relaxed);
+			out->total_ns = atomic_load_explicit(&entry->total_ns, memory_order_relaxed);
+			out->max_ns = atomic_load_explicit(&entry->max_ns, memory_order_relaxed);
+
+			for (j = 0; j < FASTRPC_STATS_BUCKETS; j++)
+				out->buckets[j] = atomic_load_explicit(&entry->buckets[j], memory_order_relaxed);
+		}
+
+		n++;
+	}
+
+	return n;
+}
+
+void fastrpc_stats_reset(void)
+{
+	struct stats_entry *entry;
+	size_t i, j;
+
+	for (i = 0; i < STATS_TABLE_SIZE; i++) {
+		entry = &stats_table[i];
+
+		atomic_store_explicit(&entry->calls, 0, memory_order_relaxed);
+		atomic_store_explicit(&entry->errors, 0, memory_order_relaxed);
+		atomic_store_explicit(&entry->arg_bytes_in, 0, memory_order_relaxed);
+		atomic_store_explicit(&entry->arg_bytes_out, 0, memory_order_relaxed);
+		atomic_store_explicit(&entry->total_ns, 0, memory_order_relaxed);
+		atomic_store_explicit(&entry->max_ns, 0, memory_order_relaxed);
+
+		for (j = 0; j < FASTRPC_STATS_BUCKETS; j++)
+			atomic_store_explicit(&entry->buckets[j], 0, memory_order_relaxed);
+	}
+}
+
+/*
+ * Find the upper bound of the bucket that contains the given percentile of
+ * calls. The percentiles in the summary are therefore rounded up to a power
+ * of two.
+ */
+static uint64_t percentile_us(const struct fastrpc_method_stats *stats,
+			      unsigned int percent)
+{
+	uint64_t seen = 0;
+	unsigned int i;
+
+	for (i = 0; i < FASTRPC_STATS_BUCKETS; i++) {
+		seen += stats->buckets[i];
+		if (seen * 100 >= stats->calls * percent)
+			break;
+	}
+
+	return (uint64_t) 1 << i;
+}
+
+void fastrpc_stats_dump(FILE *f)
+{
+	struct fastrpc_method_stats *stats;
+	const struct fastrpc_method_stats *s;
+	size_t i, n;
+
+	stats = malloc(sizeof(*stats) * STATS_TABLE_SIZE);
+	if (stats == NULL)
+		return;
+
+	n = fastrpc_stats_snapshot(stats, STATS_TABLE_SIZE);
+
+	fprintf(f, "%-8s %-6s %10s %8s %14s %14s %10s %10s %10s %10s\n",
+		"handle", "method", "calls", "errors", "arg_bytes_in", "arg_bytes_out",
+		"avg_us", "p50_us", "p99_us", "max_us");
+
+	for (i = 0; i < n; i++) {
+		s = &stats[i];
+
+		fprintf(f, "%-8u %-6u %10llu %8llu %14llu %14llu %10llu %10llu %10llu %10llu\n",
+			s->handle, s->msg_id,
+			(unsigned long long) s->calls,
+			(unsigned long long) s->errors,
+			(unsigned long long) s->arg_bytes_in,
+			(unsigned long long) s->arg_bytes_out,
+			(unsigned long long) (s->total_ns / s->calls / 1000),
+			(unsigned long long) percentile_us(s, 50),
+			(unsigned long long) percentile_us(s, 99),
+			(unsigned long long) (s->max_ns / 1000));
+	}
+
+	free(stats);
+}
@@ -0,0 +1,49 @@
+/*
+ * FastRPC API Replacement - invocation transports
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIBHEXAGONRPC_TRANSPORT_H
+#define LIBHEXAGONRPC_TRANSPORT_H
+
+#include <misc/fastrpc.h>
+#include <stdint.h>
+
+struct hexagonrpc_broker;
+
+/*
+ * Find the broker connection for a file descriptor from
+ * hexagonrpc_broker_connect() and take a reference to it, which must be
+ * dropped with hexagonrpc_broker_put().
+ *
+ * Returns NULL if the file descriptor is not a broker connection.
+ */
+struct hexagonrpc_broker *hexagonrpc_broker_find(int fd);
+
+void hexagonrpc_broker_put(struct hexagonrpc_broker *broker);
+
+/*
+ * Forward an invocation to a broker. This has the same return value and
+ * errno as FASTRPC_IOCTL_INVOKE.
+ */
+int hexagonrpc_broker_invoke(struct hexagonrpc_broker *broker,
+			     uint32_t handle, uint32_t sc,
+			     const struct fastrpc_invoke_args *args);
+
+#endif /* LIBHEXAGONRPC_TRANSPORT_H */
@@ -0,0 +1,199 @@
+/*
+ * FastRPC reverse tunnel - tests for remote processor logs
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <libhexagonrpc/fastrpc.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../hexagonrpcd/adspmsgd.h"
+
+static int send_nodes(struct fastrpc_interface *iface,
+		      struct adspmsgd_log_node *nodes, size_t n_nodes)
+{
+	struct fastrpc_io_buffer inbuf = {
+		.s = sizeof(struct adspmsgd_log_node) * n_nodes,
+		.p = nodes,
+	};
+
+	return iface->procs[0].impl(iface->data, &inbuf, NULL);
+}
+
+static char *read_log(const char *path)
+{
+	char *buf;
+	size_t len;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (f == NULL)
+		return NULL;
+
+	buf = calloc(1, 1048576);
+	if (buf != NULL) {
+		len = fread(buf, 1, 1048575, f);
+		buf[len] = '\0';
+	}
+
+	fclose(f);
+
+	return buf;
+}
+
+static int test_format(const char *path)
+{
+	static const char expected[] =
+		"adsp: [1] sns_main.c:12 HIGH: hello\n"
+		"adsp: [2] a_file_name_that_fills_it_all!:65535 UNKNOWN: \n";
+	struct adspmsgd_log_node nodes[3];
+	struct fastrpc_interface *iface;
+	char *log;
+	int ret;
+
+	// The layout sent by the remote processor
+	if (sizeof(struct adspmsgd_log_node) != 256
+	 || offsetof(struct adspmsgd_log_node, file) != 8
+	 || offsetof(struct adspmsgd_log_node, msg) != 38)
+		return 1;
+
+	memset(nodes, 0, sizeof(nodes));
+
+	nodes[0].level = 2;
+	nodes[0].line = 12;
+	nodes[0].thread_id = 1;
+	strcpy(nodes[0].msg, "hello\n");
+	strcpy(nodes[0].file, "sns_main.c");
+
+	// Unterminated file name and unknown level
+	nodes[1].level = 42;
+	nodes[1].line = 65535;
+	nodes[1].thread_id = 2;
+	memcpy(nodes[1].file, "a_file_name_that_fills_it_all!", ADSPMSGD_FILENAME_SIZE);
+
+	// Unterminated message
+	nodes[2].level = 4;
+	nodes[2].line = 1;
+	nodes[2].thread_id = 3;
+	memset(nodes[2].msg, 'x', sizeof(nodes[2].msg));
+	strcpy(nodes[2].file, "f.c");
+
+	iface = fastrpc_adspmsgd_init(path);
+	if (iface == NULL)
+		return 1;
+
+	// Stopping should write out the messages before the interface is freed
+	ret = send_nodes(iface, nodes, 3);
+	fastrpc_adspmsgd_stop(iface);
+
+	log = read_log(path);
+	fastrpc_adspmsgd_deinit(iface);
+	if (ret || log == NULL)
+		return 1;
+
+	ret = strncmp(log, expected, strlen(expected))
+	   || strncmp(&log[strlen(expected)], "adsp: [3] f.c:1 FATAL: ", 23)
+	   || strspn(&log[strlen(expected) + 23], "x") != ADSPMSGD_MSG_SIZE
+	   || strcmp(&log[strlen(expected) + 23 + ADSPMSGD_MSG_SIZE], "\n");
+
+	free(log);
+
+	return ret;
+}
+
+/*
+ * Send more messages than the ring can hold at once, and check that every
+ * message is either written or counted as dropped.
+ */
+static int test_burst(const char *path)
+{
+	struct fastrpc_interface *iface;
+	struct adspmsgd_log_node *nodes;
+	const char *curr;
+	size_t n_written = 0, n_dropped = 0;
+	unsigned long dropped;
+	char *log;
+	int i, ret;
+
+	nodes = calloc(1000, sizeof(struct adspmsgd_log_node));
+	if (nodes == NULL)
+		return 1;
+
+	for (i = 0; i < 1000; i++) {
+		nodes[i].line = i;
+		memset(nodes[i].msg, 'a' + i % 26, 100);
+		strcpy(nodes[i].file, "burst.c");
+	}
+
+	iface = fastrpc_adspmsgd_init(path);
+	if (iface == NULL)
+		return 1;
+
+	ret = 0;
+	for (i = 0; i < 4 && !ret; i++)
+		ret = send_nodes(iface, nodes, 1000);
+
+	fastrpc_adspmsgd_deinit(iface);
+	free(nodes);
+	if (ret)
+		return 1;
+
+	log = read_log(path);
+	if (log == NULL)
+		return 1;
+
+	for (curr = log; *curr != '\0'; curr = strchr(curr, '\n') + 1) {
+		if (!strncmp(curr, "adsp: ", 6))
+			n_written++;
+		else if (sscanf(curr, "adspmsgd: dropped %lu messages", &dropped) == 1)
+			n_dropped += dropped;
+		else
+			break;
+	}
+
+	free(log);
+
+	return n_written + n_dropped != 4000;
+}
+
+int main(int argc, const char **argv)
+{
+	char path[] = "/tmp/test_adspmsgd.XXXXXX";
+	int fd, ret;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return 1;
+
+	close(fd);
+
+	ret = test_format(path);
+	if (!ret)
+		ret = truncate(path, 0);
+	if (!ret)
+		ret = test_burst(path);
+
+	unlink(path);
+
+	return ret;
+}
@@ -0,0 +1,234 @@
+/*
+ * FastRPC reverse tunnel - tests for shared memory requests
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/mem.h>
+#include <misc/fastrpc.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../hexagonrpcd/aee_error.h"
+#include "../hexagonrpcd/apps_mem.h"
+
+static unsigned int n_allocs;
+static unsigned int n_maps;
+static unsigned int n_unmaps;
+static uint64_t next_raddr = 0x10000000;
+
+/*
+ * Stand in for the FastRPC device, with memfds instead of dma-bufs and
+ * made-up remote addresses.
+ */
+int ioctl(int fd, unsigned long req, ...)
+{
+	struct fastrpc_alloc_dma_buf *alloc;
+	struct fastrpc_req_mmap *map;
+	va_list va;
+	void *arg;
+
+	va_start(va, req);
+	arg = va_arg(va, void *);
+	va_end(va);
+
+	switch (req) {
+		case FASTRPC_IOCTL_ALLOC_DMA_BUFF:
+			alloc = arg;
+			alloc->fd = memfd_create("apps_mem", MFD_CLOEXEC);
+			if (alloc->fd == -1)
+				return -1;
+
+			if (ftruncate(alloc->fd, alloc->size)) {
+				close(alloc->fd);
+				return -1;
+			}
+
+			n_allocs++;
+			return 0;
+		case FASTRPC_IOCTL_MMAP:
+			map = arg;
+			if (map->fd < 0) {
+				errno = EBADF;
+				return -1;
+			}
+
+			map->vaddrout = next_raddr;
+			next_raddr += map->size;
+			n_maps++;
+			return 0;
+		case FASTRPC_IOCTL_MUNMAP:
+			n_unmaps++;
+			return 0;
+		default:
+			errno = ENOTTY;
+			return -1;
+	}
+}
+
+static uint32_t map64(struct fastrpc_interface *iface, int64_t len,
+		      uint64_t *vapps, uint64_t *vadsp)
+{
+	struct {
+		int32_t heapid;
+		uint32_t lflags;
+		uint32_t rflags;
+		uint64_t vin;
+		int64_t len;
+	} __attribute__((packed)) in = { .len = len, };
+	uint64_t out[2];
+	struct fastrpc_io_buffer inbuf = { .s = sizeof(in), .p = &in, };
+	struct fastrpc_io_buffer outbuf = { .s = sizeof(out), .p = out, };
+	uint32_t ret;
+
+	ret = iface->procs[2].impl(iface->data, &inbuf, &outbuf);
+
+	*vapps = out[0];
+	*vadsp = out[1];
+
+	return ret;
+}
+
+static uint32_t unmap64(struct fastrpc_interface *iface,
+			uint64_t vadsp, int64_t len)
+{
+	struct {
+		uint64_t vadsp;
+		int64_t len;
+	} in = { .vadsp = vadsp, .len = len, };
+	struct fastrpc_io_buffer inbuf = { .s = sizeof(in), .p = &in, };
+
+	return iface->procs[3].impl(iface->data, &inbuf, NULL);
+}
+
+/*
+ * Small buffers come from the pool that is filled when the interface is
+ * created, and released buffers are reused, cleared, for the next request.
+ */
+static int test_pool(struct fastrpc_interface *iface)
+{
+	unsigned int allocs = n_allocs;
+	uint64_t vapps, vadsp, vapps2, vadsp2;
+	const char *ptr;
+
+	if (map64(iface, 3000, &vapps, &vadsp))
+		return 1;
+
+	if (n_allocs != allocs || n_maps != 1)
+		return 1;
+
+	// Fill the whole 4 KiB buffer, not only the requested part
+	memset((void *) (uintptr_t) vapps, 0xAA, 4096);
+
+	if (unmap64(iface, vadsp, 4096) != AEE_EBADPARM)
+		return 1;
+
+	if (unmap64(iface, vadsp, 3000) || n_unmaps != 1)
+		return 1;
+
+	if (map64(iface, 2000, &vapps2, &vadsp2))
+		return 1;
+
+	if (n_allocs != allocs || vapps2 != vapps || vadsp2 == vadsp)
+		return 1;
+
+	ptr = (const char *) (uintptr_t) vapps2;
+	if (ptr[0] != 0 || ptr[1999] != 0 || ptr[2999] != 0 || ptr[4095] != 0)
+		return 1;
+
+	return unmap64(iface, vadsp2, 2000);
+}
+
+// Buffers larger than the largest size class are allocated for each request
+static int test_large(struct fastrpc_interface *iface)
+{
+	unsigned int allocs = n_allocs;
+	uint64_t vapps, vadsp;
+
+	if (map64(iface, 32 << 20, &vapps, &vadsp))
+		return 1;
+
+	if (n_allocs != allocs + 1)
+		return 1;
+
+	if (unmap64(iface, vadsp, 32 << 20))
+		return 1;
+
+	if (map64(iface, 0, &vapps, &vadsp) != AEE_EBADPARM)
+		return 1;
+
+	return 0;
+}
+
+static int test_map32(struct fastrpc_interface *iface)
+{
+	struct {
+		int32_t heapid;
+		uint32_t lflags;
+		uint32_t rflags;
+		uint32_t vin;
+		int32_t len;
+	} map_in = { .len = 100000, };
+	uint32_t map_out[2];
+	struct {
+		uint32_t vadsp;
+		int32_t len;
+	} unmap_in = { .len = 100000, };
+	struct fastrpc_io_buffer inbuf = { .s = sizeof(map_in), .p = &map_in, };
+	struct fastrpc_io_buffer outbuf = { .s = sizeof(map_out), .p = map_out, };
+
+	if (iface->procs[0].impl(iface->data, &inbuf, &outbuf))
+		return 1;
+
+	unmap_in.vadsp = map_out[1];
+	inbuf.s = sizeof(unmap_in);
+	inbuf.p = &unmap_in;
+
+	return iface->procs[1].impl(iface->data, &inbuf, NULL);
+}
+
+int main(int argc, const char **argv)
+{
+	struct fastrpc_interface *iface;
+	int ret;
+
+	// Allocate from the fake device instead of a dma-buf heap
+	fastrpc_mem_set_heap(-1);
+
+	iface = fastrpc_apps_mem_init(42);
+	if (iface == NULL)
+		return 1;
+
+	ret = test_pool(iface);
+	if (!ret)
+		ret = test_large(iface);
+	if (!ret)
+		ret = test_map32(iface);
+
+	fastrpc_apps_mem_deinit(iface);
+
+	return ret;
+}
@@ -0,0 +1,462 @@
+/*
+ * FastRPC API Replacement - tests for the session broker
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <libhexagonrpc/broker.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/interfaces/remotectl.def>
+#include <libhexagonrpc/session.h>
+#include <misc/fastrpc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../hexagonrpcd/broker.h"
+
+#define TEST_HANDLE 5
+
+static const struct fastrpc_function_def_interp2 test_next2_def = {
+	.msg_id = 4,
+	.in_nums = 2,
+	.in_bufs = 1,
+	.out_nums = 4,
+	.out_bufs = 1,
+};
+
+static atomic_uint n_invokes;
+static atomic_int invoke_error;
+
+static atomic_uint n_remote_opens;
+static atomic_uint n_remote_closes;
+
+// Open and close any interface as TEST_HANDLE
+static int remote_ctl(const struct fastrpc_invoke *invoke)
+{
+	const struct fastrpc_invoke_args *args;
+	const uint32_t *inbuf;
+	uint32_t *outbuf;
+
+	args = (const struct fastrpc_invoke_args *) invoke->args;
+	inbuf = (const uint32_t *) args[0].ptr;
+
+	if (invoke->sc == REMOTE_SCALARS_MAKE(0, 2, 2)) {
+		outbuf = (uint32_t *) args[2].ptr;
+		outbuf[0] = TEST_HANDLE;
+		outbuf[1] = 0;
+		n_remote_opens++;
+		return 0;
+	}
+
+	if (invoke->sc == REMOTE_SCALARS_MAKE(1, 1, 2) && inbuf[0] == TEST_HANDLE) {
+		outbuf = (uint32_t *) args[1].ptr;
+		outbuf[0] = 0;
+		n_remote_closes++;
+		return 0;
+	}
+
+	invoke_error = 1;
+	return -1;
+}
+
+/*
+ * This replaces the ioctl() from the C library, acting as a remote processor
+ * that implements adsp_listener_next2 on any handle. Only the broker in this
+ * process should call it.
+ */
+int ioctl(int fd, unsigned long request, ...)
+{
+	const struct fastrpc_invoke *invoke;
+	const struct fastrpc_invoke_args *args;
+	const uint32_t *inbuf;
+	uint32_t *outbuf;
+	va_list va;
+
+	va_start(va, request);
+	invoke = (const struct fastrpc_invoke *) va_arg(va, __u64);
+	va_end(va);
+
+	if (fd == -1
+	 && request == FASTRPC_IOCTL_INVOKE
+	 && invoke->handle == REMOTECTL_HANDLE)
+		return remote_ctl(invoke);
+
+	n_invokes++;
+
+	if (fd != -1
+	 || request != FASTRPC_IOCTL_INVOKE
+	 || invoke->sc != REMOTE_SCALARS_MAKE(4, 2, 2)) {
+		invoke_error = 1;
+		return -1;
+	}
+
+	args = (const struct fastrpc_invoke_args *) invoke->args;
+	inbuf = (const uint32_t *) args[0].ptr;
+	outbuf = (uint32_t *) args[2].ptr;
+
+	if (args[0].length != 16
+	 || args[1].length != 5
+	 || args[2].length != 16
+	 || args[3].length != 8
+	 || inbuf[2] != 5
+	 || inbuf[3] != 8
+	 || memcmp((const void *) args[1].ptr, "abcd", 5)) {
+		invoke_error = 1;
+		return -1;
+	}
+
+	outbuf[0] = inbuf[0] + invoke->handle;
+	outbuf[1] = inbuf[1] + invoke->handle;
+	outbuf[2] = 0x1234;
+	outbuf[3] = 0x5678;
+	memcpy((void *) args[3].ptr, "efghijk", 8);
+
+	return 0;
+}
+
+static int call_next2(int fd, uint32_t handle)
+{
+	uint32_t outs[4];
+	char outbuf[8];
+	int ret;
+
+	ret = fastrpc2(&test_next2_def, fd, handle,
+		       10, 20,
+		       5, "abcd",
+		       &outs[0], &outs[1], &outs[2], &outs[3],
+		       8, outbuf);
+	if (ret)
+		return ret;
+
+	if (outs[0] != 10 + handle
+	 || outs[1] != 20 + handle
+	 || outs[2] != 0x1234
+	 || outs[3] != 0x5678
+	 || memcmp(outbuf, "efghijk", 8))
+		return 1;
+
+	return 0;
+}
+
+static int open_test_handle(int fd)
+{
+	char err[256] = "";
+	struct remotectl_open_args args = {
+		.in_bufs = { { .s = 5, .p = "test", }, },
+		.out_bufs = { { .s = sizeof(err), .p = err, }, },
+	};
+	int ret;
+
+	ret = remotectl_open_invoke(fd, REMOTECTL_HANDLE, &args);
+	if (ret || args.out_nums[1] || args.out_nums[0] != TEST_HANDLE)
+		return 1;
+
+	return 0;
+}
+
+static int close_test_handle(int fd)
+{
+	char err[256] = "";
+	struct remotectl_close_args args = {
+		.in_nums = { TEST_HANDLE, },
+		.out_bufs = { { .s = sizeof(err), .p = err, }, },
+	};
+
+	return remotectl_close_invoke(fd, REMOTECTL_HANDLE, &args);
+}
+
+static void *client_thread(void *data)
+{
+	int fd = *(int *) data;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		if (call_next2(fd, TEST_HANDLE))
+			return (void *) 1;
+	}
+
+	return NULL;
+}
+
+static int test_invoke(const char *path)
+{
+	int fd, ret;
+
+	fd = hexagonrpc_broker_connect(path);
+	if (fd == -1)
+		return 1;
+
+	ret = open_test_handle(fd)
+	   || call_next2(fd, TEST_HANDLE)
+	   || close_test_handle(fd);
+
+	hexagonrpc_broker_close(fd);
+
+	if (ret || invoke_error || n_invokes != 1)
+		return 1;
+
+	return 0;
+}
+
+static int test_concurrent(const char *path)
+{
+	pthread_t threads[8];
+	void *thread_ret;
+	int fds[2];
+	int ret = 0;
+	int i;
+
+	// Two clients, each shared by four threads
+	for (i = 0; i < 2; i++) {
+		fds[i] = hexagonrpc_broker_connect(path);
+		if (fds[i] == -1 || open_test_handle(fds[i]))
+			return 1;
+	}
+
+	for (i = 0; i < 8; i++) {
+		if (pthread_create(&threads[i], NULL, client_thread, &fds[i % 2]))
+			return 1;
+	}
+
+	for (i = 0; i < 8; i++) {
+		pthread_join(threads[i], &thread_ret);
+		if (thread_ret != NULL)
+			ret = 1;
+	}
+
+	for (i = 0; i < 2; i++)
+		hexagonrpc_broker_close(fds[i]);
+
+	if (invoke_error || n_invokes != 1 + 8 * 64)
+		return 1;
+
+	return ret;
+}
+
+static int test_rejected(const char *path)
+{
+	static char big[HEXAGONRPC_BROKER_SLOT_DATA + 1];
+	uint32_t outs[4];
+	char outbuf[8];
+	int fd, ret;
+
+	fd = hexagonrpc_broker_connect(path);
+	if (fd == -1 || open_test_handle(fd))
+		return 1;
+
+	// The listener handle of the reverse tunnel
+	ret = call_next2(fd, 3);
+	if (ret != -1 || errno != EPERM)
+		return 1;
+
+	ret = fastrpc2(&test_next2_def, fd, TEST_HANDLE,
+		       10, 20,
+		       sizeof(big), big,
+		       &outs[0], &outs[1], &outs[2], &outs[3],
+		       8, outbuf);
+	if (ret != -1 || errno != EMSGSIZE)
+		return 1;
+
+	// The connection is still usable
+	ret = call_next2(fd, TEST_HANDLE);
+
+	hexagonrpc_broker_close(fd);
+
+	return ret;
+}
+
+/*
+ * Clients can only use and close the handles they opened, and the handles
+ * they leave open are closed when they disconnect.
+ */
+static int test_ownership(const char *path)
+{
+	unsigned int prev_invokes = n_invokes;
+	unsigned int prev_closes;
+	int owner, other;
+	int i, ret;
+
+	owner = hexagonrpc_broker_connect(path);
+	other = hexagonrpc_broker_connect(path);
+	if (owner == -1 || other == -1)
+		return 1;
+
+	if (open_test_handle(owner))
+		return 1;
+
+	ret = call_next2(other, TEST_HANDLE);
+	if (ret != -1 || errno != EPERM)
+		return 1;
+
+	ret = close_test_handle(other);
+	if (ret != -1 || errno != EPERM)
+		return 1;
+
+	if (call_next2(owner, TEST_HANDLE) || n_invokes != prev_invokes + 1)
+		return 1;
+
+	prev_closes = n_remote_closes;
+
+	hexagonrpc_broker_close(other);
+	hexagonrpc_broker_close(owner);
+
+	// The broker notices the disconnect in the background
+	for (i = 0; i < 1000 && n_remote_closes == prev_closes; i++)
+		usleep(1000);
+
+	if (n_remote_closes != prev_closes + 1 || invoke_error)
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Connect without the library and submit a request whose buffers are outside
+ * of the slot.
+ */
+static int test_bad_request(const char *path)
+{
+	struct hexagonrpc_broker_shm *shm;
+	struct hexagonrpc_broker_slot *slot;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct sockaddr_un addr;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	char byte;
+	int sock, shm_fd;
+	unsigned int prev_invokes = n_invokes;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1)
+		return 1;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)))
+		return 1;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (recvmsg(sock, &msg, 0) != 1)
+		return 1;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+		return 1;
+
+	memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+
+	// The shared memory cannot be shrunk under the broker
+	if (!ftruncate(shm_fd, 4096))
+		return 1;
+
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE,
+		   MAP_SHARED, shm_fd, 0);
+	close(shm_fd);
+	if (shm == MAP_FAILED)
+		return 1;
+
+	slot = &shm->slots[0];
+	slot->handle = TEST_HANDLE;
+	slot->sc = REMOTE_SCALARS_MAKE(4, 2, 2);
+	slot->bufs[0].offset = 0;
+	slot->bufs[0].length = 16;
+	slot->bufs[1].offset = HEXAGONRPC_BROKER_SLOT_DATA - 4;
+	slot->bufs[1].length = 5;
+	slot->bufs[2].offset = 16;
+	slot->bufs[2].length = 16;
+	slot->bufs[3].offset = 0xffffffff;
+	slot->bufs[3].length = 8;
+
+	shm->sq.slots[0] = 0;
+	atomic_store(&shm->sq.head, 1);
+
+	if (send(sock, "", 1, 0) != 1 || recv(sock, &byte, 1, 0) != 1)
+		return 1;
+
+	if (atomic_load(&shm->cq.head) != 1
+	 || shm->cq.slots[0] != 0
+	 || slot->ret != -1
+	 || slot->err != EINVAL
+	 || n_invokes != prev_invokes)
+		return 1;
+
+	munmap(shm, sizeof(*shm));
+	close(sock);
+
+	return 0;
+}
+
+int main(int argc, const char **argv)
+{
+	char dir[] = "/tmp/hexagonrpc-test-XXXXXX";
+	char path[64];
+	int ret;
+
+	if (mkdtemp(dir) == NULL)
+		return 1;
+
+	snprintf(path, sizeof(path), "%s/broker", dir);
+
+	ret = broker_start(-1, path, 0600);
+	if (ret)
+		goto out;
+
+	ret = test_invoke(path);
+	if (ret)
+		goto out;
+
+	ret = test_concurrent(path);
+	if (ret)
+		goto out;
+
+	ret = test_rejected(path);
+	if (ret)
+		goto out;
+
+	ret = test_ownership(path);
+	if (ret)
+		goto out;
+
+	ret = test_bad_request(path);
+
+out:
+	unlink(path);
+	rmdir(dir);
+
+	return ret;
+}
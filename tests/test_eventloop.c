@@ -0,0 +1,174 @@
+/*
+ * Event loop - tests
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "../hexagonrpcd/eventloop.h"
+
+static unsigned int n_reads;
+static uint32_t timeout_events;
+
+static void on_pipe(struct event_loop *loop,
+		    struct event_source *src,
+		    uint32_t events,
+		    void *data)
+{
+	char c;
+
+	if (events & EPOLLIN && read(event_source_fd(src), &c, 1) == 1)
+		n_reads++;
+
+	event_source_remove(loop, src);
+}
+
+static void on_timeout(struct event_loop *loop,
+		       struct event_source *src,
+		       uint32_t events,
+		       void *data)
+{
+	timeout_events = events;
+
+	event_source_remove(loop, src);
+	event_loop_quit(loop, 42);
+}
+
+/*
+ * A ready file descriptor should be dispatched once before its handler
+ * removes it, and an idle one should time out.
+ */
+static int test_dispatch(void)
+{
+	struct event_loop *loop;
+	struct event_source *src;
+	int ready[2], idle[2];
+	int ret;
+
+	loop = event_loop_new();
+	if (loop == NULL || pipe(ready) || pipe(idle))
+		return 1;
+
+	if (event_loop_add(loop, ready[0], EPOLLIN, on_pipe, NULL) == NULL)
+		return 1;
+
+	src = event_loop_add(loop, idle[0], EPOLLIN, on_timeout, NULL);
+	if (src == NULL)
+		return 1;
+
+	event_source_set_timeout(src, 10);
+	timeout_events = 0xffffffff;
+
+	if (write(ready[1], "x", 1) != 1)
+		return 1;
+
+	ret = event_loop_run(loop);
+
+	event_loop_free(loop);
+	close(ready[0]);
+	close(ready[1]);
+	close(idle[0]);
+	close(idle[1]);
+
+	return ret != 42 || n_reads != 1 || timeout_events != 0;
+}
+
+static void respond(void *data, uid_t uid, const char *req, size_t len, FILE *out)
+{
+	fprintf(out, "%zu:%s", len, req);
+
+	event_loop_quit(data, 0);
+}
+
+static int request(struct event_loop *loop, const char *path,
+		   const char *req, const char *expected)
+{
+	struct sockaddr_un addr;
+	char reply[64];
+	ssize_t len;
+	int sock;
+
+	sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock == -1)
+		return 1;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)))
+		return 1;
+
+	if (req != NULL && send(sock, req, strlen(req), 0) == -1)
+		return 1;
+
+	if (event_loop_run(loop))
+		return 1;
+
+	len = recv(sock, reply, sizeof(reply) - 1, 0);
+	close(sock);
+
+	if (len < 0)
+		return 1;
+
+	reply[len] = '\0';
+
+	return strcmp(reply, expected) != 0;
+}
+
+/*
+ * Clients should get a response to what they send, or to an empty request
+ * if they send nothing before the timeout.
+ */
+static int test_serve(void)
+{
+	char path[] = "/tmp/test_eventloop_XXXXXX";
+	struct event_loop *loop;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return 1;
+
+	close(fd);
+
+	loop = event_loop_new();
+	if (loop == NULL || event_loop_serve(loop, path, 20, respond, loop))
+		return 1;
+
+	ret = request(loop, path, "status\n", "7:status\n")
+	   || request(loop, path, NULL, "0:");
+
+	event_loop_free(loop);
+	unlink(path);
+
+	return ret;
+}
+
+int main(int argc, const char **argv)
+{
+	return test_dispatch()
+	    || test_serve();
+}
@@ -0,0 +1,972 @@
+/*
+ * FastRPC API Replacement - tests for argument marshalling
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <errno.h>
+#include <libhexagonrpc/async.h>
+#include <libhexagonrpc/batch.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <libhexagonrpc/interface.h>
+#include <libhexagonrpc/interfaces/remotectl.def>
+#include <libhexagonrpc/mem.h>
+#include <libhexagonrpc/remotectl.h>
+#include <libhexagonrpc/stats.h>
+#include <linux/dma-heap.h>
+#include <misc/fastrpc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_HANDLE 3
+#define TEST_BLOCK_HANDLE 5
+#define TEST_BLOCK_CALLS 16
+#define TEST_HEAP 1000
+#define TEST_REMOTE_MEM 0x20000
+
+static const struct fastrpc_function_def_interp2 test_next2_def = {
+	.msg_id = 4,
+	.in_nums = 2,
+	.in_bufs = 1,
+	.out_nums = 4,
+	.out_bufs = 1,
+};
+
+HEXAGONRPC_DEFINE_REMOTE_STUB(4, test_next2, 2, 1, 4, 1)
+
+static const struct fastrpc_function_def_interp2 test_block_def = {
+	.msg_id = 0,
+};
+
+static atomic_uint n_invokes;
+static atomic_int invoke_error;
+
+// The file descriptors expected for the input and output buffers
+static atomic_int expect_in_fd = -1;
+static atomic_int expect_out_fd = -1;
+
+/*
+ * A memfd stands in for the dma-buf that a heap would allocate.
+ */
+static int alloc_dma_buf(struct dma_heap_allocation_data *data)
+{
+	int fd;
+
+	fd = memfd_create("dma-buf", MFD_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (ftruncate(fd, data->len)) {
+		close(fd);
+		return -1;
+	}
+
+	data->fd = fd;
+
+	return 0;
+}
+
+// The remote address space for mappings
+static uint64_t remote_next_addr = 0x10000000;
+static size_t remote_mapped;
+static unsigned int n_mmaps;
+
+static int remote_mmap(struct fastrpc_req_mmap *req)
+{
+	if (remote_mapped + req->size > TEST_REMOTE_MEM) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	req->vaddrout = remote_next_addr;
+
+	remote_next_addr += req->size;
+	remote_mapped += req->size;
+	n_mmaps++;
+
+	return 0;
+}
+
+static int remote_munmap(const struct fastrpc_req_munmap *req)
+{
+	remote_mapped -= req->size;
+
+	return 0;
+}
+
+static unsigned int n_remote_opens;
+static unsigned int n_remote_closes;
+
+static int remote_ctl(const struct fastrpc_invoke *invoke)
+{
+	const struct fastrpc_invoke_args *args;
+	uint32_t *outbuf;
+
+	args = (const struct fastrpc_invoke_args *) invoke->args;
+
+	if (invoke->sc == REMOTE_SCALARS_MAKE(0, 2, 2)) {
+		outbuf = (uint32_t *) args[2].ptr;
+
+		if (!strcmp((const char *) args[1].ptr, "missing")) {
+			strcpy((char *) args[3].ptr, "not found");
+			outbuf[1] = -5;
+			return 0;
+		}
+
+		n_remote_opens++;
+		outbuf[0] = 100 + n_remote_opens;
+		outbuf[1] = 0;
+	} else if (invoke->sc == REMOTE_SCALARS_MAKE(1, 1, 2)) {
+		outbuf = (uint32_t *) args[1].ptr;
+
+		n_remote_closes++;
+		outbuf[0] = 0;
+	} else {
+		invoke_error = 1;
+		return -1;
+	}
+
+	return 0;
+}
+
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t block_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int n_blocked;
+
+/*
+ * Block until TEST_BLOCK_CALLS calls are in flight at the same time, or fail
+ * after 5 seconds.
+ */
+static int remote_block(void)
+{
+	struct timespec deadline;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 5;
+
+	pthread_mutex_lock(&block_lock);
+
+	n_blocked++;
+	pthread_cond_broadcast(&block_cond);
+
+	while (n_blocked < TEST_BLOCK_CALLS && !ret)
+		ret = pthread_cond_timedwait(&block_cond, &block_lock, &deadline);
+
+	pthread_mutex_unlock(&block_lock);
+
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * This replaces the ioctl() from the C library, acting as a remote processor
+ * that implements adsp_listener_next2. It checks the marshalled arguments and
+ * fills the outputs with values derived from the inputs.
+ */
+int ioctl(int fd, unsigned long request, ...)
+{
+	const struct fastrpc_invoke *invoke;
+	const struct fastrpc_invoke_args *args;
+	const uint32_t *inbuf;
+	uint32_t *outbuf;
+	void *data;
+	va_list va;
+
+	va_start(va, request);
+	data = va_arg(va, void *);
+	va_end(va);
+
+	if (fd == TEST_HEAP && request == DMA_HEAP_IOCTL_ALLOC)
+		return alloc_dma_buf(data);
+
+	if (request == FASTRPC_IOCTL_MMAP)
+		return remote_mmap(data);
+
+	if (request == FASTRPC_IOCTL_MUNMAP)
+		return remote_munmap(data);
+
+	invoke = data;
+
+	if (request == FASTRPC_IOCTL_INVOKE && invoke->handle == REMOTECTL_HANDLE)
+		return remote_ctl(invoke);
+
+	if (request == FASTRPC_IOCTL_INVOKE && invoke->handle == TEST_BLOCK_HANDLE)
+		return remote_block();
+
+	n_invokes++;
+
+	if (request != FASTRPC_IOCTL_INVOKE
+	 || invoke->handle != TEST_HANDLE
+	 || invoke->sc != REMOTE_SCALARS_MAKE(4, 2, 2)) {
+		invoke_error = 1;
+		return -1;
+	}
+
+	args = (const struct fastrpc_invoke_args *) invoke->args;
+	inbuf = (const uint32_t *) args[0].ptr;
+	outbuf = (uint32_t *) args[2].ptr;
+
+	if (args[0].length != 16
+	 || args[1].length != 5
+	 || args[2].length != 16
+	 || args[3].length != 8
+	 || args[0].fd != -1
+	 || args[1].fd != expect_in_fd
+	 || args[2].fd != -1
+	 || args[3].fd != expect_out_fd
+	 || inbuf[2] != 5
+	 || inbuf[3] != 8
+	 || memcmp((const void *) args[1].ptr, "abcd", 5)) {
+		invoke_error = 1;
+		return -1;
+	}
+
+	outbuf[0] = inbuf[0] + 1;
+	outbuf[1] = inbuf[1] + 1;
+	outbuf[2] = 0x1234;
+	outbuf[3] = 0x5678;
+	memcpy((void *) args[3].ptr, "efghijk", 8);
+
+	return 0;
+}
+
+static int check_outputs(const uint32_t *outs, const char *outbuf)
+{
+	if (outs[0] != 11
+	 || outs[1] != 21
+	 || outs[2] != 0x1234
+	 || outs[3] != 0x5678)
+		return 1;
+
+	if (memcmp(outbuf, "efghijk", 8))
+		return 1;
+
+	return 0;
+}
+
+static int test_plan_layout(void)
+{
+	struct fastrpc_call_plan plan;
+
+	fastrpc_plan_init(&plan, &test_next2_def);
+
+	if (plan.sc != REMOTE_SCALARS_MAKE(4, 2, 2)
+	 || plan.in_count != 2
+	 || plan.out_count != 2
+	 || plan.inbuf_len != 16
+	 || plan.outbuf_len != 16
+	 || plan.scratch_len != 4 * sizeof(struct fastrpc_invoke_args) + 32)
+		return 1;
+
+	return 0;
+}
+
+static int test_plan_invoke(void)
+{
+	struct fastrpc_call_plan plan;
+	uint64_t scratch[32];
+	uint32_t outs[4];
+	char outbuf[8];
+	int ret;
+
+	fastrpc_plan_init(&plan, &test_next2_def);
+	if (plan.scratch_len > sizeof(scratch))
+		return 1;
+
+	ret = fastrpc_plan(&plan, scratch, -1, TEST_HANDLE,
+			   10, 20,
+			   5, "abcd",
+			   &outs[0], &outs[1], &outs[2], &outs[3],
+			   8, outbuf);
+	if (ret || invoke_error)
+		return 1;
+
+	return check_outputs(outs, outbuf);
+}
+
+static int test_fastrpc2(void)
+{
+	uint32_t outs[4];
+	char outbuf[8];
+	int ret;
+
+	ret = fastrpc2(&test_next2_def, -1, TEST_HANDLE,
+		       10, 20,
+		       5, "abcd",
+		       &outs[0], &outs[1], &outs[2], &outs[3],
+		       8, outbuf);
+	if (ret || invoke_error)
+		return 1;
+
+	return check_outputs(outs, outbuf);
+}
+
+static int test_array_invoke(void)
+{
+	static const uint32_t in_nums[] = { 10, 20, };
+	static const struct fastrpc_io_buffer in_bufs[] = {
+		{ .s = 5, .p = "abcd", },
+	};
+	uint32_t outs[4];
+	uint32_t *const out_nums[] = { &outs[0], &outs[1], &outs[2], &outs[3], };
+	char outbuf[8];
+	const struct fastrpc_io_buffer out_bufs[] = {
+		{ .s = 8, .p = outbuf, },
+	};
+	int ret;
+	int i;
+
+	// The same arrays should be usable for repeated calls
+	for (i = 0; i < 2; i++) {
+		memset(outs, 0, sizeof(outs));
+
+		ret = fastrpc2_array(&test_next2_def, -1, TEST_HANDLE,
+				     in_nums, in_bufs, out_nums, out_bufs);
+		if (ret || invoke_error)
+			return 1;
+
+		ret = check_outputs(outs, outbuf);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int test_stub_invoke(void)
+{
+	char outbuf[8];
+	struct test_next2_args args = {
+		.in_nums = { 10, 20, },
+		.in_bufs = { { .s = 5, .p = "abcd", }, },
+		.out_bufs = { { .s = 8, .p = outbuf, }, },
+	};
+	int ret;
+
+	ret = test_next2_invoke(-1, TEST_HANDLE, &args);
+	if (ret || invoke_error)
+		return 1;
+
+	return check_outputs(args.out_nums, outbuf);
+}
+
+static int test_batch(void)
+{
+	static const uint32_t in_nums[] = { 10, 20, };
+	static const struct fastrpc_io_buffer in_bufs[] = {
+		{ .s = 5, .p = "abcd", },
+	};
+	struct fastrpc_call calls[16];
+	struct fastrpc_io_buffer out_bufs[16];
+	uint32_t *out_nums[16][4];
+	uint32_t outs[16][4];
+	char outbuf[16][8];
+	size_t i, j;
+	int ret;
+
+	for (i = 0; i < 16; i++) {
+		for (j = 0; j < 4; j++)
+			out_nums[i][j] = &outs[i][j];
+
+		out_bufs[i].s = 8;
+		out_bufs[i].p = outbuf[i];
+
+		calls[i].def = &test_next2_def;
+		calls[i].handle = TEST_HANDLE;
+		calls[i].in_nums = in_nums;
+		calls[i].in_bufs = in_bufs;
+		calls[i].out_nums = out_nums[i];
+		calls[i].out_bufs = &out_bufs[i];
+	}
+
+	ret = fastrpc_batch(-1, 16, calls);
+	if (ret || invoke_error)
+		return 1;
+
+	for (i = 0; i < 16; i++) {
+		if (calls[i].ret || calls[i].err)
+			return 1;
+
+		ret = check_outputs(outs[i], outbuf[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int test_async(void)
+{
+	static const uint32_t in_nums[] = { 10, 20, };
+	static const struct fastrpc_io_buffer in_bufs[] = {
+		{ .s = 5, .p = "abcd", },
+	};
+	struct fastrpc_async_queue *queue;
+	struct fastrpc_call calls[8];
+	struct fastrpc_call *done;
+	struct fastrpc_io_buffer out_bufs[8];
+	struct pollfd pfd;
+	uint32_t *out_nums[8][4];
+	uint32_t outs[8][4];
+	char outbuf[8][8];
+	size_t n_done = 0;
+	size_t i, j;
+	int ret;
+
+	queue = fastrpc_async_queue_create(-1);
+	if (queue == NULL)
+		return 1;
+
+	for (i = 0; i < 8; i++) {
+		for (j = 0; j < 4; j++)
+			out_nums[i][j] = &outs[i][j];
+
+		out_bufs[i].s = 8;
+		out_bufs[i].p = outbuf[i];
+
+		calls[i].def = &test_next2_def;
+		calls[i].handle = TEST_HANDLE;
+		calls[i].in_nums = in_nums;
+		calls[i].in_bufs = in_bufs;
+		calls[i].out_nums = out_nums[i];
+		calls[i].out_bufs = &out_bufs[i];
+
+		ret = fastrpc_async_submit(queue, &calls[i]);
+		if (ret)
+			return 1;
+	}
+
+	pfd.fd = fastrpc_async_eventfd(queue);
+	pfd.events = POLLIN;
+
+	while (n_done < 8) {
+		ret = poll(&pfd, 1, 5000);
+		if (ret != 1)
+			return 1;
+
+		while ((done = fastrpc_async_collect(queue)) != NULL) {
+			i = done - calls;
+			if (i >= 8 || done->ret || done->err)
+				return 1;
+
+			ret = check_outputs(outs[i], outbuf[i]);
+			if (ret)
+				return ret;
+
+			n_done++;
+		}
+	}
+
+	// Every completion has been collected, so nothing should be pending
+	ret = poll(&pfd, 1, 0);
+	if (ret != 0)
+		return 1;
+
+	fastrpc_async_queue_destroy(queue);
+
+	return 0;
+}
+
+/*
+ * Asynchronous calls that do not return until many others are in flight must
+ * not be limited by the size of the batch pool.
+ */
+static int test_async_in_flight(void)
+{
+	struct fastrpc_async_queue *queue;
+	struct fastrpc_call calls[TEST_BLOCK_CALLS];
+	struct fastrpc_call *done;
+	struct pollfd pfd;
+	size_t n_done = 0;
+	size_t i;
+	int ret;
+
+	queue = fastrpc_async_queue_create(-1);
+	if (queue == NULL)
+		return 1;
+
+	for (i = 0; i < TEST_BLOCK_CALLS; i++) {
+		calls[i].def = &test_block_def;
+		calls[i].handle = TEST_BLOCK_HANDLE;
+		calls[i].in_nums = NULL;
+		calls[i].in_bufs = NULL;
+		calls[i].out_nums = NULL;
+		calls[i].out_bufs = NULL;
+
+		ret = fastrpc_async_submit(queue, &calls[i]);
+		if (ret)
+			return 1;
+	}
+
+	pfd.fd = fastrpc_async_eventfd(queue);
+	pfd.events = POLLIN;
+
+	while (n_done < TEST_BLOCK_CALLS) {
+		ret = poll(&pfd, 1, 10000);
+		if (ret != 1)
+			return 1;
+
+		while ((done = fastrpc_async_collect(queue)) != NULL) {
+			if (done->ret || done->err)
+				return 1;
+
+			n_done++;
+		}
+	}
+
+	fastrpc_async_queue_destroy(queue);
+
+	return 0;
+}
+
+static void *context_thread(void *data)
+{
+	const struct fastrpc_context *ctx = data;
+	uint32_t outs[4];
+	char outbuf[8];
+	int ret;
+	int i;
+
+	for (i = 0; i < 64; i++) {
+		ret = fastrpc(&test_next2_def, ctx,
+			      10, 20,
+			      5, "abcd",
+			      &outs[0], &outs[1], &outs[2], &outs[3],
+			      8, outbuf);
+		if (ret || check_outputs(outs, outbuf))
+			return (void *) 1;
+	}
+
+	return NULL;
+}
+
+static pthread_barrier_t context_barrier;
+
+// Keep the thread and its scratch memory alive until the context is destroyed
+static void *context_live_thread(void *data)
+{
+	void *ret;
+
+	ret = context_thread(data);
+
+	pthread_barrier_wait(&context_barrier);
+	pthread_barrier_wait(&context_barrier);
+
+	return ret;
+}
+
+static int test_context_mt(void)
+{
+	struct fastrpc_context *ctx;
+	pthread_t threads[4], live;
+	void *thread_ret;
+	int ret = 0;
+	int i;
+
+	ctx = fastrpc_create_context_mt(-1, TEST_HANDLE);
+	if (ctx == NULL)
+		return 1;
+
+	for (i = 0; i < 4; i++) {
+		if (pthread_create(&threads[i], NULL, context_thread, ctx))
+			return 1;
+	}
+
+	for (i = 0; i < 4; i++) {
+		pthread_join(threads[i], &thread_ret);
+		if (thread_ret != NULL)
+			ret = 1;
+	}
+
+	// The main thread still has no scratch memory of its own
+	if (context_thread(ctx) != NULL)
+		ret = 1;
+
+	pthread_barrier_init(&context_barrier, NULL, 2);
+
+	if (pthread_create(&live, NULL, context_live_thread, ctx))
+		return 1;
+
+	pthread_barrier_wait(&context_barrier);
+
+	fastrpc_destroy_context(ctx);
+
+	pthread_barrier_wait(&context_barrier);
+	pthread_join(live, &thread_ret);
+	if (thread_ret != NULL)
+		ret = 1;
+
+	pthread_barrier_destroy(&context_barrier);
+
+	if (invoke_error)
+		return 1;
+
+	return ret;
+}
+
+static int test_shared_buffers(void)
+{
+	struct fastrpc_call_plan plan;
+	struct test_next2_args args = {
+		.in_nums = { 10, 20, },
+		.in_bufs = { { .s = 5, .p = "abcd", }, },
+	};
+	char *inbuf, *outbuf;
+	uint32_t outs[4];
+	char local[8];
+	int ret = 1;
+
+	fastrpc_mem_set_heap(TEST_HEAP);
+	fastrpc_plan_init(&plan, &test_next2_def);
+
+	inbuf = fastrpc_mem_alloc(-1, 4096);
+	if (inbuf == NULL)
+		return 1;
+
+	outbuf = fastrpc_mem_alloc(-1, 8192);
+	if (outbuf == NULL)
+		goto err_free_in;
+
+	expect_in_fd = fastrpc_mem_fd(inbuf, 4096);
+	expect_out_fd = fastrpc_mem_fd(outbuf, 8192);
+	if (expect_in_fd == -1 || expect_out_fd == -1)
+		goto err;
+
+	// Ranges that leave the shared buffer must still be copied
+	if (fastrpc_mem_fd(inbuf + 4090, 7) != -1
+	 || fastrpc_mem_fd(local, sizeof(local)) != -1)
+		goto err;
+
+	// Arguments anywhere inside the buffer are passed by file descriptor
+	memcpy(inbuf + 100, "abcd", 5);
+	ret = fastrpc_plan(&plan, NULL, -1, TEST_HANDLE,
+			   10, 20,
+			   5, inbuf + 100,
+			   &outs[0], &outs[1], &outs[2], &outs[3],
+			   8, outbuf + 4096);
+	if (ret || invoke_error || check_outputs(outs, outbuf + 4096)) {
+		ret = 1;
+		goto err;
+	}
+
+	// Only the output buffer is shared here
+	expect_in_fd = -1;
+	args.out_bufs[0].s = 8;
+	args.out_bufs[0].p = outbuf;
+
+	ret = test_next2_invoke(-1, TEST_HANDLE, &args);
+	if (ret || invoke_error || check_outputs(args.out_nums, outbuf))
+		ret = 1;
+
+err:
+	expect_in_fd = -1;
+	expect_out_fd = -1;
+	fastrpc_mem_free(outbuf);
+err_free_in:
+	fastrpc_mem_free(inbuf);
+
+	if (fastrpc_mem_fd(inbuf, 1) != -1)
+		return 1;
+
+	return ret;
+}
+
+static int test_map_cache(void)
+{
+	struct fastrpc_map_cache *cache;
+	const char *a = (const char *) 0x1000;
+	const char *b = (const char *) 0x2000;
+	const char *c = (const char *) 0x3000;
+	const char *d = (const char *) 0x4000;
+	uint64_t raddr, raddr2;
+	void *buf;
+	int buf_fd;
+	int ret;
+
+	cache = fastrpc_map_cache_create(-1, 0, 0x10000);
+	if (cache == NULL)
+		return 1;
+
+	ret = fastrpc_map_cache_get(cache, 5, a, 0x4000, &raddr);
+	if (ret)
+		return 1;
+
+	// The same buffer is reused, while it is in use and after it is released
+	ret = fastrpc_map_cache_get(cache, 5, a, 0x4000, &raddr2);
+	if (ret || raddr2 != raddr)
+		return 1;
+
+	fastrpc_map_cache_put(cache, 5, a, 0x4000);
+	fastrpc_map_cache_put(cache, 5, a, 0x4000);
+
+	ret = fastrpc_map_cache_get(cache, 5, a, 0x4000, &raddr2);
+	if (ret || raddr2 != raddr || n_mmaps != 1)
+		return 1;
+
+	fastrpc_map_cache_put(cache, 5, a, 0x4000);
+
+	// Going over the limit unmaps the least recently used buffer
+	if (fastrpc_map_cache_get(cache, 5, b, 0x8000, &raddr)
+	 || fastrpc_map_cache_get(cache, 5, c, 0x8000, &raddr))
+		return 1;
+
+	fastrpc_map_cache_put(cache, 5, b, 0x8000);
+	fastrpc_map_cache_put(cache, 5, c, 0x8000);
+
+	if (n_mmaps != 3 || remote_mapped != 0x10000)
+		return 1;
+
+	// Running out of remote memory unmaps the released buffers
+	if (fastrpc_map_cache_get(cache, 5, c, 0x8000, &raddr)
+	 || fastrpc_map_cache_get(cache, 5, d, 0x18000, &raddr))
+		return 1;
+
+	if (n_mmaps != 4 || remote_mapped != 0x20000)
+		return 1;
+
+	fastrpc_map_cache_put(cache, 5, c, 0x8000);
+	fastrpc_map_cache_put(cache, 5, d, 0x18000);
+
+	fastrpc_map_cache_trim(cache);
+	if (remote_mapped != 0)
+		return 1;
+
+	// Freeing a buffer drops its mappings, and fails while they are in use
+	buf = fastrpc_mem_alloc(-1, 0x4000);
+	if (buf == NULL)
+		return 1;
+
+	buf_fd = fastrpc_mem_fd(buf, 0x4000);
+	if (fastrpc_map_cache_get(cache, buf_fd, buf, 0x4000, &raddr))
+		return 1;
+
+	if (fastrpc_mem_free(buf) != -1 || errno != EBUSY)
+		return 1;
+
+	fastrpc_map_cache_put(cache, buf_fd, buf, 0x4000);
+
+	if (fastrpc_mem_free(buf) || remote_mapped != 0)
+		return 1;
+
+	fastrpc_map_cache_destroy(cache);
+
+	return 0;
+}
+
+static const char *remotectl_error;
+
+static void remotectl_err(const char *err)
+{
+	remotectl_error = err;
+}
+
+static int test_remotectl(void)
+{
+	struct fastrpc_context *a1, *a2, *a3, *b;
+	int fd, other;
+	int ret;
+
+	ret = remotectl_open(-1, "a", &a1, remotectl_err);
+	if (ret)
+		return 1;
+
+	// The second user of an interface gets the same handle without opening
+	ret = remotectl_open(-1, "a", &a2, remotectl_err);
+	if (ret || a2->handle != a1->handle || n_remote_opens != 1)
+		return 1;
+
+	ret = remotectl_open(-1, "b", &b, remotectl_err);
+	if (ret || b->handle == a1->handle || n_remote_opens != 2)
+		return 1;
+
+	ret = remotectl_open(-1, "missing", &b, remotectl_err);
+	if (ret != -5 || remotectl_error == NULL
+	 || strcmp(remotectl_error, "not found"))
+		return 1;
+
+	// The handle is only closed by the last user
+	if (remotectl_close(a1, remotectl_err) || n_remote_closes != 0)
+		return 1;
+
+	if (remotectl_close(a2, remotectl_err) || n_remote_closes != 1)
+		return 1;
+
+	if (remotectl_close(b, remotectl_err) || n_remote_closes != 2)
+		return 1;
+
+	ret = remotectl_open(-1, "a", &a1, remotectl_err);
+	if (ret || n_remote_opens != 3)
+		return 1;
+
+	if (remotectl_close(a1, remotectl_err) || n_remote_closes != 3)
+		return 1;
+
+	// A file descriptor that was reused for another file has its own handles
+	fd = memfd_create("session", MFD_CLOEXEC);
+	other = memfd_create("session", MFD_CLOEXEC);
+	if (fd == -1 || other == -1)
+		return 1;
+
+	ret = remotectl_open(fd, "a", &a1, remotectl_err);
+	if (ret || n_remote_opens != 4)
+		return 1;
+
+	ret = remotectl_open(fd, "a", &a3, remotectl_err);
+	if (ret || n_remote_opens != 4)
+		return 1;
+
+	if (dup2(other, fd) == -1)
+		return 1;
+
+	close(other);
+
+	ret = remotectl_open(fd, "a", &a2, remotectl_err);
+	if (ret || n_remote_opens != 5)
+		return 1;
+
+	if (remotectl_close(a2, remotectl_err) || n_remote_closes != 4)
+		return 1;
+
+	// The handle of the old file is still only closed by its last user
+	if (remotectl_close(a1, remotectl_err) || n_remote_closes != 4)
+		return 1;
+
+	if (remotectl_close(a3, remotectl_err) || n_remote_closes != 5)
+		return 1;
+
+	close(fd);
+
+	if (invoke_error)
+		return 1;
+
+	return 0;
+}
+
+static int test_stats(void)
+{
+	struct fastrpc_method_stats stats[4];
+	const struct fastrpc_method_stats *next2 = NULL;
+	uint64_t n_bucketed = 0;
+	size_t i, n;
+
+	n = fastrpc_stats_snapshot(stats, 4);
+	if (n > 4)
+		return 1;
+
+	for (i = 0; i < n; i++) {
+		if (stats[i].handle == TEST_HANDLE && stats[i].msg_id == 4)
+			next2 = &stats[i];
+	}
+
+	if (next2 == NULL
+	 || next2->calls != n_invokes
+	 || next2->errors != 0
+	 || next2->arg_bytes_in != (16 + 5) * next2->calls
+	 || next2->arg_bytes_out != (16 + 8) * next2->calls)
+		return 1;
+
+	for (i = 0; i < FASTRPC_STATS_BUCKETS; i++)
+		n_bucketed += next2->buckets[i];
+
+	if (n_bucketed != next2->calls)
+		return 1;
+
+	fastrpc_stats_reset();
+
+	if (fastrpc_stats_snapshot(stats, 4) != 0)
+		return 1;
+
+	return 0;
+}
+
+int main(int argc, const char **argv)
+{
+	int ret;
+
+	ret = test_plan_layout();
+	if (ret)
+		return ret;
+
+	ret = test_plan_invoke();
+	if (ret)
+		return ret;
+
+	ret = test_fastrpc2();
+	if (ret)
+		return ret;
+
+	ret = test_array_invoke();
+	if (ret)
+		return ret;
+
+	ret = test_stub_invoke();
+	if (ret)
+		return ret;
+
+	ret = test_batch();
+	if (ret)
+		return ret;
+
+	ret = test_async();
+	if (ret)
+		return ret;
+
+	ret = test_context_mt();
+	if (ret)
+		return ret;
+
+	ret = test_shared_buffers();
+	if (ret)
+		return ret;
+
+	ret = test_map_cache();
+	if (ret)
+		return ret;
+
+	ret = test_remotectl();
+	if (ret)
+		return ret;
+
+	ret = test_stats();
+	if (ret)
+		return ret;
+
+	if (n_invokes != 31 + 6 * 64)
+		return 1;
+
+	ret = test_async_in_flight();
+	if (ret)
+		return ret;
+
+	return 0;
+}
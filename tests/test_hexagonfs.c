@@ -22,6 +22,7 @@
 #include <fcntl.h>
 #include <libhexagonrpc/fastrpc.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -30,7 +31,7 @@
 static int test_mapped_seq_read(const char *path)
 {
 	struct hexagonfs_fd file = {
-		.is_assigned = true,
+		.refs = 1,
 		.up = NULL,
 		.ops = &hexagonfs_mapped_ops,
 	};
@@ -83,6 +84,124 @@ static int test_mapped_seq_read(const char *path)
 	return 0;
 }
 
+static struct hexagonfs_tree *build_tree(const char *path)
+{
+	struct hexagonfs_dirent **root_list, **dir_list;
+	struct hexagonfs_dirent *root, *dir, *file;
+	struct hexagonfs_tree *tree;
+	char *phys;
+
+	tree = hexagonfs_tree_new();
+	if (tree == NULL)
+		return NULL;
+
+	root = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent));
+	dir = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent));
+	file = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent));
+	root_list = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent *) * 2);
+	dir_list = hexagonfs_tree_alloc(tree, sizeof(struct hexagonfs_dirent *) * 2);
+	phys = hexagonfs_tree_alloc(tree, strlen(path) + 1);
+	if (root == NULL || dir == NULL || file == NULL
+	 || root_list == NULL || dir_list == NULL || phys == NULL) {
+		hexagonfs_tree_put(tree);
+		return NULL;
+	}
+
+	strcpy(phys, path);
+
+	file->name = "sample";
+	file->ops = &hexagonfs_mapped_ops;
+	file->u.phys = phys;
+
+	dir_list[0] = file;
+	dir_list[1] = NULL;
+	dir->name = "dir";
+	dir->ops = &hexagonfs_virt_dir_ops;
+	dir->u.dir = dir_list;
+
+	root_list[0] = dir;
+	root_list[1] = NULL;
+	root->name = "/";
+	root->ops = &hexagonfs_virt_dir_ops;
+	root->u.dir = root_list;
+
+	tree->root = root;
+
+	return tree;
+}
+
+/*
+ * Replace the served tree while a file from the old tree is still open, and
+ * check that the file can still be read after the old tree is dropped.
+ */
+static int test_tree_replace(const char *path)
+{
+	struct hexagonfs_fd *fds[HEXAGONFS_MAX_FD] = { NULL };
+	struct hexagonfs_tree *tree;
+	char buf1[16], buf2[16];
+	int rootfd, fd, file, dirfd;
+
+	tree = build_tree(path);
+	if (tree == NULL)
+		return 1;
+
+	rootfd = hexagonfs_open_root(fds, tree);
+	hexagonfs_tree_put(tree);
+	if (rootfd < 0)
+		return 1;
+
+	file = hexagonfs_openat(fds, rootfd, rootfd, "/dir/sample");
+	if (file < 0)
+		return 1;
+
+	tree = build_tree(path);
+	if (tree == NULL)
+		return 1;
+
+	hexagonfs_close(fds, rootfd);
+	rootfd = hexagonfs_open_root(fds, tree);
+	hexagonfs_tree_put(tree);
+	if (rootfd < 0)
+		return 1;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+
+	if (read(fd, buf1, sizeof(buf1)) != sizeof(buf1))
+		return 1;
+
+	if (hexagonfs_read(fds, file, sizeof(buf2), buf2) != sizeof(buf2))
+		return 1;
+
+	if (memcmp(buf1, buf2, sizeof(buf1)))
+		return 1;
+
+	close(fd);
+
+	// Walking up from the old file reaches the root of the old tree
+	dirfd = hexagonfs_openat(fds, rootfd, file, "../..");
+	if (dirfd < 0)
+		return 1;
+
+	fd = hexagonfs_openat(fds, rootfd, dirfd, "dir/sample");
+	if (fd < 0)
+		return 1;
+
+	hexagonfs_close(fds, fd);
+
+	if (hexagonfs_close(fds, file))
+		return 1;
+
+	file = hexagonfs_openat(fds, rootfd, rootfd, "/dir/sample");
+	if (file < 0)
+		return 1;
+
+	hexagonfs_close_all(fds);
+
+	return 0;
+}
+
 int main(int argc, const char **argv)
 {
 	int ret;
@@ -94,5 +213,9 @@ int main(int argc, const char **argv)
 	if (ret)
 		return ret;
 
+	ret = test_tree_replace(argv[1]);
+	if (ret)
+		return ret;
+
 	return 0;
 }
@@ -20,6 +20,7 @@
  */
 
 #include <libhexagonrpc/fastrpc.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "../hexagonrpcd/iobuffer.h"
@@ -86,7 +87,7 @@ static int test_in_empty(void)
 	struct fastrpc_io_buffer *bufs;
 	int complete;
 
-	ctx = inbuf_decode_start(REMOTE_SCALARS_MAKE(1, 0, 2));
+	ctx = inbuf_decode_start(NULL, REMOTE_SCALARS_MAKE(1, 0, 2));
 	if (ctx == NULL)
 		return 1;
 
@@ -98,7 +99,7 @@ static int test_in_empty(void)
 
 	bufs = inbuf_decode_finish(ctx);
 
-	iobuf_free(0, bufs);
+	iobuf_free(NULL, 0, bufs);
 
 	return 0;
 }
@@ -111,7 +112,7 @@ static int test_in_normal(void)
 	size_t i;
 	int ret;
 
-	ctx = inbuf_decode_start(REMOTE_SCALARS_MAKE(1, 8, 2));
+	ctx = inbuf_decode_start(NULL, REMOTE_SCALARS_MAKE(1, 8, 2));
 	if (ctx == NULL)
 		return 1;
 
@@ -136,7 +137,109 @@ static int test_in_normal(void)
 			return 1;
 	}
 
-	iobuf_free(8, bufs);
+	iobuf_free(NULL, 8, bufs);
+
+	return 0;
+}
+
+static int test_in_arena(void)
+{
+	struct fastrpc_decoder_context *ctx;
+	struct fastrpc_io_buffer *bufs;
+	struct iobuf_arena *arena;
+	char *first, *second;
+	size_t i;
+	int ret;
+
+	arena = iobuf_arena_create(64);
+	if (arena == NULL)
+		return 1;
+
+	// Decoding needs more than one block
+	ctx = inbuf_decode_start(arena, REMOTE_SCALARS_MAKE(1, 8, 2));
+	if (ctx == NULL)
+		return 1;
+
+	inbuf_decode(ctx, sizeof(misaligned_iobufs), misaligned_iobufs);
+
+	if (!inbuf_decode_is_complete(ctx))
+		return 1;
+
+	bufs = inbuf_decode_finish(ctx);
+
+	for (i = 0; i < 8; i++) {
+		if (bufs[i].s != misaligned_decoded[i].s
+		 || (uintptr_t) bufs[i].p & 0x7)
+			return 1;
+
+		ret = memcmp(bufs[i].p, misaligned_decoded[i].p, misaligned_decoded[i].s);
+		if (ret)
+			return 1;
+	}
+
+	iobuf_free(arena, 8, bufs);
+
+	// After a reset, the blocks are merged into one that fits it all
+	iobuf_arena_reset(arena);
+
+	first = iobuf_alloc(arena, 3);
+	second = iobuf_alloc(arena, 200);
+	if (first == NULL || second != &first[8])
+		return 1;
+
+	iobuf_arena_destroy(arena);
+
+	return 0;
+}
+
+static int test_in_views(void)
+{
+	struct fastrpc_decoder_context *ctx;
+	struct fastrpc_io_buffer *bufs;
+	struct iobuf_arena *arena;
+	const unsigned char *src = misaligned_iobufs;
+	size_t i;
+	int ret;
+
+	arena = iobuf_arena_create(256);
+	if (arena == NULL)
+		return 1;
+
+	ctx = inbuf_decode_start(arena, REMOTE_SCALARS_MAKE(1, 8, 2));
+	if (ctx == NULL)
+		return 1;
+
+	// Split the source in the middle of inbuf 1
+	ret = inbuf_decode_views(ctx, 20, src);
+	if (ret)
+		return 1;
+
+	ret = inbuf_decode_views(ctx, sizeof(misaligned_iobufs) - 20, &src[20]);
+	if (ret)
+		return 1;
+
+	if (!inbuf_decode_is_complete(ctx))
+		return 1;
+
+	bufs = inbuf_decode_finish(ctx);
+
+	for (i = 0; i < 8; i++) {
+		if (bufs[i].s != misaligned_decoded[i].s)
+			return 1;
+
+		ret = memcmp(bufs[i].p, misaligned_decoded[i].p, misaligned_decoded[i].s);
+		if (ret)
+			return 1;
+	}
+
+	// Only the split buffer is copied
+	if (bufs[0].p != &src[8]
+	 || (bufs[1].p >= (void *) src
+	  && bufs[1].p < (void *) &src[sizeof(misaligned_iobufs)])
+	 || bufs[7].p != &src[sizeof(misaligned_iobufs) - 2])
+		return 1;
+
+	iobuf_arena_destroy(arena);
 
 	return 0;
 }
@@ -149,7 +252,7 @@ static int test_in_misaligned(void)
 	size_t i;
 	int ret;
 
-	ctx = inbuf_decode_start(REMOTE_SCALARS_MAKE(1, 8, 2));
+	ctx = inbuf_decode_start(NULL, REMOTE_SCALARS_MAKE(1, 8, 2));
 	if (ctx == NULL)
 		return 1;
 
@@ -176,7 +279,7 @@ static int test_in_misaligned(void)
 			return 1;
 	}
 
-	iobuf_free(8, bufs);
+	iobuf_free(NULL, 8, bufs);
 
 	return 0;
 }
@@ -219,6 +322,28 @@ static int test_out_misaligned(void)
 	return 0;
 }
 
+static int test_out_layout(void)
+{
+	struct fastrpc_io_buffer bufs[8];
+	unsigned char buf[sizeof(misaligned_iobufs)];
+	size_t i;
+	int ret;
+
+	for (i = 0; i < 8; i++)
+		bufs[i].s = misaligned_decoded[i].s;
+
+	outbufs_layout(8, bufs, buf);
+
+	for (i = 0; i < 8; i++)
+		memcpy(bufs[i].p, misaligned_decoded[i].p, bufs[i].s);
+
+	ret = memcmp(buf, misaligned_iobufs, sizeof(misaligned_iobufs));
+	if (ret)
+		return 1;
+
+	return 0;
+}
+
 int main(int argc, const char **argv)
 {
 	int ret;
@@ -231,6 +356,14 @@ int main(int argc, const char **argv)
 	if (ret)
 		return ret;
 
+	ret = test_in_arena();
+	if (ret)
+		return ret;
+
+	ret = test_in_views();
+	if (ret)
+		return ret;
+
 	ret = test_in_misaligned();
 	if (ret)
 		return ret;
@@ -243,5 +376,9 @@ int main(int argc, const char **argv)
 	if (ret)
 		return ret;
 
+	ret = test_out_layout();
+	if (ret)
+		return ret;
+
 	return 0;
 }
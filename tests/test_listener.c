@@ -0,0 +1,668 @@
+/*
+ * FastRPC reverse tunnel - tests for the listener loop
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <libhexagonrpc/fastrpc.h>
+#include <misc/fastrpc.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hexagonrpcd/capture.h"
+#include "../hexagonrpcd/iobuffer.h"
+#include "../hexagonrpcd/listener.h"
+#include "../hexagonrpcd/metrics.h"
+#include "../hexagonrpcd/recorder.h"
+
+#define MAX_REQUESTS 8
+
+/*
+ * The test interface has a method that receives a buffer and returns its
+ * length and the sum of its bytes, and a pair of methods where the first
+ * waits for the second to be called, which only succeeds if the requests are
+ * handled by different threads. The waiting method is also available as a
+ * deferred handler.
+ */
+static const struct fastrpc_function_def_interp2 test_sum_def = {
+	.msg_id = 0,
+	.in_nums = 0,
+	.in_bufs = 1,
+	.out_nums = 2,
+	.out_bufs = 0,
+};
+
+static const struct fastrpc_function_def_interp2 test_wait_def = {
+	.msg_id = 1,
+	.in_nums = 1,
+	.in_bufs = 0,
+	.out_nums = 0,
+	.out_bufs = 0,
+};
+
+static const struct fastrpc_function_def_interp2 test_signal_def = {
+	.msg_id = 2,
+	.in_nums = 1,
+	.in_bufs = 0,
+	.out_nums = 0,
+	.out_bufs = 0,
+};
+
+static const struct fastrpc_function_def_interp2 test_deferred_wait_def = {
+	.msg_id = 3,
+	.in_nums = 1,
+	.in_bufs = 0,
+	.out_nums = 0,
+	.out_bufs = 0,
+};
+
+/*
+ * The remote processor reports a request length that is off by len_error
+ * bytes in next2, and the real length in get_in_bufs2.
+ */
+struct test_request {
+	uint32_t method;
+	uint32_t len;
+	int32_t len_error;
+
+	char *buf;
+	uint32_t buf_len;
+};
+
+static pthread_mutex_t dsp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dsp_replied = PTHREAD_COND_INITIALIZER;
+
+static struct test_request requests[MAX_REQUESTS];
+static unsigned int n_script;
+static unsigned int n_requests;
+static unsigned int n_replies;
+static unsigned int n_fetches;
+static unsigned int n_callers;
+static unsigned int n_finished;
+static int dsp_error;
+
+static pthread_mutex_t signal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t signal_cond = PTHREAD_COND_INITIALIZER;
+static bool signalled;
+
+static uint32_t test_sum(void *data,
+			 const struct fastrpc_io_buffer *inbufs,
+			 struct fastrpc_io_buffer *outbufs)
+{
+	const unsigned char *buf = inbufs[1].p;
+	uint32_t *out = outbufs[0].p;
+	uint32_t i;
+
+	out[0] = inbufs[1].s;
+	out[1] = 0;
+
+	for (i = 0; i < inbufs[1].s; i++)
+		out[1] += buf[i];
+
+	return 0;
+}
+
+static uint32_t test_wait(void *data,
+			  const struct fastrpc_io_buffer *inbufs,
+			  struct fastrpc_io_buffer *outbufs)
+{
+	struct timespec deadline;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += 5;
+
+	pthread_mutex_lock(&signal_lock);
+
+	while (!signalled && !ret)
+		ret = pthread_cond_timedwait(&signal_cond, &signal_lock, &deadline);
+
+	pthread_mutex_unlock(&signal_lock);
+
+	return ret? 1: 0;
+}
+
+static uint32_t test_signal(void *data,
+			    const struct fastrpc_io_buffer *inbufs,
+			    struct fastrpc_io_buffer *outbufs)
+{
+	pthread_mutex_lock(&signal_lock);
+	signalled = true;
+	pthread_cond_broadcast(&signal_cond);
+	pthread_mutex_unlock(&signal_lock);
+
+	return 0;
+}
+
+static const struct fastrpc_function_impl test_procs[] = {
+	{ .def = &test_sum_def, .impl = test_sum, },
+	{ .def = &test_wait_def, .impl = test_wait, },
+	{ .def = &test_signal_def, .impl = test_signal, },
+	{ .def = &test_deferred_wait_def, .impl = test_wait, .deferred = true, },
+};
+
+static const struct fastrpc_interface test_interface = {
+	.name = "test",
+	.data = NULL,
+	.n_procs = 4,
+	.procs = test_procs,
+};
+
+static uint32_t expected_sum(uint32_t len)
+{
+	uint32_t i, sum = 0;
+
+	for (i = 0; i < len; i++)
+		sum += (unsigned char) (i * 7);
+
+	return sum;
+}
+
+/*
+ * Encode a request in the wire format, which is the same as the format of
+ * returned output buffers.
+ */
+static void make_request(struct test_request *req)
+{
+	struct fastrpc_io_buffer bufs[2];
+	uint32_t n_bufs = 1;
+	uint32_t i;
+
+	bufs[0].s = 4;
+	bufs[0].p = &req->len;
+
+	if (req->method == 0) {
+		bufs[1].s = req->len;
+		bufs[1].p = malloc(req->len);
+
+		for (i = 0; i < req->len; i++)
+			((unsigned char *) bufs[1].p)[i] = i * 7;
+
+		n_bufs = 2;
+	}
+
+	req->buf_len = outbufs_calculate_size(n_bufs, bufs);
+	req->buf = malloc(req->buf_len);
+	outbufs_encode(n_bufs, bufs, req->buf);
+
+	if (n_bufs == 2)
+		free(bufs[1].p);
+}
+
+static void check_reply(const struct fastrpc_invoke_args *args)
+{
+	const uint32_t *inbuf = (const uint32_t *) args[0].ptr;
+	const uint32_t *reply = (const uint32_t *) args[1].ptr;
+	const struct test_request *req;
+
+	if (inbuf[0] < 1 || inbuf[0] > n_requests || inbuf[1] != 0) {
+		dsp_error = 1;
+		return;
+	}
+
+	req = &requests[inbuf[0] - 1];
+
+	// The reply is a single 8-byte buffer after its size and padding
+	if (req->method == 0
+	 && (args[1].length != 16
+	  || reply[0] != 8
+	  || reply[2] != req->len
+	  || reply[3] != expected_sum(req->len)))
+		dsp_error = 1;
+
+	if (req->method != 0 && args[1].length != 0)
+		dsp_error = 1;
+
+	n_replies++;
+	pthread_cond_broadcast(&dsp_replied);
+}
+
+static int dsp_next2(const struct fastrpc_invoke_args *args)
+{
+	static __thread bool called;
+	const uint32_t *inbuf = (const uint32_t *) args[0].ptr;
+	uint32_t *outbuf = (uint32_t *) args[2].ptr;
+	const struct test_request *req;
+	uint32_t sc;
+
+	pthread_mutex_lock(&dsp_lock);
+
+	// Worker threads also call next2, and must leave it before the next test
+	if (!called) {
+		called = true;
+		n_callers++;
+	}
+
+	if (inbuf[0] != 0)
+		check_reply(args);
+
+	// Only stop the listener once every request has been answered
+	if (n_requests == n_script) {
+		while (n_replies < n_script)
+			pthread_cond_wait(&dsp_replied, &dsp_lock);
+
+		n_finished++;
+		pthread_mutex_unlock(&dsp_lock);
+
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	req = &requests[n_requests];
+	n_requests++;
+
+	if (req->method == 0)
+		sc = REMOTE_SCALARS_MAKE(0, 2, 1);
+	else
+		sc = REMOTE_SCALARS_MAKE(req->method, 1, 0);
+
+	outbuf[0] = n_requests;
+	outbuf[1] = 0;
+	outbuf[2] = sc;
+	outbuf[3] = req->buf_len + req->len_error;
+
+	memcpy((void *) args[3].ptr, req->buf,
+	       req->buf_len < args[3].length ? req->buf_len : args[3].length);
+
+	pthread_mutex_unlock(&dsp_lock);
+
+	return 0;
+}
+
+static int dsp_get_in_bufs2(const struct fastrpc_invoke_args *args)
+{
+	const uint32_t *inbuf = (const uint32_t *) args[0].ptr;
+	uint32_t *outbuf = (uint32_t *) args[1].ptr;
+	const struct test_request *req;
+	int ret = 0;
+
+	pthread_mutex_lock(&dsp_lock);
+
+	n_fetches++;
+
+	if (inbuf[0] < 1 || inbuf[0] > n_requests) {
+		dsp_error = 1;
+		ret = -1;
+		goto out;
+	}
+
+	req = &requests[inbuf[0] - 1];
+
+	// The listener asks for the rest of the length it was last told
+	if (inbuf[1] > req->buf_len
+	 || (inbuf[1] + args[2].length != req->buf_len
+	  && inbuf[1] + args[2].length != req->buf_len + req->len_error)) {
+		dsp_error = 1;
+		ret = -1;
+		goto out;
+	}
+
+	memcpy((void *) args[2].ptr, &req->buf[inbuf[1]],
+	       req->buf_len - inbuf[1] < args[2].length ?
+	       req->buf_len - inbuf[1] : args[2].length);
+	outbuf[0] = req->buf_len;
+
+out:
+	pthread_mutex_unlock(&dsp_lock);
+
+	return ret;
+}
+
+/*
+ * This replaces the ioctl() from the C library, acting as a remote processor
+ * that sends requests of increasing size through the listener interface.
+ */
+int ioctl(int fd, unsigned long request, ...)
+{
+	const struct fastrpc_invoke *invoke;
+	const struct fastrpc_invoke_args *args;
+	va_list va;
+
+	va_start(va, request);
+	invoke = (const struct fastrpc_invoke *) va_arg(va, __u64);
+	va_end(va);
+
+	args = (const struct fastrpc_invoke_args *) invoke->args;
+
+	if (invoke->handle != 3) {
+		dsp_error = 1;
+		return -1;
+	}
+
+	switch (invoke->sc) {
+		case REMOTE_SCALARS_MAKE(3, 0, 0):
+			return 0;
+		case REMOTE_SCALARS_MAKE(4, 2, 2):
+			return dsp_next2(args);
+		case REMOTE_SCALARS_MAKE(5, 1, 2):
+			return dsp_get_in_bufs2(args);
+		default:
+			dsp_error = 1;
+			return -1;
+	}
+}
+
+static int run_script(unsigned int n_threads,
+		      unsigned int n, const struct test_request *script)
+{
+	struct fastrpc_interface *ifaces[] = {
+		(struct fastrpc_interface *) &test_interface,
+	};
+	unsigned int i, finished, callers;
+	int ret;
+
+	n_script = n;
+	n_requests = 0;
+	n_replies = 0;
+	n_fetches = 0;
+	n_callers = 0;
+	n_finished = 0;
+	signalled = false;
+
+	for (i = 0; i < n; i++) {
+		requests[i] = script[i];
+		make_request(&requests[i]);
+	}
+
+	ret = run_fastrpc_listener(-1, n_threads, 1, ifaces);
+
+	/*
+	 * Let the other threads see the error before the requests go away. A
+	 * worker thread sends the reply to its deferred request through next2,
+	 * so every worker that may still be in next2 has called it by now.
+	 */
+	do {
+		pthread_mutex_lock(&dsp_lock);
+		finished = n_finished;
+		callers = n_callers;
+		pthread_mutex_unlock(&dsp_lock);
+	} while (finished < n_threads || finished < callers);
+
+	for (i = 0; i < n; i++)
+		free(requests[i].buf);
+
+	// The listener stops when the remote processor reports an error
+	if (ret != -1)
+		return 1;
+
+	if (dsp_error || n_requests != n || n_replies != n)
+		return 1;
+
+	return 0;
+}
+
+static int test_growing_requests(void)
+{
+	static const struct test_request script[] = {
+		{ .len = 10, }, { .len = 1000, }, { .len = 500, },
+		{ .len = 100000, }, { .len = 1000, },
+	};
+
+	if (run_script(1, 5, script))
+		return 1;
+
+	// Only requests larger than any before need to be fetched separately
+	return n_fetches != 2;
+}
+
+/*
+ * Every request handled so far should be in the flight recorder, with the
+ * handler stage carrying the request details.
+ */
+static int test_recorder(unsigned int n)
+{
+	const char *pos;
+	char *trace;
+	unsigned int count = 0;
+	off_t len;
+	FILE *f;
+
+	f = tmpfile();
+	if (f == NULL)
+		return 1;
+
+	recorder_dump(fileno(f));
+
+	len = lseek(fileno(f), 0, SEEK_END);
+	if (len <= 4)
+		return 1;
+
+	trace = calloc(1, len + 1);
+	if (trace == NULL || pread(fileno(f), trace, len, 0) != len)
+		return 1;
+
+	fclose(f);
+
+	for (pos = trace; (pos = strstr(pos, "\"name\":\"handler\"")) != NULL; pos++)
+		count++;
+
+	if (strncmp(trace, "{\"displayTimeUnit\"", 18)
+	 || strcmp(&trace[len - 4], "\n]}\n")
+	 || strstr(trace, "\"in_len\":100016,") == NULL)
+		count = 0;
+
+	free(trace);
+
+	return count != n;
+}
+
+/*
+ * Capture the requests, and check that replaying each request gives the
+ * captured reply.
+ */
+static int test_capture(void)
+{
+	static const struct test_request script[] = {
+		{ .len = 10, }, { .len = 3000, }, { .len = 20, },
+	};
+	struct fastrpc_interface *ifaces[] = {
+		(struct fastrpc_interface *) &test_interface,
+	};
+	char path[] = "/tmp/test_listener_capture_XXXXXX";
+	struct fastrpc_decoder_context *ctx;
+	struct fastrpc_io_buffer *decoded = NULL;
+	struct listener_reply reply = { .len = 0, .p = NULL, };
+	struct recorder_entry entry;
+	struct capture_record rec;
+	struct iobuf_arena *arena;
+	char *buf = NULL;
+	size_t buf_size = 0;
+	unsigned int n_reqs = 0, n_reps = 0;
+	uint32_t result;
+	FILE *f;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		return 1;
+
+	close(fd);
+
+	if (capture_start(path))
+		return 1;
+
+	ret = run_script(1, 3, script);
+	capture_stop();
+	if (ret)
+		return 1;
+
+	arena = iobuf_arena_create(64);
+	f = fopen(path, "rb");
+	unlink(path);
+	if (arena == NULL || f == NULL || capture_read_header(f))
+		return 1;
+
+	while (!(ret = capture_read(f, &rec, &buf, &buf_size))) {
+		if (rec.type == CAPTURE_REQUEST) {
+			if (rec.id != n_reqs + 1 || rec.sc != REMOTE_SCALARS_MAKE(0, 2, 1))
+				return 1;
+
+			iobuf_arena_reset(arena);
+
+			ctx = inbuf_decode_start(arena, rec.sc);
+			if (ctx == NULL || inbuf_decode(ctx, rec.len, buf))
+				return 1;
+
+			decoded = inbuf_decode_finish(ctx);
+
+			if (invoke_requested_procedure(arena, 1, ifaces,
+						       rec.handle, rec.sc,
+						       &result, decoded,
+						       &reply, &entry))
+				return 1;
+
+			n_reqs++;
+		} else {
+			if (rec.id != n_reqs
+			 || rec.result != result
+			 || rec.len != reply.len
+			 || memcmp(buf, reply.p, rec.len))
+				return 1;
+
+			n_reps++;
+		}
+	}
+
+	free(buf);
+	fclose(f);
+	iobuf_arena_destroy(arena);
+
+	return ret != 1 || n_reqs != 3 || n_reps != 3;
+}
+
+static int test_threads(void)
+{
+	static const struct test_request script[] = {
+		{ .method = 1, }, { .method = 2, }, { .len = 100000, },
+		{ .len = 10, }, { .len = 2000, },
+	};
+
+	return run_script(4, 5, script);
+}
+
+/*
+ * Every request handled by the listener loop should be counted under its
+ * interface and method, and have its stages timed.
+ */
+static int test_metrics(void)
+{
+	struct fastrpc_interface *ifaces[] = {
+		(struct fastrpc_interface *) &test_interface,
+	};
+	char *text = NULL;
+	size_t len = 0;
+	FILE *f;
+	int ret;
+
+	f = open_memstream(&text, &len);
+	if (f == NULL)
+		return 1;
+
+	metrics_write(f, 1, ifaces);
+	fclose(f);
+
+	ret = strstr(text, "hexagonrpcd_requests_total{interface=\"test\",method=\"0\"} 11\n") == NULL
+	   || strstr(text, "hexagonrpcd_requests_total{interface=\"test\",method=\"2\"} 1\n") == NULL
+	   || strstr(text, "hexagonrpcd_request_errors_total{interface=\"test\",method=\"0\"} 0\n") == NULL
+	   || strstr(text, "hexagonrpcd_stage_seconds_bucket{stage=\"handler\",le=\"+Inf\"} 13\n") == NULL
+	   || strstr(text, "hexagonrpcd_stage_seconds_count{stage=\"wait\"} 13\n") == NULL;
+
+	free(text);
+
+	return ret;
+}
+
+/*
+ * A single listener thread should keep receiving requests while a deferred
+ * handler waits for one of them.
+ */
+static int test_deferred(void)
+{
+	static const struct test_request script[] = {
+		{ .method = 3, }, { .len = 10, }, { .method = 2, },
+		{ .len = 3000, },
+	};
+
+	return run_script(1, 4, script);
+}
+
+/*
+ * A request that is longer than first reported should be fetched until it is
+ * complete.
+ */
+static int test_longer_request(void)
+{
+	static const struct test_request script[] = {
+		{ .len = 100000, .len_error = -50000, },
+	};
+
+	if (run_script(1, 1, script))
+		return 1;
+
+	return n_fetches != 2;
+}
+
+/*
+ * A request that is shorter than first reported should stop the listener
+ * instead of being handled.
+ */
+static int test_short_request(void)
+{
+	static const struct test_request script[] = {
+		{ .len = 1000, .len_error = 16, },
+	};
+	struct fastrpc_interface *ifaces[] = {
+		(struct fastrpc_interface *) &test_interface,
+	};
+	int ret;
+
+	n_script = 1;
+	n_requests = 0;
+	n_replies = 0;
+	n_fetches = 0;
+
+	requests[0] = script[0];
+	make_request(&requests[0]);
+
+	ret = run_fastrpc_listener(-1, 1, 1, ifaces);
+
+	free(requests[0].buf);
+
+	return ret != -1 || dsp_error || n_fetches != 1 || n_replies != 0;
+}
+
+int main(int argc, const char **argv)
+{
+	return test_growing_requests()
+	    || test_recorder(5)
+	    || test_capture()
+	    || test_threads()
+	    || test_recorder(13)
+	    || test_metrics()
+	    || test_deferred()
+	    || test_longer_request()
+	    || test_short_request();
+}
@@ -0,0 +1,48 @@
+/*
+ * FastRPC reverse tunnel - interface module for the registry tests
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "../hexagonrpcd/listener.h"
+
+static int n_instances;
+
+struct fastrpc_interface *fastrpc_module_init(void)
+{
+	struct fastrpc_interface *iface;
+
+	iface = calloc(1, sizeof(*iface));
+	if (iface == NULL)
+		return NULL;
+
+	iface->name = "test_module";
+	iface->data = &n_instances;
+
+	n_instances++;
+
+	return iface;
+}
+
+void fastrpc_module_deinit(struct fastrpc_interface *iface)
+{
+	n_instances--;
+	free(iface);
+}
@@ -0,0 +1,131 @@
+/*
+ * FastRPC reverse tunnel - tests for the interface registry
+ *
+ * Copyright (C) 2024 The HexagonRPC Contributors
+ *
+ * This file is part of HexagonRPC.
+ *
+ * HexagonRPC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../hexagonrpcd/listener.h"
+#include "../hexagonrpcd/registry.h"
+
+#define N_IFACES 100
+
+static struct fastrpc_interface ifaces[N_IFACES];
+static char names[N_IFACES][16];
+static unsigned int n_deinits;
+
+static void deinit_iface(struct fastrpc_interface *iface)
+{
+	n_deinits++;
+}
+
+static int test_lookup(void)
+{
+	struct fastrpc_interface **list;
+	struct fastrpc_registry *reg;
+	struct fastrpc_interface dup = { .name = "iface42", };
+	size_t n;
+	int i;
+
+	reg = fastrpc_registry_new();
+	if (reg == NULL)
+		return 1;
+
+	// Enough interfaces to grow the index several times
+	for (i = 0; i < N_IFACES; i++) {
+		snprintf(names[i], sizeof(names[i]), "iface%d", i);
+		ifaces[i].name = names[i];
+
+		if (fastrpc_registry_add(reg, &ifaces[i], deinit_iface) != i)
+			return 1;
+	}
+
+	// Duplicate names are rejected and the interface is given back
+	if (fastrpc_registry_add(reg, &dup, deinit_iface) != -1
+	 || n_deinits != 1)
+		return 1;
+
+	for (i = 0; i < N_IFACES; i++) {
+		if (fastrpc_registry_find(reg, names[i]) != i)
+			return 1;
+	}
+
+	if (fastrpc_registry_find(reg, "iface100") != -1
+	 || fastrpc_registry_find(reg, "") != -1)
+		return 1;
+
+	list = fastrpc_registry_ifaces(reg, &n);
+	if (n != N_IFACES || list[42] != &ifaces[42])
+		return 1;
+
+	fastrpc_registry_free(reg);
+
+	return n_deinits != N_IFACES + 1;
+}
+
+static int test_load(const char *path)
+{
+	struct fastrpc_interface **list;
+	struct fastrpc_registry *reg;
+	int *n_instances;
+	size_t n;
+	int handle;
+
+	reg = fastrpc_registry_new();
+	if (reg == NULL)
+		return 1;
+
+	if (fastrpc_registry_add(reg, &ifaces[0], NULL) != 0)
+		return 1;
+
+	handle = fastrpc_registry_load(reg, path);
+	if (handle != 1)
+		return 1;
+
+	if (fastrpc_registry_find(reg, "test_module") != handle)
+		return 1;
+
+	list = fastrpc_registry_ifaces(reg, &n);
+	n_instances = list[handle]->data;
+	if (n != 2 || *n_instances != 1)
+		return 1;
+
+	// A second instance of the same interface is refused and freed
+	if (fastrpc_registry_load(reg, path) != -1 || *n_instances != 1)
+		return 1;
+
+	if (fastrpc_registry_load(reg, "/nonexistent/module.so") != -1)
+		return 1;
+
+	fastrpc_registry_free(reg);
+
+	return 0;
+}
+
+int main(int argc, const char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s MODULE\n", argv[0]);
+		return 1;
+	}
+
+	return test_lookup()
+	    || test_load(argv[1]);
+}